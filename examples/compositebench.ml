@@ -0,0 +1,82 @@
+(* Alpha compositing: Draw.composite against SDL's per-pixel alpha blit_surface.
+   Usage: compositebench [layers] [frames]
+   Composites layers of 256x256 translucent RGBA surfaces onto a 640x480 RGBA surface,
+   both ways on the same inputs, and prints the time per frame and how far apart the
+   two results are. *)
+
+open Sdl
+open Video
+open Draw
+
+let width = 640
+let height = 480
+let size = 256
+
+let layers = if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1) else 16
+let frames = if Array.length Sys.argv > 2 then int_of_string Sys.argv.(2) else 100
+
+(* a radial alpha falloff in a different colour for every layer *)
+let make_layer i =
+  let s = create_rgb_surface [SWSURFACE] size size 32 in
+  set_alpha s [SRCALPHA] 255;
+  let row = make_pixel_span size in
+  for y = 0 to size - 1 do
+    for x = 0 to size - 1 do
+      let dx = x - size / 2 and dy = y - size / 2 in
+      let d = int_of_float (sqrt (float_of_int (dx * dx + dy * dy))) in
+      let a = if d >= size / 2 then 0 else 255 - d * 2 in
+      row.{x} <- map_rgba s (i * 53 land 255) (i * 97 land 255) (255 - i * 31 land 255) a
+    done;
+    write_pixels s 0 y size 1 row
+  done;
+  s
+
+let position i = (i * 37) mod (width - size / 2) - size / 4, (i * 59) mod (height - size / 2) - size / 4
+
+let time f =
+  let start = Unix.gettimeofday () in
+  for _i = 1 to frames do f () done;
+  (Unix.gettimeofday () -. start) *. 1000.0 /. float_of_int frames
+
+let largest_difference a b =
+  let ra = make_pixel_span width and rb = make_pixel_span width in
+  let worst = ref 0 in
+  for y = 0 to height - 1 do
+    read_pixels a 0 y width 1 ra;
+    read_pixels b 0 y width 1 rb;
+    for x = 0 to width - 1 do
+      let (r, g, b', _) = get_rgba a ra.{x} and (r', g', b'', _) = get_rgba b rb.{x} in
+      worst := max !worst (max (abs (r - r')) (max (abs (g - g')) (abs (b' - b''))))
+    done
+  done;
+  !worst
+
+let main () =
+  let layer = Array.init layers make_layer in
+  let by_sdl = create_rgb_surface [SWSURFACE] width height 32
+  and by_composite = create_rgb_surface [SWSURFACE] width height 32 in
+  let background s = fill_surface s (map_rgba s 40 40 60 255) in
+  let sdl () =
+    background by_sdl;
+    Array.iteri (fun i l ->
+      let x, y = position i in
+      blit_surface l None by_sdl (Some { rect_x = x; rect_y = y; rect_w = size; rect_h = size })) layer
+  and native mode opacity () =
+    background by_composite;
+    Array.iteri (fun i l -> let x, y = position i in composite l None by_composite x y mode opacity) layer
+  in
+  let t_sdl = time sdl in
+  Printf.printf "%d layers of %dx%d on %dx%d\n" layers size size width height;
+  Printf.printf "blit_surface (SRCALPHA)    %8.3f ms/frame\n%!" t_sdl;
+  List.iter (fun (name, mode, opacity) ->
+    Printf.printf "composite %-16s %8.3f ms/frame\n%!" name (time (native mode opacity)))
+    [ "over", BLEND_OVER, 255; "over 50%", BLEND_OVER, 128; "add", BLEND_ADD, 255;
+      "multiply", BLEND_MULTIPLY, 255; "premultiplied", BLEND_PREMULTIPLIED, 255 ];
+  sdl ();
+  native BLEND_OVER 255 ();
+  Printf.printf "largest colour difference, over: %d\n" (largest_difference by_sdl by_composite);
+  Array.iter free_surface layer;
+  free_surface by_sdl;
+  free_surface by_composite
+
+let _ = main ()
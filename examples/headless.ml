@@ -0,0 +1,58 @@
+(* Renders a scene offscreen and times it, for machines without a display.
+   Needs glwin built with HEADLESS=egl.
+   Usage: headless [width] [height] [frames]
+   Prints the time per frame and a checksum of the last frame. *)
+
+open Glcaml
+
+let width = if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1) else 640
+let height = if Array.length Sys.argv > 2 then int_of_string Sys.argv.(2) else 480
+let frames = if Array.length Sys.argv > 3 then int_of_string Sys.argv.(3) else 300
+
+(* a ring of coloured triangles, rotated a little further every frame *)
+let draw frame =
+  glClear (gl_color_buffer_bit lor gl_depth_buffer_bit);
+  glLoadIdentity ();
+  glTranslatef 0.0 0.0 (-3.0);
+  glRotatef (float_of_int frame) 0.3 1.0 0.0;
+  glBegin gl_triangles;
+  for i = 0 to 63 do
+    let a = float_of_int i *. 6.2831853 /. 64.0 in
+    let b = a +. 6.2831853 /. 64.0 in
+    glColor3f (0.5 +. 0.5 *. cos a) (0.5 +. 0.5 *. sin a) 0.5;
+    glVertex3f 0.0 0.0 0.5;
+    glVertex3f (cos a) (sin a) 0.0;
+    glVertex3f (cos b) (sin b) 0.0
+  done;
+  glEnd ()
+
+let checksum () =
+  let pixels = make_ubyte_array (width * height * 4) in
+  glReadPixels 0 0 width height gl_rgba gl_unsigned_byte pixels;
+  let sum = ref 0 in
+  for i = 0 to width * height * 4 - 1 do
+    sum := (!sum * 31 + pixels.{i}) land 0x3fffffff
+  done;
+  !sum
+
+let main () =
+  Win.init_headless width height;
+  Printf.printf "backend %s, renderer %s\n%!" Win.headless_backend (glGetString gl_renderer);
+  glEnable gl_depth_test;
+  glMatrixMode gl_projection;
+  glLoadIdentity ();
+  glFrustum (-1.0) 1.0 (-. float_of_int height /. float_of_int width)
+    (float_of_int height /. float_of_int width) 1.0 10.0;
+  glMatrixMode gl_modelview;
+  glClearColor 0.1 0.1 0.2 1.0;
+  let start = Unix.gettimeofday () in
+  for frame = 1 to frames do
+    draw frame;
+    Win.swap_buffers ()
+  done;
+  let seconds = Unix.gettimeofday () -. start in
+  Printf.printf "%dx%d, %d frames: %.3f ms/frame\n" width height frames
+    (seconds *. 1000.0 /. float_of_int frames);
+  Printf.printf "checksum %08x\n" (checksum ())
+
+let _ = main ()
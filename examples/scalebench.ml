@@ -0,0 +1,141 @@
+(* Image scaling: Draw.scale_to against the per-pixel OCaml resampler it replaced.
+   Usage: scalebench [size]
+   Scales a size x size RGBA surface to half and to one and a half times its size
+   with every filter, and the old path only to half size with box, triangle and lanczos3. *)
+
+open Sdl
+open Video
+open Draw
+
+let size = if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1) else 512
+
+let filters = [
+  "box", box; "triangle", triangle; "bell", bell; "bspline", bspline;
+  "hermite", hermite; "mitchell", mitchell; "lanczos3", lanczos3 ]
+
+(* the OCaml resampler: a square kernel applied through get_pixel and get_rgba *)
+module Old = struct
+
+  let normalize a =
+    let total = ref 0.0 in
+    let dim = Array.length a.(0) in
+    for i = 0 to dim - 1 do
+      for j = 0 to dim - 1 do total := !total +. a.(i).(j) done
+    done;
+    for i = 0 to dim - 1 do
+      for j = 0 to dim - 1 do a.(i).(j) <- a.(i).(j) /. !total done
+    done;
+    a
+
+  let dist x y dim =
+    let x2 = float_of_int x -. float_of_int dim /. 2.0
+    and y2 = float_of_int y -. float_of_int dim /. 2.0 in
+    sqrt (x2 *. x2 +. y2 *. y2)
+
+  let box_filter dim = normalize (Array.make_matrix dim dim 1.0)
+
+  let tent_filter dim =
+    let t = dist dim dim dim in
+    let f x = (t -. abs_float x) /. t in
+    let a = Array.make_matrix (dim + 1) (dim + 1) 0.0 in
+    for i = 0 to dim do
+      for j = 0 to dim do a.(i).(j) <- f (dist i j dim) done
+    done;
+    normalize a
+
+  let lanczos3_filter dim =
+    let f x =
+      if abs_float x > 3.0 then 0.0 else
+      let pi = 4.0 *. atan 1.0 in
+      let pix' = pi *. x in
+      let pix = if abs_float pix' > 0.1 then pix' else 0.1 in
+      let pix3 = pix /. 3.0 in
+      (sin pix /. pix) *. (sin pix3 /. pix3)
+    in
+    let a = Array.make_matrix (dim + 1) (dim + 1) 0.0 in
+    let dim2 = dist dim dim dim in
+    for i = 0 to dim do
+      for j = 0 to dim do a.(i).(j) <- f (dist i j dim *. 3.0 /. dim2) done
+    done;
+    normalize a
+
+  let create_filter filter dim =
+    if filter = box then box_filter dim
+    else if filter = triangle then tent_filter dim
+    else lanczos3_filter (dim + 4)
+
+  let round f = int_of_float (f +. 0.5)
+
+  let pixel_round f =
+    let c = round f in
+    if c > 255 then 255 else if c < 0 then 0 else c
+
+  let convolute kernel s x y =
+    let r = ref 0.0 and g = ref 0.0 and b = ref 0.0 and a = ref 0.0 in
+    let h = surface_height s and w = surface_width s in
+    let len = Array.length kernel.(0) in
+    let halflen = len / 2 in
+    for i = x + halflen - len + 1 to x + halflen do
+      for j = y + halflen - len + 1 to y + halflen do
+        let k = i - (x + halflen - len + 1) in
+        let l = j - (y + halflen - len + 1) in
+        let x' = if i >= 0 then (if i < w then i else w - 1) else 0 in
+        let y' = if j >= 0 then (if j < h then j else h - 1) else 0 in
+        let (r', g', b', a') = get_rgba s (get_pixel s x' y') in
+        r := !r +. float_of_int r' *. kernel.(k).(l);
+        g := !g +. float_of_int g' *. kernel.(k).(l);
+        b := !b +. float_of_int b' *. kernel.(k).(l);
+        a := !a +. float_of_int a' *. kernel.(k).(l)
+      done
+    done;
+    map_rgba s (pixel_round !r) (pixel_round !g) (pixel_round !b) (pixel_round !a)
+
+  let scale_to s w h filter =
+    let t = create_rgb_surface [SWSURFACE] w h (surface_bpp s) in
+    let fw = float_of_int (surface_width s) /. float_of_int w
+    and fh = float_of_int (surface_height s) /. float_of_int h in
+    let dim = if fw > 1.0 then fw else 1.0 /. fw in
+    let filter' = create_filter filter (round dim) in
+    for i = 0 to w - 1 do
+      for j = 0 to h - 1 do
+        let si = float_of_int i *. fw and sj = float_of_int j *. fh in
+        put_pixel t i j (convolute filter' s (int_of_float si) (int_of_float sj))
+      done
+    done;
+    t
+
+end
+
+(* colour gradients with a checker pattern on top, so that filters make a difference *)
+let make_source () =
+  let s = create_rgb_surface [SWSURFACE] size size 32 in
+  for y = 0 to size - 1 do
+    for x = 0 to size - 1 do
+      let c = if (x / 8 + y / 8) land 1 = 0 then 255 else 0 in
+      put_pixel s x y (map_rgba s (x * 255 / size) (y * 255 / size) c 255)
+    done
+  done;
+  s
+
+let time f =
+  let start = Unix.gettimeofday () in
+  let r = f () in
+  (Unix.gettimeofday () -. start) *. 1000.0, r
+
+let main () =
+  let src = make_source () in
+  let half = size / 2 and larger = size * 3 / 2 in
+  List.iter (fun (name, filter) ->
+    let down, t1 = time (fun () -> scale_to src half half filter) in
+    let up, t2 = time (fun () -> scale_to src larger larger filter) in
+    free_surface t1;
+    free_surface t2;
+    Printf.printf "native %-9s %dx%d: %8.2f ms, %dx%d: %8.2f ms\n%!" name half half down larger larger up) filters;
+  List.iter (fun (name, filter) ->
+    let down, t = time (fun () -> Old.scale_to src half half filter) in
+    free_surface t;
+    Printf.printf "ocaml  %-9s %dx%d: %8.2f ms\n%!" name half half down)
+    [ "box", box; "triangle", triangle; "lanczos3", lanczos3 ];
+  free_surface src
+
+let _ = main ()
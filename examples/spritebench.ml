@@ -0,0 +1,129 @@
+(* Sprite throughput: immediate mode quads against Glsprite batches.
+   Usage: spritebench [sprites] [frames] *)
+
+open Sdl
+open Video
+open Window
+open Timer
+open SDLGL
+open Glcaml
+
+let width = 800
+let height = 600
+let texture_count = 4
+
+let sprites = if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1) else 10000
+let frames = if Array.length Sys.argv > 2 then int_of_string Sys.argv.(2) else 200
+
+(* small checkered textures, each in another colour *)
+let make_textures () =
+  let names = Array.make texture_count 0 in
+  glGenTextures texture_count names;
+  let image = make_ubyte_array (16 * 16 * 4) in
+  Array.iteri (fun t name ->
+    for i = 0 to 16 * 16 - 1 do
+      let on = ((i / 16) lxor (i mod 16)) land 4 = 0 in
+      image.{i * 4} <- if on && t land 1 = 0 then 255 else 64;
+      image.{i * 4 + 1} <- if on && t land 2 = 0 then 255 else 64;
+      image.{i * 4 + 2} <- if on then 255 else 64;
+      image.{i * 4 + 3} <- 255
+    done;
+    glBindTexture gl_texture_2d name;
+    glTexParameteri gl_texture_2d gl_texture_mag_filter gl_nearest;
+    glTexParameteri gl_texture_2d gl_texture_min_filter gl_nearest;
+    glTexImage2D gl_texture_2d 0 gl_rgba 16 16 0 gl_rgba gl_unsigned_byte image) names;
+  names
+
+type particle = {
+  mutable px : float;
+  mutable py : float;
+  mutable vx : float;
+  mutable vy : float;
+  mutable angle : float;
+  texture : int;
+}
+
+let make_particles textures =
+  Array.init sprites (fun _ -> {
+    px = Random.float (float_of_int width);
+    py = Random.float (float_of_int height);
+    vx = Random.float 2.0 -. 1.0;
+    vy = Random.float 2.0 -. 1.0;
+    angle = Random.float 6.28;
+    texture = textures.(Random.int texture_count) })
+
+let move p =
+  p.px <- p.px +. p.vx;
+  p.py <- p.py +. p.vy;
+  if p.px < 0.0 || p.px > float_of_int width then p.vx <- -. p.vx;
+  if p.py < 0.0 || p.py > float_of_int height then p.vy <- -. p.vy;
+  p.angle <- p.angle +. 0.01
+
+let size = 16.0
+
+let draw_immediate particles =
+  Array.iter (fun p ->
+    let c = cos p.angle *. size /. 2.0 and s = sin p.angle *. size /. 2.0 in
+    glBindTexture gl_texture_2d p.texture;
+    glBegin gl_quads;
+    glColor4f 1.0 1.0 1.0 0.8;
+    glTexCoord2f 0.0 0.0; glVertex2f (p.px -. c +. s) (p.py -. s -. c);
+    glTexCoord2f 1.0 0.0; glVertex2f (p.px +. c +. s) (p.py +. s -. c);
+    glTexCoord2f 1.0 1.0; glVertex2f (p.px +. c -. s) (p.py +. s +. c);
+    glTexCoord2f 0.0 1.0; glVertex2f (p.px -. c -. s) (p.py -. s +. c);
+    glEnd ()) particles
+
+let draw_batched batch sprite particles =
+  Array.iter (fun p ->
+    sprite.Glsprite.x <- p.px;
+    sprite.Glsprite.y <- p.py;
+    sprite.Glsprite.rotation <- p.angle;
+    Glsprite.add batch p.texture sprite) particles;
+  Glsprite.flush batch
+
+let run name draw particles =
+  glFinish ();
+  let start = get_ticks () in
+  for _i = 1 to frames do
+    glClear gl_color_buffer_bit;
+    Array.iter move particles;
+    draw particles;
+    swap_buffers ()
+  done;
+  glFinish ();
+  let ms = max 1 (get_ticks () - start) in
+  Printf.printf "%-10s %8d sprites x %d frames: %6.1f ms/frame, %12.0f sprites/s\n%!"
+    name sprites frames (float_of_int ms /. float_of_int frames)
+    (float_of_int (sprites * frames) *. 1000.0 /. float_of_int ms)
+
+let main () =
+  init [VIDEO];
+  let _ = set_video_mode width height 32 [OPENGL] in
+  set_caption "Glsprite benchmark" "spritebench";
+  glViewport 0 0 width height;
+  glMatrixMode gl_projection;
+  glLoadIdentity ();
+  glOrtho 0.0 (float_of_int width) (float_of_int height) 0.0 (-1.0) 1.0;
+  glMatrixMode gl_modelview;
+  glLoadIdentity ();
+  glEnable gl_texture_2d;
+  glEnable gl_blend;
+  glBlendFunc gl_src_alpha gl_one_minus_src_alpha;
+  let textures = make_textures () in
+  let particles = make_particles textures in
+  let sprite = Glsprite.make_sprite 0.0 0.0 size size in
+  sprite.Glsprite.origin_x <- size /. 2.0;
+  sprite.Glsprite.origin_y <- size /. 2.0;
+  sprite.Glsprite.alpha <- 0.8;
+  run "immediate" draw_immediate particles;
+  let batch = Glsprite.create (min sprites Glsprite.max_sprites) true in
+  run "batched" (draw_batched batch sprite) particles;
+  Printf.printf "draw calls in the last batched flush: %d\n" (Glsprite.draw_calls batch);
+  Glsprite.delete batch;
+  quit ()
+
+let _ =
+  try
+    main ()
+  with
+    SDL_failure m -> failwith m
@@ -0,0 +1,17 @@
+/*
+ * dirty_rects.h - dirty rectangle tracking for Sdl.Video, shared by
+ * sdl_stub.c, which keeps the tracker, and sdl_draw_stub.c.
+ *
+ * Stubs that write to a surface mark the rectangle they touched; the call
+ * returns at once unless that surface is the one being tracked (see
+ * Video.track_dirty). The rectangle may reach outside the surface.
+ */
+
+#ifndef DIRTY_RECTS_H
+#define DIRTY_RECTS_H
+
+#include <SDL/SDL.h>
+
+void sdl_mark_dirty(SDL_Surface *s, int x, int y, int w, int h);
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * frame_pacer.h - frame pacing for Sdl.Timer and Win.
+ *
+ * A pacer is an OCaml float record (see create_pacer in sdl.ml and win.ml)
+ * which these functions read and write in place, so waiting for a frame
+ * does not allocate. Times in the record are nanoseconds of hrtime_ns.
+ */
+
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include "hrtime.h"
+
+/* fields of the pacer record */
+enum {
+    PACER_PERIOD, PACER_SPIN, PACER_DEADLINE, PACER_LAST_WAKE, PACER_FRAME_TIME,
+    PACER_ACCUMULATOR, PACER_ACCUMULATED_AT, PACER_ALPHA,
+    PACER_FRAMES, PACER_LATE, PACER_OVERSHOOT_SUM, PACER_OVERSHOOT_MAX, PACER_OVERSHOOT_LAST
+};
+
+/* at most this many fixed steps are run per frame, the rest of the
+   accumulated time is dropped so a slow frame cannot snowball */
+#define PACER_MAX_STEPS 8
+
+#define Pacer_get(p, f) Double_field(p, f)
+#define Pacer_set(p, f, x) Store_double_field(p, f, (double)(x))
+
+/* Starts pacing from now and clears the statistics. */
+static value pacer_reset(value p)
+{
+    CAMLparam1(p);
+    long long now = hrtime_ns();
+    Pacer_set(p, PACER_DEADLINE, now + (long long)Pacer_get(p, PACER_PERIOD));
+    Pacer_set(p, PACER_LAST_WAKE, now);
+    Pacer_set(p, PACER_FRAME_TIME, 0);
+    Pacer_set(p, PACER_ACCUMULATOR, 0);
+    Pacer_set(p, PACER_ACCUMULATED_AT, now);
+    Pacer_set(p, PACER_ALPHA, 0);
+    Pacer_set(p, PACER_FRAMES, 0);
+    Pacer_set(p, PACER_LATE, 0);
+    Pacer_set(p, PACER_OVERSHOOT_SUM, 0);
+    Pacer_set(p, PACER_OVERSHOOT_MAX, 0);
+    Pacer_set(p, PACER_OVERSHOOT_LAST, 0);
+    CAMLreturn(Val_unit);
+}
+
+/* Waits for the next deadline and moves it one period on. A frame that
+   arrives after its deadline is counted as late and the deadlines are
+   moved past now, keeping their phase, instead of rushing to catch up.
+   The overshoot is how far past the deadline the wait woke up. */
+static value pacer_wait(value p)
+{
+    CAMLparam1(p);
+    long long period = (long long)Pacer_get(p, PACER_PERIOD);
+    long long spin = (long long)Pacer_get(p, PACER_SPIN);
+    long long deadline = (long long)Pacer_get(p, PACER_DEADLINE);
+    long long now = hrtime_ns(), overshoot;
+
+    if (now < deadline) {
+        caml_enter_blocking_section();
+        hrtime_wait_until(deadline, spin);
+        now = hrtime_ns();
+        caml_leave_blocking_section();
+        overshoot = now - deadline;
+        Pacer_set(p, PACER_OVERSHOOT_SUM, Pacer_get(p, PACER_OVERSHOOT_SUM) + overshoot);
+        if (overshoot > Pacer_get(p, PACER_OVERSHOOT_MAX)) Pacer_set(p, PACER_OVERSHOOT_MAX, overshoot);
+        Pacer_set(p, PACER_OVERSHOOT_LAST, overshoot);
+        deadline += period;
+    } else {
+        Pacer_set(p, PACER_LATE, Pacer_get(p, PACER_LATE) + 1);
+        deadline += period * ((now - deadline) / period + 1);
+    }
+    Pacer_set(p, PACER_DEADLINE, deadline);
+    Pacer_set(p, PACER_FRAMES, Pacer_get(p, PACER_FRAMES) + 1);
+    Pacer_set(p, PACER_FRAME_TIME, now - (long long)Pacer_get(p, PACER_LAST_WAKE));
+    Pacer_set(p, PACER_LAST_WAKE, now);
+    CAMLreturn(Val_unit);
+}
+
+/* Adds the time since the last call to the accumulator and returns how
+   many fixed steps of [step] seconds to run; what is left over, as a
+   fraction of a step, is the interpolation factor. */
+static value pacer_steps(value p, value vstep)
+{
+    CAMLparam2(p, vstep);
+    long long step = (long long)(Double_val(vstep) * 1e9);
+    long long now = hrtime_ns();
+    long long acc = (long long)Pacer_get(p, PACER_ACCUMULATOR) + now - (long long)Pacer_get(p, PACER_ACCUMULATED_AT);
+    long long n;
+
+    if (step <= 0) invalid_argument("fixed_steps");
+    n = acc / step;
+    if (n > PACER_MAX_STEPS) {
+        n = PACER_MAX_STEPS;
+        acc = n * step;
+    }
+    acc -= n * step;
+    Pacer_set(p, PACER_ACCUMULATOR, acc);
+    Pacer_set(p, PACER_ACCUMULATED_AT, now);
+    Pacer_set(p, PACER_ALPHA, (double)acc / step);
+    CAMLreturn(Val_int(n));
+}
+
+#endif
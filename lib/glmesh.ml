@@ -0,0 +1,34 @@
+(* Mesh optimisation for index and vertex bigarrays *)
+
+type ('a, 'b) index_array = ('a, 'b, Bigarray.c_layout) Bigarray.Array1.t
+
+type cache_stats = {
+  acmr_before : float;
+  acmr_after : float;
+}
+
+external acmr : ('a, 'b) index_array -> int -> float
+= "glmeshstub_acmr"
+external optimize_vertex_cache : ('a, 'b) index_array -> cache_stats
+= "glmeshstub_optimize_vertex_cache"
+external optimize_overdraw : ('a, 'b) index_array -> Glcaml.float_array -> int -> float -> unit
+= "glmeshstub_optimize_overdraw"
+external optimize_vertex_fetch : ('a, 'b) index_array -> ('c, 'd, Bigarray.c_layout) Bigarray.Array1.t -> int -> int
+= "glmeshstub_optimize_vertex_fetch"
+
+type simplify_params = {
+  vertex_stride : int;
+  attributes : (int * float) array;
+  max_error : float;
+}
+
+external lod_chains : simplify_params -> (('a, 'b) index_array * Glcaml.float_array) array -> float -> int -> int -> (('a, 'b) index_array * float) array array
+= "glmeshstub_lod_chains"
+
+let lod_chain params indices vertices ratio levels =
+  (lod_chains params [| indices, vertices |] ratio levels 1).(0)
+
+let simplify params indices vertices target_index_count =
+  let n = Bigarray.Array1.dim indices in
+  let ratio = if n = 0 then 1.0 else max 0.0 (min 1.0 (float_of_int target_index_count /. float_of_int n)) in
+  (lod_chain params indices vertices ratio 1).(1)
@@ -0,0 +1,88 @@
+(** Mesh optimisation for index and vertex bigarrays.
+
+  The functions in this module work on the bigarray types of {!Glcaml} and do not
+  call OpenGL, so they may be used before a context has been created.
+
+  Index arrays are either [Glcaml.ushort_array] (for [gl_unsigned_short] indices) or
+  [Glcaml.word_array] (for [gl_unsigned_int] indices) and describe triangle lists.
+  Any other kind of bigarray, or an index of 2{^31} - 1 or more, raises [Invalid_argument].
+
+  A typical sequence for a static mesh is [optimize_vertex_cache], then [optimize_overdraw],
+  then [optimize_vertex_fetch]; the overdraw pass reads the positions in the original vertex
+  order, so it has to run before the vertices are reordered. *)
+
+(** A triangle list index array; [Glcaml.ushort_array] or [Glcaml.word_array] *)
+type ('a, 'b) index_array = ('a, 'b, Bigarray.c_layout) Bigarray.Array1.t
+
+(** ACMR (average cache miss ratio, transformed vertices per triangle) measured with a
+  16 entry FIFO cache before and after an optimisation. The ideal value approaches 0.5
+  for large regular meshes; 3.0 means no reuse at all. *)
+type cache_stats = {
+  acmr_before : float;
+  acmr_after : float;
+}
+
+(** [acmr indices cache_size]
+  Simulates a FIFO post-transform cache of [cache_size] entries over the triangle list
+  and returns the average number of cache misses per triangle. *)
+val acmr : ('a, 'b) index_array -> int -> float
+
+(** [optimize_vertex_cache indices]
+  Reorders the triangles in place for post-transform vertex cache locality, using
+  Tom Forsyth's linear-speed algorithm. Returns the ACMR before and after. *)
+val optimize_vertex_cache : ('a, 'b) index_array -> cache_stats
+
+(** [optimize_overdraw indices positions stride threshold]
+  Reorders clusters of triangles in place so that outward facing clusters are drawn
+  first, which reduces overdraw independently of the view direction.
+  [positions] holds the vertex positions as [x, y, z] at the start of each vertex,
+  [stride] floats apart. Clusters start at every cache flush in the triangle order and
+  are split further wherever the ACMR of the triangles since the last split is at most
+  [threshold] times that of the whole cluster: 1.05 allows runs up to 5 percent worse
+  than their cluster, 1.0 only splits after runs that are no worse, and values below
+  1.0 split less. *)
+val optimize_overdraw : ('a, 'b) index_array -> Glcaml.float_array -> int -> float -> unit
+
+(** [optimize_vertex_fetch indices vertices stride -> used_vertices]
+  Reorders the vertex array in place in the order the vertices are first referenced and
+  rewrites the indices to match. Each vertex is [stride] elements of [vertices] (any
+  bigarray kind). Vertices that are not referenced are moved to the end; the number of
+  referenced vertices is returned. *)
+val optimize_vertex_fetch : ('a, 'b) index_array -> ('c, 'd, Bigarray.c_layout) Bigarray.Array1.t -> int -> int
+
+(** Parameters of the simplifier.
+  [vertex_stride] is the number of floats per vertex in the vertex array, with the
+  position in the first three. [attributes] lists [(offset, weight)] pairs of further
+  floats in each vertex (normals, texture coordinates, ...) that should be preserved,
+  at most 8; their deviation times [weight] counts as error alongside the position.
+  [max_error] bounds the error of each collapse, relative to the extent of the mesh
+  (0.01 is one percent of its largest dimension); use [infinity] to reach the
+  target triangle counts regardless. *)
+type simplify_params = {
+  vertex_stride : int;
+  attributes : (int * float) array;
+  max_error : float;
+}
+
+(** [simplify params indices vertices target_index_count -> simplified, error]
+  Removes vertices from the triangle list until at most [target_index_count] indices
+  remain or the next step would exceed [params.max_error]. The result indexes the same
+  vertex array and [error] is the largest error that was accepted.
+  Open borders keep their outline. Vertices that are split along attribute seams
+  (same position, different index) move together, each copy to the copy of the target
+  it shares a triangle with, or else to the one with the nearest attributes, so seams
+  stay closed and flat-shaded meshes simplify too; the attribute error counts against
+  [params.max_error]. *)
+val simplify : simplify_params -> ('a, 'b) index_array -> Glcaml.float_array -> int -> ('a, 'b) index_array * float
+
+(** [lod_chain params indices vertices ratio levels]
+  Returns [levels + 1] levels of detail: level 0 is [indices] itself and level [i] has
+  at most [ratio ** i] of its triangles, each produced by continuing to simplify the
+  previous one. Levels stop shrinking once [params.max_error] is reached. *)
+val lod_chain : simplify_params -> ('a, 'b) index_array -> Glcaml.float_array -> float -> int -> (('a, 'b) index_array * float) array
+
+(** [lod_chains params meshes ratio levels threads]
+  [lod_chain] for every [(indices, vertices)] mesh, running on [threads] threads at once
+  (0 uses one per processor). The OCaml runtime is released meanwhile, so other threads
+  may continue, but they must not modify the arrays. *)
+val lod_chains : simplify_params -> (('a, 'b) index_array * Glcaml.float_array) array -> float -> int -> int -> (('a, 'b) index_array * float) array array
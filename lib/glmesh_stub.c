@@ -0,0 +1,1403 @@
+/*
+ * Glmesh - mesh optimisation routines for index and vertex bigarrays.
+ *
+ * None of the functions in this file touch OpenGL, so they may be run
+ * before a context exists or from another thread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/signals.h>
+#include <caml/custom.h>
+#include <caml/bigarray.h>
+
+/* ---------------------------- index buffers ---------------------------- */
+
+/* Index buffers are either 16-bit (Glcaml.ushort_array) or 32-bit
+   (Glcaml.word_array). They are copied into a plain unsigned array while
+   the optimisers run and written back afterwards. */
+
+static int index_kind(value ba)
+{
+    int kind = Bigarray_val(ba)->flags & BIGARRAY_KIND_MASK;
+    if (kind != BIGARRAY_UINT16 && kind != BIGARRAY_INT32)
+        invalid_argument("Glmesh: index array must be ushort_array or word_array");
+    return kind;
+}
+
+/* Vertex counts are kept in an int, so the largest index must leave room for
+   idx + 1. Only word arrays can hold such an index. */
+static int indices_in_range(const unsigned int *idx, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) if (idx[i] > INT_MAX - 1) return 0;
+    return 1;
+}
+
+static unsigned int *read_indices(value ba, int *count)
+{
+    int kind = index_kind(ba);
+    int n = Bigarray_val(ba)->dim[0];
+    unsigned int *idx;
+    int i;
+
+    if (n % 3 != 0) invalid_argument("Glmesh: index count is not a multiple of 3");
+    idx = (unsigned int *)malloc((n > 0 ? n : 1) * sizeof(unsigned int));
+    if (idx == NULL) raise_out_of_memory();
+    if (kind == BIGARRAY_UINT16) {
+        unsigned short *src = Data_bigarray_val(ba);
+        for (i = 0; i < n; i++) idx[i] = src[i];
+    } else {
+        unsigned int *src = Data_bigarray_val(ba);
+        memcpy(idx, src, n * sizeof(unsigned int));
+        if (!indices_in_range(idx, n)) {
+            free(idx);
+            invalid_argument("Glmesh: index too large");
+        }
+    }
+    *count = n;
+    return idx;
+}
+
+static void write_indices(value ba, const unsigned int *idx, int n)
+{
+    int i;
+    if ((Bigarray_val(ba)->flags & BIGARRAY_KIND_MASK) == BIGARRAY_UINT16) {
+        unsigned short *dst = Data_bigarray_val(ba);
+        for (i = 0; i < n; i++) dst[i] = (unsigned short)idx[i];
+    } else {
+        memcpy(Data_bigarray_val(ba), idx, n * sizeof(unsigned int));
+    }
+}
+
+static int vertex_count(const unsigned int *idx, int n)
+{
+    unsigned int m = 0;
+    int i;
+    for (i = 0; i < n; i++) if (idx[i] >= m) m = idx[i] + 1;
+    return (int)m;
+}
+
+/* ------------------------------ ACMR ----------------------------------- */
+
+/* Average cache miss ratio (transformed vertices per triangle) of a FIFO
+   post-transform cache with cache_size entries. A vertex is resident while
+   fewer than cache_size misses happened since it was last loaded. */
+static double fifo_acmr(const unsigned int *idx, int n, int nv, int cache_size)
+{
+    unsigned int *stamp;
+    unsigned int time = cache_size + 1;
+    int misses = 0;
+    int i;
+
+    if (n == 0) return 0.0;
+    stamp = (unsigned int *)calloc(nv > 0 ? nv : 1, sizeof(unsigned int));
+    if (stamp == NULL) return -1.0;
+    for (i = 0; i < n; i++) {
+        unsigned int v = idx[i];
+        if (time - stamp[v] > (unsigned int)cache_size) {
+            stamp[v] = time++;
+            misses++;
+        }
+    }
+    free(stamp);
+    return (double)misses / (double)(n / 3);
+}
+
+#define DEFAULT_CACHE_SIZE 16
+
+value glmeshstub_acmr(value vidx, value vcache)
+{
+    CAMLparam2(vidx, vcache);
+    int n;
+    int cache_size = Int_val(vcache);
+    unsigned int *idx;
+    double r;
+
+    if (cache_size < 3) invalid_argument("Glmesh.acmr");
+    idx = read_indices(vidx, &n);
+    r = fifo_acmr(idx, n, vertex_count(idx, n), cache_size);
+    free(idx);
+    if (r < 0.0) raise_out_of_memory();
+    CAMLreturn(copy_double(r));
+}
+
+/* ------------------------- vertex cache order -------------------------- */
+
+/* Tom Forsyth's "Linear-Speed Vertex Cache Optimisation": greedily emit the
+   triangle with the highest score, where a vertex scores for being recently
+   used and for having few remaining triangles. */
+
+#define VCACHE_SIZE 32
+#define VALENCE_MAX 64
+
+static float cache_score_table[VCACHE_SIZE];
+static float valence_score_table[VALENCE_MAX];
+static int score_tables_ready = 0;
+
+static void init_score_tables(void)
+{
+    int i;
+    if (score_tables_ready) return;
+    for (i = 0; i < VCACHE_SIZE; i++) {
+        if (i < 3) {
+            /* the most recent triangle should not be favoured too much */
+            cache_score_table[i] = 0.75f;
+        } else {
+            float s = 1.0f - (float)(i - 3) / (float)(VCACHE_SIZE - 3);
+            cache_score_table[i] = powf(s, 1.5f);
+        }
+    }
+    valence_score_table[0] = 0.0f;
+    for (i = 1; i < VALENCE_MAX; i++)
+        valence_score_table[i] = 2.0f * powf((float)i, -0.5f);
+    score_tables_ready = 1;
+}
+
+static float vertex_score(int cache_pos, int live)
+{
+    float score;
+    if (live == 0) return -1.0f;
+    score = cache_pos >= 0 ? cache_score_table[cache_pos] : 0.0f;
+    return score + valence_score_table[live < VALENCE_MAX ? live : VALENCE_MAX - 1];
+}
+
+/* returns 0 on allocation failure */
+static int forsyth_reorder(unsigned int *idx, int n, int nv)
+{
+    int nt = n / 3;
+    int *live = NULL, *adj_start = NULL, *adj = NULL, *cache_pos = NULL;
+    float *vscore = NULL, *tscore = NULL;
+    char *emitted = NULL;
+    unsigned int *out = NULL;
+    int cache[VCACHE_SIZE + 3], new_cache[VCACHE_SIZE + 3];
+    int cache_count = 0;
+    int best, scan = 0;
+    int i, j, k, t;
+    int ok = 0;
+
+    init_score_tables();
+    live = (int *)calloc(nv + 1, sizeof(int));
+    adj_start = (int *)calloc(nv + 1, sizeof(int));
+    adj = (int *)malloc((n + 1) * sizeof(int));
+    cache_pos = (int *)malloc((nv + 1) * sizeof(int));
+    vscore = (float *)malloc((nv + 1) * sizeof(float));
+    tscore = (float *)malloc((nt + 1) * sizeof(float));
+    emitted = (char *)calloc(nt + 1, 1);
+    out = (unsigned int *)malloc((n + 1) * sizeof(unsigned int));
+    if (!live || !adj_start || !adj || !cache_pos || !vscore || !tscore || !emitted || !out)
+        goto done;
+
+    /* vertex -> triangle adjacency */
+    for (i = 0; i < n; i++) live[idx[i]]++;
+    for (i = 0, k = 0; i < nv; i++) { adj_start[i] = k; k += live[i]; }
+    adj_start[nv] = k;
+    for (i = 0; i < nv; i++) live[i] = 0;
+    for (t = 0; t < nt; t++)
+        for (j = 0; j < 3; j++) {
+            unsigned int v = idx[3*t + j];
+            adj[adj_start[v] + live[v]++] = t;
+        }
+
+    for (i = 0; i < nv; i++) {
+        cache_pos[i] = -1;
+        vscore[i] = vertex_score(-1, live[i]);
+    }
+    best = -1;
+    for (t = 0; t < nt; t++) {
+        tscore[t] = vscore[idx[3*t]] + vscore[idx[3*t+1]] + vscore[idx[3*t+2]];
+        if (best < 0 || tscore[t] > tscore[best]) best = t;
+    }
+
+    for (k = 0; k < nt; k++) {
+        int new_count = 0;
+        float best_score = -1.0f;
+
+        if (best < 0) {
+            /* dead end: continue with the next unused triangle in input order */
+            while (emitted[scan]) scan++;
+            best = scan;
+        }
+        emitted[best] = 1;
+        for (j = 0; j < 3; j++) {
+            unsigned int v = idx[3*best + j];
+            int *a = adj + adj_start[v];
+            int m;
+            out[3*k + j] = v;
+            /* remove the triangle from the vertex's live list */
+            for (m = 0; m < live[v]; m++)
+                if (a[m] == best) { a[m] = a[live[v] - 1]; break; }
+            live[v]--;
+            new_cache[new_count++] = v;
+        }
+        for (i = 0; i < cache_count; i++) {
+            int v = cache[i];
+            if (v != (int)idx[3*best] && v != (int)idx[3*best+1] && v != (int)idx[3*best+2])
+                new_cache[new_count++] = v;
+        }
+        /* vertices pushed out of the cache lose their position score */
+        for (i = VCACHE_SIZE; i < new_count; i++) {
+            int v = new_cache[i];
+            cache_pos[v] = -1;
+            vscore[v] = vertex_score(-1, live[v]);
+        }
+        if (new_count > VCACHE_SIZE) new_count = VCACHE_SIZE;
+        for (i = 0; i < new_count; i++) {
+            int v = new_cache[i];
+            cache[i] = v;
+            cache_pos[v] = i;
+            vscore[v] = vertex_score(i, live[v]);
+        }
+        cache_count = new_count;
+
+        /* rescore triangles touching the cache and pick the best of them */
+        best = -1;
+        for (i = 0; i < cache_count; i++) {
+            int v = cache[i];
+            int *a = adj + adj_start[v];
+            int m;
+            for (m = 0; m < live[v]; m++) {
+                int tt = a[m];
+                float s = vscore[idx[3*tt]] + vscore[idx[3*tt+1]] + vscore[idx[3*tt+2]];
+                tscore[tt] = s;
+                if (s > best_score) { best_score = s; best = tt; }
+            }
+        }
+    }
+    memcpy(idx, out, n * sizeof(unsigned int));
+    ok = 1;
+done:
+    free(live); free(adj_start); free(adj); free(cache_pos);
+    free(vscore); free(tscore); free(emitted); free(out);
+    return ok;
+}
+
+value glmeshstub_optimize_vertex_cache(value vidx)
+{
+    CAMLparam1(vidx);
+    CAMLlocal1(result);
+    int n, nv, ok;
+    unsigned int *idx = read_indices(vidx, &n);
+    double before, after;
+
+    nv = vertex_count(idx, n);
+    caml_enter_blocking_section();
+    before = fifo_acmr(idx, n, nv, DEFAULT_CACHE_SIZE);
+    ok = forsyth_reorder(idx, n, nv);
+    after = fifo_acmr(idx, n, nv, DEFAULT_CACHE_SIZE);
+    caml_leave_blocking_section();
+    if (!ok || before < 0.0 || after < 0.0) {
+        free(idx);
+        raise_out_of_memory();
+    }
+    write_indices(vidx, idx, n);
+    free(idx);
+    result = caml_alloc(2 * Double_wosize, Double_array_tag);
+    Store_double_field(result, 0, before);
+    Store_double_field(result, 1, after);
+    CAMLreturn(result);
+}
+
+/* ---------------------------- overdraw --------------------------------- */
+
+/* Clusters are runs of triangles between cache flushes (all three vertices
+   missing), further split where the running ACMR is at most threshold times
+   the cluster ACMR. The clusters are then sorted front-to-back in an
+   approximate view-independent way: outward facing clusters far from the
+   mesh centre are drawn first (Sander, Nehab, Barczak 2007). */
+
+typedef struct {
+    int start;
+    int count;
+    float key;
+} cluster_t;
+
+static int compare_clusters(const void *a, const void *b)
+{
+    const cluster_t *ca = a, *cb = b;
+    if (ca->key > cb->key) return -1;
+    if (ca->key < cb->key) return 1;
+    return ca->start - cb->start;
+}
+
+static int triangle_misses(const unsigned int *tri, unsigned int *stamp, unsigned int *time, int cache_size)
+{
+    int j, m = 0;
+    for (j = 0; j < 3; j++) {
+        unsigned int v = tri[j];
+        if (*time - stamp[v] > (unsigned int)cache_size) {
+            stamp[v] = (*time)++;
+            m++;
+        }
+    }
+    return m;
+}
+
+static int overdraw_reorder(unsigned int *idx, int n, int nv, const float *pos, int stride, float threshold)
+{
+    int nt = n / 3;
+    unsigned int *stamp = NULL, *out = NULL;
+    int *hard = NULL;
+    cluster_t *clusters = NULL;
+    int nhard = 0, nclusters = 0;
+    unsigned int time;
+    double mesh_c[3] = {0.0, 0.0, 0.0}, mesh_area = 0.0;
+    int t, c, k;
+    int ok = 0;
+
+    stamp = (unsigned int *)calloc(nv + 1, sizeof(unsigned int));
+    hard = (int *)malloc((nt + 1) * sizeof(int));
+    clusters = (cluster_t *)malloc((nt + 1) * sizeof(cluster_t));
+    out = (unsigned int *)malloc((n + 1) * sizeof(unsigned int));
+    if (!stamp || !hard || !clusters || !out) goto done;
+
+    /* hard boundaries */
+    time = DEFAULT_CACHE_SIZE + 1;
+    for (t = 0; t < nt; t++)
+        if (triangle_misses(idx + 3*t, stamp, &time, DEFAULT_CACHE_SIZE) == 3 || t == 0)
+            hard[nhard++] = t;
+    hard[nhard] = nt;
+
+    /* soft boundaries inside each hard cluster */
+    for (c = 0; c < nhard; c++) {
+        int start = hard[c], end = hard[c + 1];
+        int misses = 0, run_misses = 0, run_start = start;
+        float cluster_acmr;
+
+        time += DEFAULT_CACHE_SIZE + 1;
+        for (t = start; t < end; t++)
+            misses += triangle_misses(idx + 3*t, stamp, &time, DEFAULT_CACHE_SIZE);
+        cluster_acmr = (float)misses / (float)(end - start);
+
+        time += DEFAULT_CACHE_SIZE + 1;
+        for (t = start; t < end; t++) {
+            run_misses += triangle_misses(idx + 3*t, stamp, &time, DEFAULT_CACHE_SIZE);
+            if (t + 1 < end && (float)run_misses / (float)(t + 1 - run_start) <= cluster_acmr * threshold) {
+                clusters[nclusters].start = run_start;
+                clusters[nclusters].count = t + 1 - run_start;
+                nclusters++;
+                run_start = t + 1;
+                run_misses = 0;
+                time += DEFAULT_CACHE_SIZE + 1;
+            }
+        }
+        clusters[nclusters].start = run_start;
+        clusters[nclusters].count = end - run_start;
+        nclusters++;
+    }
+
+    /* area weighted mesh centroid */
+    for (t = 0; t < nt; t++) {
+        const float *a = pos + idx[3*t] * stride;
+        const float *b = pos + idx[3*t+1] * stride;
+        const float *d = pos + idx[3*t+2] * stride;
+        double ux = b[0]-a[0], uy = b[1]-a[1], uz = b[2]-a[2];
+        double vx = d[0]-a[0], vy = d[1]-a[1], vz = d[2]-a[2];
+        double nx = uy*vz - uz*vy, ny = uz*vx - ux*vz, nz = ux*vy - uy*vx;
+        double area = sqrt(nx*nx + ny*ny + nz*nz);
+        mesh_c[0] += area * (a[0] + b[0] + d[0]) / 3.0;
+        mesh_c[1] += area * (a[1] + b[1] + d[1]) / 3.0;
+        mesh_c[2] += area * (a[2] + b[2] + d[2]) / 3.0;
+        mesh_area += area;
+    }
+    if (mesh_area > 0.0) {
+        mesh_c[0] /= mesh_area; mesh_c[1] /= mesh_area; mesh_c[2] /= mesh_area;
+    }
+
+    for (c = 0; c < nclusters; c++) {
+        double cc[3] = {0.0, 0.0, 0.0}, cn[3] = {0.0, 0.0, 0.0}, carea = 0.0, len;
+        for (t = clusters[c].start; t < clusters[c].start + clusters[c].count; t++) {
+            const float *a = pos + idx[3*t] * stride;
+            const float *b = pos + idx[3*t+1] * stride;
+            const float *d = pos + idx[3*t+2] * stride;
+            double ux = b[0]-a[0], uy = b[1]-a[1], uz = b[2]-a[2];
+            double vx = d[0]-a[0], vy = d[1]-a[1], vz = d[2]-a[2];
+            double nx = uy*vz - uz*vy, ny = uz*vx - ux*vz, nz = ux*vy - uy*vx;
+            double area = sqrt(nx*nx + ny*ny + nz*nz);
+            cc[0] += area * (a[0] + b[0] + d[0]) / 3.0;
+            cc[1] += area * (a[1] + b[1] + d[1]) / 3.0;
+            cc[2] += area * (a[2] + b[2] + d[2]) / 3.0;
+            cn[0] += nx; cn[1] += ny; cn[2] += nz;
+            carea += area;
+        }
+        if (carea > 0.0) { cc[0] /= carea; cc[1] /= carea; cc[2] /= carea; }
+        len = sqrt(cn[0]*cn[0] + cn[1]*cn[1] + cn[2]*cn[2]);
+        if (len > 0.0) { cn[0] /= len; cn[1] /= len; cn[2] /= len; }
+        clusters[c].key = (float)((cc[0] - mesh_c[0]) * cn[0] + (cc[1] - mesh_c[1]) * cn[1] + (cc[2] - mesh_c[2]) * cn[2]);
+    }
+
+    qsort(clusters, nclusters, sizeof(cluster_t), compare_clusters);
+    for (c = 0, k = 0; c < nclusters; c++) {
+        memcpy(out + k, idx + 3 * clusters[c].start, 3 * clusters[c].count * sizeof(unsigned int));
+        k += 3 * clusters[c].count;
+    }
+    memcpy(idx, out, n * sizeof(unsigned int));
+    ok = 1;
+done:
+    free(stamp); free(hard); free(clusters); free(out);
+    return ok;
+}
+
+value glmeshstub_optimize_overdraw(value vidx, value vpos, value vstride, value vthreshold)
+{
+    CAMLparam4(vidx, vpos, vstride, vthreshold);
+    int stride = Int_val(vstride);
+    float threshold = Double_val(vthreshold);
+    const float *pos = Data_bigarray_val(vpos);
+    int n, nv, ok;
+    unsigned int *idx;
+
+    if (stride < 3) invalid_argument("Glmesh.optimize_overdraw");
+    idx = read_indices(vidx, &n);
+    nv = vertex_count(idx, n);
+    if ((long)nv * stride > Bigarray_val(vpos)->dim[0]) {
+        free(idx);
+        invalid_argument("Glmesh.optimize_overdraw: index out of range of the position array");
+    }
+    caml_enter_blocking_section();
+    ok = overdraw_reorder(idx, n, nv, pos, stride, threshold);
+    caml_leave_blocking_section();
+    if (!ok) {
+        free(idx);
+        raise_out_of_memory();
+    }
+    write_indices(vidx, idx, n);
+    free(idx);
+    CAMLreturn(Val_unit);
+}
+
+/* --------------------------- vertex fetch ------------------------------ */
+
+/* Renumber vertices in order of first use and permute the vertex array to
+   match, so that vertex fetches walk memory linearly. Unreferenced vertices
+   are moved behind the referenced ones. */
+value glmeshstub_optimize_vertex_fetch(value vidx, value vverts, value vstride)
+{
+    CAMLparam3(vidx, vverts, vstride);
+    int n, nv, i, used = 0, unused;
+    int stride = Int_val(vstride);
+    int elt = bigarray_element_size[Bigarray_val(vverts)->flags & BIGARRAY_KIND_MASK];
+    long total = Bigarray_val(vverts)->dim[0];
+    size_t vsize;
+    unsigned int *idx, *remap;
+    unsigned char *data = Data_bigarray_val(vverts), *copy;
+
+    if (stride <= 0 || total % stride != 0) invalid_argument("Glmesh.optimize_vertex_fetch");
+    idx = read_indices(vidx, &n);
+    nv = total / stride;
+    if (vertex_count(idx, n) > nv) {
+        free(idx);
+        invalid_argument("Glmesh.optimize_vertex_fetch: index out of range of the vertex array");
+    }
+    vsize = (size_t)stride * elt;
+    remap = (unsigned int *)malloc((nv + 1) * sizeof(unsigned int));
+    copy = (unsigned char *)malloc(nv * vsize + 1);
+    if (remap == NULL || copy == NULL) {
+        free(idx); free(remap); free(copy);
+        raise_out_of_memory();
+    }
+    caml_enter_blocking_section();
+    for (i = 0; i < nv; i++) remap[i] = (unsigned int)-1;
+    for (i = 0; i < n; i++) {
+        if (remap[idx[i]] == (unsigned int)-1) remap[idx[i]] = used++;
+        idx[i] = remap[idx[i]];
+    }
+    unused = used;
+    for (i = 0; i < nv; i++)
+        if (remap[i] == (unsigned int)-1) remap[i] = unused++;
+    memcpy(copy, data, nv * vsize);
+    for (i = 0; i < nv; i++)
+        memcpy(data + remap[i] * vsize, copy + i * vsize, vsize);
+    caml_leave_blocking_section();
+    write_indices(vidx, idx, n);
+    free(idx); free(remap); free(copy);
+    CAMLreturn(Val_int(used));
+}
+
+/* --------------------------- simplification ---------------------------- */
+
+/* Quadric error metric simplification (Garland & Heckbert) by half-edge
+   collapse: a vertex is only ever merged into one of its neighbours, so
+   every level of detail indexes the original vertex array.
+
+   Attributes take part through generalised quadrics over the point
+   (x, y, z, w0 * a0, w1 * a1, ...). Positions are scaled into the unit box
+   of the mesh and quadrics are divided by their accumulated area, so the
+   error is roughly the distance from the original surface relative to the
+   mesh extent. Open borders only collapse along themselves.
+
+   Vertices that share a position (split for normals, texture seams, ...)
+   are linked into a ring and collapse together: every copy goes to the
+   copy of the target position it already shares a triangle with, or else
+   to the one whose attributes suit it best, and the cost is the sum over
+   the copies. The topology tests work on positions, so a seam is an
+   ordinary edge to them and can not open up. */
+
+#define MAX_ATTRIBUTES 8
+#define MAX_DIM (3 + MAX_ATTRIBUTES)
+#define BORDER_WEIGHT 10.0
+#define MAX_PASSES 4
+
+enum { VK_INTERIOR, VK_BORDER, VK_LOCKED };
+
+typedef struct {
+    int stride;
+    int nattr;
+    int attr_offset[MAX_ATTRIBUTES];
+    double attr_weight[MAX_ATTRIBUTES];
+    double max_error;
+} simplify_params;
+
+typedef struct {
+    double cost;
+    unsigned int from, to;
+    unsigned int vfrom, vto;
+} collapse;
+
+typedef struct {
+    int *items;
+    int count, cap;
+} int_list;
+
+typedef struct {
+    int nt, nv, dim, qsize;
+    unsigned int *tris;         /* updated in place as vertices collapse */
+    unsigned char *alive;
+    int alive_count;
+    double *coords;             /* nv * dim */
+    double *quadrics;           /* nv * qsize; packed upper A, b, c, area */
+    unsigned char *kind;
+    unsigned int *version;
+    unsigned int *remap;        /* first vertex with the same position */
+    unsigned int *wedge;        /* next vertex with the same position */
+    int_list *vtris;            /* triangles around each vertex, some dead */
+    unsigned int *mark;
+    unsigned int stamp;
+    collapse *heap;
+    int heap_count, heap_cap;
+    double error;               /* largest collapse cost so far */
+} simplifier;
+
+static int list_push(int_list *l, int x)
+{
+    if (l->count == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 8;
+        int *items = (int *)realloc(l->items, cap * sizeof(int));
+        if (items == NULL) return 0;
+        l->items = items;
+        l->cap = cap;
+    }
+    l->items[l->count++] = x;
+    return 1;
+}
+
+static void quadric_add_triangle(double *q, int d, const double *p0, const double *p1, const double *p2, double w)
+{
+    double e1[MAX_DIM], e2[MAX_DIM];
+    double l = 0.0, t = 0.0, pe1 = 0.0, pe2 = 0.0, pp = 0.0;
+    int i, j, k = 0;
+
+    for (i = 0; i < d; i++) { e1[i] = p1[i] - p0[i]; l += e1[i] * e1[i]; }
+    if (l <= 0.0) return;
+    l = sqrt(l);
+    for (i = 0; i < d; i++) { e1[i] /= l; e2[i] = p2[i] - p0[i]; t += e2[i] * e1[i]; }
+    l = 0.0;
+    for (i = 0; i < d; i++) { e2[i] -= t * e1[i]; l += e2[i] * e2[i]; }
+    if (l <= 0.0) return;
+    l = sqrt(l);
+    for (i = 0; i < d; i++) {
+        e2[i] /= l;
+        pe1 += p0[i] * e1[i];
+        pe2 += p0[i] * e2[i];
+        pp += p0[i] * p0[i];
+    }
+    for (i = 0; i < d; i++)
+        for (j = i; j < d; j++)
+            q[k++] += w * ((i == j ? 1.0 : 0.0) - e1[i] * e1[j] - e2[i] * e2[j]);
+    for (i = 0; i < d; i++) q[k++] += w * (pe1 * e1[i] + pe2 * e2[i] - p0[i]);
+    q[k++] += w * (pp - pe1 * pe1 - pe2 * pe2);
+    q[k] += w;
+}
+
+/* plane n.x + dist = 0 over the position components */
+static void quadric_add_plane(double *q, int d, const double *n, double dist, double w)
+{
+    int i, j, k = 0;
+    for (i = 0; i < d; i++)
+        for (j = i; j < d; j++, k++)
+            if (j < 3) q[k] += w * n[i] * n[j];
+    for (i = 0; i < d; i++, k++)
+        if (i < 3) q[k] += w * dist * n[i];
+    q[k] += w * dist * dist;
+}
+
+static double quadric_eval(const double *q, const double *r, const double *x, int d)
+{
+    double e = 0.0, area;
+    int i, j, k = 0;
+    for (i = 0; i < d; i++) {
+        e += (q[k] + r[k]) * x[i] * x[i];
+        k++;
+        for (j = i + 1; j < d; j++, k++) e += 2.0 * (q[k] + r[k]) * x[i] * x[j];
+    }
+    for (i = 0; i < d; i++, k++) e += 2.0 * (q[k] + r[k]) * x[i];
+    e += q[k] + r[k];
+    k++;
+    area = q[k] + r[k];
+    if (e <= 0.0) return 0.0;
+    return area > 0.0 ? e / area : e;
+}
+
+static void triangle_normal(const double *a, const double *b, const double *c, double *n)
+{
+    double u[3], v[3];
+    int i;
+    for (i = 0; i < 3; i++) { u[i] = b[i] - a[i]; v[i] = c[i] - a[i]; }
+    n[0] = u[1] * v[2] - u[2] * v[1];
+    n[1] = u[2] * v[0] - u[0] * v[2];
+    n[2] = u[0] * v[1] - u[1] * v[0];
+}
+
+static int heap_push(simplifier *s, double cost, unsigned int from, unsigned int to)
+{
+    collapse c;
+    int i;
+    if (s->heap_count == s->heap_cap) {
+        int cap = s->heap_cap ? s->heap_cap * 2 : 1024;
+        collapse *heap = (collapse *)realloc(s->heap, cap * sizeof(collapse));
+        if (heap == NULL) return 0;
+        s->heap = heap;
+        s->heap_cap = cap;
+    }
+    c.cost = cost; c.from = from; c.to = to;
+    c.vfrom = s->version[from]; c.vto = s->version[to];
+    i = s->heap_count++;
+    while (i > 0 && s->heap[(i - 1) / 2].cost > cost) {
+        s->heap[i] = s->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->heap[i] = c;
+    return 1;
+}
+
+static collapse heap_pop(simplifier *s)
+{
+    collapse top = s->heap[0];
+    collapse last = s->heap[--s->heap_count];
+    int i = 0, n = s->heap_count;
+    for (;;) {
+        int c = i * 2 + 1;
+        if (c >= n) break;
+        if (c + 1 < n && s->heap[c + 1].cost < s->heap[c].cost) c++;
+        if (s->heap[c].cost >= last.cost) break;
+        s->heap[i] = s->heap[c];
+        i = c;
+    }
+    if (n > 0) s->heap[i] = last;
+    return top;
+}
+
+/* whether triangle t has a corner at position p */
+static int tri_has(const simplifier *s, const unsigned int *t, unsigned int p)
+{
+    return s->remap[t[0]] == p || s->remap[t[1]] == p || s->remap[t[2]] == p;
+}
+
+/* number of live triangles that share the edge between positions p and q */
+static int edge_valence(simplifier *s, unsigned int p, unsigned int q)
+{
+    unsigned int v = p;
+    int i, r = 0;
+    do {
+        int_list *l = &s->vtris[v];
+        for (i = 0; i < l->count; i++) {
+            int t = l->items[i];
+            if (s->alive[t] && tri_has(s, s->tris + t * 3, q)) r++;
+        }
+        v = s->wedge[v];
+    } while (v != p);
+    return r;
+}
+
+/* The copy of position q that vertex v becomes when its position collapses
+   into q: the one it already shares a triangle with, else the one with the
+   least error. Returns -1 when v has no triangles left. */
+static int wedge_target(simplifier *s, unsigned int v, unsigned int q, double *cost)
+{
+    int_list *l = &s->vtris[v];
+    const double *qv = s->quadrics + (size_t)v * s->qsize;
+    unsigned int u = q;
+    int i, k, live = 0, best = -1;
+    double e;
+
+    for (i = 0; i < l->count; i++) {
+        const unsigned int *t = s->tris + l->items[i] * 3;
+        if (!s->alive[l->items[i]]) continue;
+        live = 1;
+        for (k = 0; k < 3; k++)
+            if (s->remap[t[k]] == q) {
+                *cost = quadric_eval(qv, s->quadrics + (size_t)t[k] * s->qsize, s->coords + (size_t)t[k] * s->dim, s->dim);
+                return (int)t[k];
+            }
+    }
+    if (!live) return -1;
+    *cost = HUGE_VAL;
+    do {
+        e = quadric_eval(qv, s->quadrics + (size_t)u * s->qsize, s->coords + (size_t)u * s->dim, s->dim);
+        if (e < *cost) {
+            *cost = e;
+            best = (int)u;
+        }
+        u = s->wedge[u];
+    } while (u != q);
+    return best;
+}
+
+static int push_collapse(simplifier *s, unsigned int v, unsigned int u)
+{
+    unsigned int p = s->remap[v], q = s->remap[u];
+    double cost = 0.0, e;
+
+    if (p == q || s->kind[p] == VK_LOCKED) return 1;
+    if (s->kind[p] == VK_BORDER && edge_valence(s, p, q) != 1) return 1;
+    v = p;
+    do {
+        if (wedge_target(s, v, q, &e) >= 0) cost += e;
+        v = s->wedge[v];
+    } while (v != p);
+    return heap_push(s, cost, p, q);
+}
+
+static int push_all_edges(simplifier *s)
+{
+    int t, i;
+    s->heap_count = 0;
+    for (t = 0; t < s->nt; t++) {
+        const unsigned int *tri = s->tris + t * 3;
+        if (!s->alive[t]) continue;
+        for (i = 0; i < 3; i++) {
+            if (!push_collapse(s, tri[i], tri[(i + 1) % 3])) return 0;
+            if (!push_collapse(s, tri[(i + 1) % 3], tri[i])) return 0;
+        }
+    }
+    return 1;
+}
+
+/* Collapsing position p into q must keep the surface manifold (the edge
+   has one common neighbour on a border and two inside) and must not flip
+   any of the triangles that move with p. */
+static int collapse_valid(simplifier *s, unsigned int p, unsigned int q)
+{
+    unsigned int seen = ++s->stamp, common = ++s->stamp, v;
+    int valence = edge_valence(s, p, q), shared = 0;
+    int i, j;
+
+    if (valence == 0 || s->kind[p] == VK_LOCKED) return 0;
+    if (s->kind[p] == VK_BORDER && valence != 1) return 0;
+    v = p;
+    do {
+        int_list *lv = &s->vtris[v];
+        for (i = 0; i < lv->count; i++) {
+            const unsigned int *t = s->tris + lv->items[i] * 3;
+            if (!s->alive[lv->items[i]]) continue;
+            for (j = 0; j < 3; j++) s->mark[s->remap[t[j]]] = seen;
+        }
+        v = s->wedge[v];
+    } while (v != p);
+    v = q;
+    do {
+        int_list *lu = &s->vtris[v];
+        for (i = 0; i < lu->count; i++) {
+            const unsigned int *t = s->tris + lu->items[i] * 3;
+            if (!s->alive[lu->items[i]]) continue;
+            for (j = 0; j < 3; j++) {
+                unsigned int w = s->remap[t[j]];
+                if (w != q && w != p && s->mark[w] == seen) {
+                    s->mark[w] = common;
+                    shared++;
+                }
+            }
+        }
+        v = s->wedge[v];
+    } while (v != q);
+    if (shared != valence) return 0;
+    v = p;
+    do {
+        int_list *lv = &s->vtris[v];
+        for (i = 0; i < lv->count; i++) {
+            const unsigned int *t = s->tris + lv->items[i] * 3;
+            const double *a[3], *b[3];
+            double n0[3], n1[3];
+            if (!s->alive[lv->items[i]] || tri_has(s, t, q)) continue;
+            for (j = 0; j < 3; j++) {
+                a[j] = s->coords + (size_t)t[j] * s->dim;
+                b[j] = t[j] == v ? s->coords + (size_t)q * s->dim : a[j];
+            }
+            triangle_normal(a[0], a[1], a[2], n0);
+            triangle_normal(b[0], b[1], b[2], n1);
+            if (n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2] <= 0.0) return 0;
+        }
+        v = s->wedge[v];
+    } while (v != p);
+    return 1;
+}
+
+static int apply_collapse(simplifier *s, unsigned int p, unsigned int q)
+{
+    unsigned int v = p, next, seen;
+    int i, j, live, u;
+    double e;
+
+    do {
+        int_list *lv = &s->vtris[v];
+        next = s->wedge[v];
+        u = wedge_target(s, v, q, &e);
+        if (u >= 0) {
+            int_list *lu = &s->vtris[u];
+            double *qv = s->quadrics + (size_t)v * s->qsize, *qu = s->quadrics + (size_t)u * s->qsize;
+            for (i = 0; i < lv->count; i++) {
+                int t = lv->items[i];
+                unsigned int *tri = s->tris + t * 3;
+                if (!s->alive[t]) continue;
+                if (tri_has(s, tri, q)) {
+                    s->alive[t] = 0;
+                    s->alive_count--;
+                    continue;
+                }
+                for (j = 0; j < 3; j++) if (tri[j] == v) tri[j] = (unsigned int)u;
+                if (!list_push(lu, t)) return 0;
+            }
+            for (i = 0; i < s->qsize; i++) qu[i] += qv[i];
+        }
+        free(lv->items);
+        lv->items = NULL;
+        lv->count = lv->cap = 0;
+        v = next;
+    } while (v != p);
+    s->kind[p] = VK_LOCKED;
+    s->version[p]++;
+    s->version[q]++;
+
+    /* drop dead triangles from the lists of q's copies and queue its edges again */
+    seen = ++s->stamp;
+    s->mark[q] = seen;
+    v = q;
+    do {
+        int_list *lu = &s->vtris[v];
+        for (i = 0, live = 0; i < lu->count; i++) {
+            int t = lu->items[i];
+            const unsigned int *tri = s->tris + t * 3;
+            if (!s->alive[t]) continue;
+            lu->items[live++] = t;
+            for (j = 0; j < 3; j++) {
+                unsigned int w = s->remap[tri[j]];
+                if (s->mark[w] == seen) continue;
+                s->mark[w] = seen;
+                if (!push_collapse(s, q, w) || !push_collapse(s, w, q)) return 0;
+            }
+        }
+        lu->count = live;
+        v = s->wedge[v];
+    } while (v != q);
+    return 1;
+}
+
+/* collapse until target_tris remain or the next collapse costs more than
+   max_error2; returns 0 when out of memory */
+static int simplifier_run(simplifier *s, int target_tris, double max_error2)
+{
+    int pass;
+    for (pass = 0; pass < MAX_PASSES; pass++) {
+        int progress = 0;
+        if (pass > 0 && !push_all_edges(s)) return 0;
+        while (s->alive_count > target_tris && s->heap_count > 0) {
+            collapse c = heap_pop(s);
+            if (c.vfrom != s->version[c.from] || c.vto != s->version[c.to]) continue;
+            if (c.cost > max_error2) {
+                /* keep it for a later level with the same bound */
+                return heap_push(s, c.cost, c.from, c.to);
+            }
+            if (!collapse_valid(s, c.from, c.to)) continue;
+            if (!apply_collapse(s, c.from, c.to)) return 0;
+            if (c.cost > s->error) s->error = c.cost;
+            progress = 1;
+        }
+        if (s->alive_count <= target_tris || !progress) break;
+    }
+    return 1;
+}
+
+typedef struct {
+    unsigned int a, b;
+    int tri;
+} edge_ref;
+
+static int compare_edges(const void *x, const void *y)
+{
+    const edge_ref *a = (const edge_ref *)x, *b = (const edge_ref *)y;
+    if (a->a != b->a) return a->a < b->a ? -1 : 1;
+    if (a->b != b->b) return a->b < b->b ? -1 : 1;
+    return 0;
+}
+
+/* link the vertices of the mesh that share a position into rings */
+static int weld_positions(simplifier *s, const float *verts, int stride)
+{
+    size_t size = 1, mask, i;
+    int *table;
+    unsigned int v;
+
+    for (v = 0; v < (unsigned int)s->nv; v++) s->remap[v] = s->wedge[v] = v;
+    while (size < (size_t)s->nv * 2) size <<= 1;
+    mask = size - 1;
+    table = (int *)malloc(size * sizeof(int));
+    if (table == NULL) return 0;
+    for (i = 0; i < size; i++) table[i] = -1;
+    for (v = 0; v < (unsigned int)s->nv; v++) {
+        const float *p = verts + (size_t)v * stride;
+        float key[3];
+        unsigned int bits[3];
+        size_t h;
+        if (s->vtris[v].count == 0) continue;
+        /* -0.0 and 0.0 are the same position */
+        key[0] = p[0] + 0.0f; key[1] = p[1] + 0.0f; key[2] = p[2] + 0.0f;
+        memcpy(bits, key, sizeof(bits));
+        h = (bits[0] * 73856093u ^ bits[1] * 19349663u ^ bits[2] * 83492791u) & mask;
+        for (;; h = (h + 1) & mask) {
+            const float *q;
+            unsigned int r;
+            if (table[h] < 0) {
+                table[h] = v;
+                break;
+            }
+            r = (unsigned int)table[h];
+            q = verts + (size_t)r * stride;
+            if (q[0] == p[0] && q[1] == p[1] && q[2] == p[2]) {
+                s->remap[v] = r;
+                s->wedge[v] = s->wedge[r];
+                s->wedge[r] = v;
+                break;
+            }
+        }
+    }
+    free(table);
+    return 1;
+}
+
+static void simplifier_free(simplifier *s)
+{
+    int i;
+    if (s->vtris != NULL)
+        for (i = 0; i < s->nv; i++) free(s->vtris[i].items);
+    free(s->vtris); free(s->tris); free(s->alive); free(s->coords);
+    free(s->quadrics); free(s->kind); free(s->version); free(s->mark); free(s->heap);
+    free(s->remap); free(s->wedge);
+}
+
+static int simplifier_init(simplifier *s, const unsigned int *idx, int n, const float *verts, const simplify_params *p)
+{
+    double lo[3], hi[3], scale = 0.0;
+    int *border;
+    edge_ref *edges;
+    int i, j, k;
+
+    memset(s, 0, sizeof(*s));
+    s->nt = n / 3;
+    s->nv = vertex_count(idx, n);
+    s->dim = 3 + p->nattr;
+    s->qsize = s->dim * (s->dim + 1) / 2 + s->dim + 2;
+    s->alive_count = s->nt;
+    s->tris = (unsigned int *)malloc((n > 0 ? n : 1) * sizeof(unsigned int));
+    s->alive = (unsigned char *)malloc(s->nt + 1);
+    s->coords = (double *)malloc(((size_t)s->nv * s->dim + 1) * sizeof(double));
+    s->quadrics = (double *)calloc((size_t)s->nv * s->qsize + 1, sizeof(double));
+    s->kind = (unsigned char *)calloc(s->nv + 1, 1);
+    s->version = (unsigned int *)calloc(s->nv + 1, sizeof(unsigned int));
+    s->mark = (unsigned int *)calloc(s->nv + 1, sizeof(unsigned int));
+    s->remap = (unsigned int *)malloc((s->nv + 1) * sizeof(unsigned int));
+    s->wedge = (unsigned int *)malloc((s->nv + 1) * sizeof(unsigned int));
+    s->vtris = (int_list *)calloc(s->nv + 1, sizeof(int_list));
+    border = (int *)calloc(s->nv + 1, sizeof(int));
+    edges = (edge_ref *)malloc((n > 0 ? n : 1) * sizeof(edge_ref));
+    if (s->tris == NULL || s->alive == NULL || s->coords == NULL || s->quadrics == NULL
+        || s->kind == NULL || s->version == NULL || s->mark == NULL || s->vtris == NULL
+        || s->remap == NULL || s->wedge == NULL || border == NULL || edges == NULL) goto fail;
+    memcpy(s->tris, idx, n * sizeof(unsigned int));
+    memset(s->alive, 1, s->nt);
+
+    for (k = 0; k < 3; k++) { lo[k] = HUGE_VAL; hi[k] = -HUGE_VAL; }
+    for (i = 0; i < n; i++) {
+        const float *v = verts + (size_t)idx[i] * p->stride;
+        for (k = 0; k < 3; k++) {
+            if (v[k] < lo[k]) lo[k] = v[k];
+            if (v[k] > hi[k]) hi[k] = v[k];
+        }
+    }
+    for (k = 0; k < 3; k++) if (n > 0 && hi[k] - lo[k] > scale) scale = hi[k] - lo[k];
+    scale = scale > 0.0 ? 1.0 / scale : 1.0;
+    for (i = 0; i < s->nv; i++) {
+        const float *v = verts + (size_t)i * p->stride;
+        double *c = s->coords + (size_t)i * s->dim;
+        for (k = 0; k < 3; k++) c[k] = (v[k] - (n > 0 ? lo[k] : 0.0)) * scale;
+        for (k = 0; k < p->nattr; k++) c[3 + k] = v[p->attr_offset[k]] * p->attr_weight[k];
+    }
+
+    for (i = 0; i < s->nt; i++) {
+        const unsigned int *t = idx + i * 3;
+        const double *a = s->coords + (size_t)t[0] * s->dim;
+        const double *b = s->coords + (size_t)t[1] * s->dim;
+        const double *c = s->coords + (size_t)t[2] * s->dim;
+        double nrm[3], area;
+        triangle_normal(a, b, c, nrm);
+        area = 0.5 * sqrt(nrm[0] * nrm[0] + nrm[1] * nrm[1] + nrm[2] * nrm[2]);
+        for (k = 0; k < 3; k++) {
+            quadric_add_triangle(s->quadrics + (size_t)t[k] * s->qsize, s->dim, a, b, c, area);
+            if (!list_push(&s->vtris[t[k]], i)) goto fail;
+        }
+    }
+    if (!weld_positions(s, verts, p->stride)) goto fail;
+
+    /* classify the edges between positions: used once is a border, more
+       than twice is locked, and so is an edge between copies of one
+       position */
+    for (i = 0; i < n; i++) {
+        unsigned int a = s->remap[idx[i]], b = s->remap[idx[i % 3 == 2 ? i - 2 : i + 1]];
+        edges[i].a = a < b ? a : b;
+        edges[i].b = a < b ? b : a;
+        edges[i].tri = i / 3;
+    }
+    qsort(edges, n, sizeof(edge_ref), compare_edges);
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && compare_edges(&edges[i], &edges[j]) == 0; j++);
+        if (edges[i].a == edges[i].b) {
+            s->kind[edges[i].a] = VK_LOCKED;
+        } else if (j - i == 1) {
+            const unsigned int *t = idx + edges[i].tri * 3;
+            const double *a = s->coords + (size_t)edges[i].a * s->dim;
+            const double *b = s->coords + (size_t)edges[i].b * s->dim;
+            double nrm[3], e[3], m[3], l, len2;
+            triangle_normal(s->coords + (size_t)t[0] * s->dim, s->coords + (size_t)t[1] * s->dim,
+                            s->coords + (size_t)t[2] * s->dim, nrm);
+            for (k = 0; k < 3; k++) e[k] = b[k] - a[k];
+            len2 = e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+            m[0] = e[1] * nrm[2] - e[2] * nrm[1];
+            m[1] = e[2] * nrm[0] - e[0] * nrm[2];
+            m[2] = e[0] * nrm[1] - e[1] * nrm[0];
+            l = sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+            if (l > 0.0) {
+                double dist;
+                for (k = 0; k < 3; k++) m[k] /= l;
+                dist = -(m[0] * a[0] + m[1] * a[1] + m[2] * a[2]);
+                /* on the copies in the border triangle */
+                for (k = 0; k < 3; k++)
+                    if (s->remap[t[k]] == edges[i].a || s->remap[t[k]] == edges[i].b)
+                        quadric_add_plane(s->quadrics + (size_t)t[k] * s->qsize, s->dim, m, dist, BORDER_WEIGHT * len2);
+            }
+            border[edges[i].a]++;
+            border[edges[i].b]++;
+        } else if (j - i > 2) {
+            s->kind[edges[i].a] = VK_LOCKED;
+            s->kind[edges[i].b] = VK_LOCKED;
+        }
+    }
+    for (i = 0; i < s->nv; i++) {
+        if (s->kind[i] == VK_LOCKED || border[i] == 0) continue;
+        s->kind[i] = border[i] == 2 ? VK_BORDER : VK_LOCKED;
+    }
+    free(border);
+    free(edges);
+    border = NULL;
+    edges = NULL;
+    if (!push_all_edges(s)) goto fail;
+    return 1;
+fail:
+    free(border);
+    free(edges);
+    simplifier_free(s);
+    return 0;
+}
+
+/* one mesh of a batch; every level is written with the width of the
+   input index type so it can become a bigarray without copying */
+typedef struct {
+    unsigned int *idx;
+    int n;
+    const float *verts;
+    int wide;
+    void **levels;
+    int *counts;
+    double *errors;
+    int ok;
+} lod_job;
+
+typedef struct {
+    lod_job *jobs;
+    int count;
+    int next;
+    const simplify_params *params;
+    double ratio;
+    int levels;
+} lod_batch;
+
+static void run_lod_job(lod_job *job, const lod_batch *b)
+{
+    simplifier s;
+    double max_error2 = b->params->max_error * b->params->max_error;
+    int l, t, i;
+
+    if (!simplifier_init(&s, job->idx, job->n, job->verts, b->params)) return;
+    for (l = 1; l <= b->levels; l++) {
+        int target = (int)(s.nt * pow(b->ratio, l) + 1e-6);
+        void *out;
+        if (!simplifier_run(&s, target, max_error2)) goto done;
+        out = malloc((s.alive_count * 3 + 1) * (job->wide ? sizeof(unsigned int) : sizeof(unsigned short)));
+        if (out == NULL) goto done;
+        for (t = 0, i = 0; t < s.nt; t++) {
+            const unsigned int *tri = s.tris + t * 3;
+            int k;
+            if (!s.alive[t]) continue;
+            for (k = 0; k < 3; k++, i++) {
+                if (job->wide) ((unsigned int *)out)[i] = tri[k];
+                else ((unsigned short *)out)[i] = (unsigned short)tri[k];
+            }
+        }
+        job->levels[l] = out;
+        job->counts[l] = i;
+        job->errors[l] = sqrt(s.error);
+    }
+    job->ok = 1;
+done:
+    simplifier_free(&s);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI lod_worker(LPVOID arg)
+#else
+static void *lod_worker(void *arg)
+#endif
+{
+    lod_batch *b = (lod_batch *)arg;
+    for (;;) {
+        int i = __sync_fetch_and_add(&b->next, 1);
+        if (i >= b->count) break;
+        run_lod_job(&b->jobs[i], b);
+    }
+    return 0;
+}
+
+static int cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* Runs the batch on up to nthreads threads including the caller. If a
+   thread can not be started its share is picked up by the others. */
+static void run_lod_batch(lod_batch *b, int nthreads)
+{
+#ifdef _WIN32
+    HANDLE *threads;
+#else
+    pthread_t *threads;
+#endif
+    int i, started = 0;
+
+    if (nthreads > b->count) nthreads = b->count;
+    threads = nthreads > 1 ? malloc((nthreads - 1) * sizeof(*threads)) : NULL;
+    if (threads != NULL) {
+        for (i = 0; i < nthreads - 1; i++) {
+#ifdef _WIN32
+            threads[started] = CreateThread(NULL, 0, lod_worker, b, 0, NULL);
+            if (threads[started] == NULL) break;
+#else
+            if (pthread_create(&threads[started], NULL, lod_worker, b) != 0) break;
+#endif
+            started++;
+        }
+    }
+    lod_worker(b);
+    for (i = 0; i < started; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+    free(threads);
+}
+
+static void free_lod_jobs(lod_job *jobs, int count, int levels)
+{
+    int i, l;
+    for (i = 0; i < count; i++) {
+        free(jobs[i].idx);
+        if (jobs[i].levels != NULL)
+            for (l = 1; l <= levels; l++) free(jobs[i].levels[l]);
+        free(jobs[i].levels);
+        free(jobs[i].counts);
+        free(jobs[i].errors);
+    }
+    free(jobs);
+}
+
+/* The jobs live in a custom block while the results are built, so the level
+   buffers not yet handed to a bigarray are freed if an allocation raises. */
+typedef struct {
+    lod_job *jobs;
+    int count;
+    int levels;
+} lod_jobs_box;
+
+static void release_lod_jobs(value v)
+{
+    lod_jobs_box *box = Data_custom_val(v);
+    if (box->jobs != NULL) free_lod_jobs(box->jobs, box->count, box->levels);
+    box->jobs = NULL;
+}
+
+static struct custom_operations lod_jobs_ops = {
+    "glcaml.glmesh.lod_jobs",
+    release_lod_jobs,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+    custom_compare_ext_default
+};
+
+value glmeshstub_lod_chains(value vparams, value vmeshes, value vratio, value vlevels, value vthreads)
+{
+    CAMLparam5(vparams, vmeshes, vratio, vlevels, vthreads);
+    CAMLlocal5(result, chain, pair, ba, err);
+    CAMLlocal1(vjobs);
+    simplify_params params;
+    lod_batch batch;
+    lod_jobs_box *box;
+    lod_job *jobs;
+    value vattrs = Field(vparams, 1);
+    int count = Wosize_val(vmeshes);
+    int levels = Int_val(vlevels);
+    int nthreads = Int_val(vthreads);
+    double ratio = Double_val(vratio);
+    int i, l, failed = 0;
+
+    params.stride = Int_val(Field(vparams, 0));
+    params.nattr = Wosize_val(vattrs);
+    params.max_error = Double_val(Field(vparams, 2));
+    if (params.stride < 3 || params.nattr > MAX_ATTRIBUTES || levels < 0
+        || !(ratio >= 0.0 && ratio <= 1.0)) invalid_argument("Glmesh.lod_chains");
+    for (i = 0; i < params.nattr; i++) {
+        params.attr_offset[i] = Int_val(Field(Field(vattrs, i), 0));
+        params.attr_weight[i] = Double_val(Field(Field(vattrs, i), 1));
+        if (params.attr_offset[i] < 3 || params.attr_offset[i] >= params.stride)
+            invalid_argument("Glmesh.lod_chains: attribute offset out of the vertex");
+    }
+    for (i = 0; i < count; i++) {
+        value vidx = Field(Field(vmeshes, i), 0);
+        value vverts = Field(Field(vmeshes, i), 1);
+        index_kind(vidx);
+        if (Bigarray_val(vidx)->dim[0] % 3 != 0)
+            invalid_argument("Glmesh: index count is not a multiple of 3");
+        if ((Bigarray_val(vverts)->flags & BIGARRAY_KIND_MASK) != BIGARRAY_FLOAT32)
+            invalid_argument("Glmesh.lod_chains: vertex array must be float_array");
+    }
+
+    vjobs = alloc_custom(&lod_jobs_ops, sizeof(lod_jobs_box), 0, 1);
+    box = Data_custom_val(vjobs);
+    box->jobs = NULL;
+    jobs = (lod_job *)calloc(count + 1, sizeof(lod_job));
+    if (jobs == NULL) raise_out_of_memory();
+    box->jobs = jobs;
+    box->count = count;
+    box->levels = levels;
+    for (i = 0; i < count && !failed; i++) {
+        value vidx = Field(Field(vmeshes, i), 0);
+        value vverts = Field(Field(vmeshes, i), 1);
+        lod_job *job = &jobs[i];
+        job->n = Bigarray_val(vidx)->dim[0];
+        job->wide = (Bigarray_val(vidx)->flags & BIGARRAY_KIND_MASK) == BIGARRAY_INT32;
+        job->verts = Data_bigarray_val(vverts);
+        job->idx = (unsigned int *)malloc((job->n > 0 ? job->n : 1) * sizeof(unsigned int));
+        job->levels = (void **)calloc(levels + 1, sizeof(void *));
+        job->counts = (int *)calloc(levels + 1, sizeof(int));
+        job->errors = (double *)calloc(levels + 1, sizeof(double));
+        if (job->idx == NULL || job->levels == NULL || job->counts == NULL || job->errors == NULL) {
+            failed = 1;
+            break;
+        }
+        if (job->wide) {
+            memcpy(job->idx, Data_bigarray_val(vidx), job->n * sizeof(unsigned int));
+        } else {
+            unsigned short *src = Data_bigarray_val(vidx);
+            for (l = 0; l < job->n; l++) job->idx[l] = src[l];
+        }
+        job->counts[0] = job->n;
+        if (!indices_in_range(job->idx, job->n)) failed = 3;
+        else if ((long)vertex_count(job->idx, job->n) * params.stride > Bigarray_val(vverts)->dim[0]) failed = 2;
+    }
+    if (failed) {
+        release_lod_jobs(vjobs);
+        if (failed == 3) invalid_argument("Glmesh: index too large");
+        if (failed == 2) invalid_argument("Glmesh.lod_chains: index out of range of the vertex array");
+        raise_out_of_memory();
+    }
+
+    batch.jobs = jobs;
+    batch.count = count;
+    batch.next = 0;
+    batch.params = &params;
+    batch.ratio = ratio;
+    batch.levels = levels;
+    caml_enter_blocking_section();
+    run_lod_batch(&batch, nthreads > 0 ? nthreads : cpu_count());
+    caml_leave_blocking_section();
+    for (i = 0; i < count; i++) if (!jobs[i].ok) failed = 1;
+    if (failed) {
+        release_lod_jobs(vjobs);
+        raise_out_of_memory();
+    }
+
+    result = alloc(count, 0);
+    for (i = 0; i < count; i++) {
+        int kind = jobs[i].wide ? BIGARRAY_INT32 : BIGARRAY_UINT16;
+        chain = alloc(levels + 1, 0);
+        Store_field(result, i, chain);
+        for (l = 0; l <= levels; l++) {
+            if (l == 0) {
+                ba = Field(Field(vmeshes, i), 0);
+            } else {
+                ba = alloc_bigarray_dims(kind | BIGARRAY_C_LAYOUT | BIGARRAY_MANAGED, 1,
+                                         jobs[i].levels[l], (long)jobs[i].counts[l]);
+                jobs[i].levels[l] = NULL;
+            }
+            err = copy_double(jobs[i].errors[l]);
+            pair = alloc_tuple(2);
+            Store_field(pair, 0, ba);
+            Store_field(pair, 1, err);
+            Store_field(chain, l, pair);
+        }
+    }
+    release_lod_jobs(vjobs);
+    CAMLreturn(result);
+}
@@ -0,0 +1,118 @@
+(* Batched drawing of textured 2D quads *)
+
+open Glcaml
+
+type sprite = {
+  mutable x : float;
+  mutable y : float;
+  mutable width : float;
+  mutable height : float;
+  mutable origin_x : float;
+  mutable origin_y : float;
+  mutable rotation : float;
+  mutable u0 : float;
+  mutable v0 : float;
+  mutable u1 : float;
+  mutable v1 : float;
+  mutable red : float;
+  mutable green : float;
+  mutable blue : float;
+  mutable alpha : float;
+}
+
+(* the first fields are read and written by glsprite_stub.c *)
+type t = {
+  capacity : int;
+  sort_by_texture : bool;
+  vertices : float_array;
+  sorted : float_array;
+  textures : word_array;
+  mutable count : int;
+  mutable calls : int;
+  vertex_buffer : int;
+  index_buffer : int;
+}
+
+let max_sprites = 16384
+
+(* x, y, u, v as floats and r, g, b, a as bytes *)
+let vertex_size = 20
+let sprite_floats = 20
+
+external add_sprite : t -> int -> sprite -> unit = "glspritestub_add"
+external prepare : t -> int array = "glspritestub_prepare"
+
+let make_sprite x y width height = {
+  x = x; y = y; width = width; height = height;
+  origin_x = 0.0; origin_y = 0.0; rotation = 0.0;
+  u0 = 0.0; v0 = 0.0; u1 = 1.0; v1 = 1.0;
+  red = 1.0; green = 1.0; blue = 1.0; alpha = 1.0 }
+
+let create capacity sort_by_texture =
+  if capacity <= 0 || capacity > max_sprites then invalid_arg "Glsprite.create";
+  let buffers = Array.make 2 0 in
+  glGenBuffers 2 buffers;
+  let indices = make_ushort_array (capacity * 6) in
+  for i = 0 to capacity - 1 do
+    let v = i * 4 and k = i * 6 in
+    indices.{k} <- v;
+    indices.{k + 1} <- v + 1;
+    indices.{k + 2} <- v + 2;
+    indices.{k + 3} <- v + 2;
+    indices.{k + 4} <- v + 3;
+    indices.{k + 5} <- v
+  done;
+  glBindBuffer gl_element_array_buffer buffers.(1);
+  glBufferData gl_element_array_buffer (capacity * 6 * 2) indices gl_static_draw;
+  glBindBuffer gl_element_array_buffer 0;
+  { capacity = capacity;
+    sort_by_texture = sort_by_texture;
+    vertices = make_float_array (capacity * sprite_floats);
+    sorted = make_float_array (if sort_by_texture then capacity * sprite_floats else 0);
+    textures = make_word_array capacity;
+    count = 0;
+    calls = 0;
+    vertex_buffer = buffers.(0);
+    index_buffer = buffers.(1) }
+
+let count b = b.count
+
+let draw_calls b = b.calls
+
+let flush b =
+  if b.count > 0 then begin
+    let runs = prepare b in
+    glBindBuffer gl_array_buffer b.vertex_buffer;
+    (* respecifying the whole store lets the driver hand out fresh memory
+       instead of waiting for the previous flush to be drawn *)
+    glBufferData gl_array_buffer (b.count * 4 * vertex_size)
+      (if b.sort_by_texture then b.sorted else b.vertices) gl_stream_draw;
+    glBindBuffer gl_element_array_buffer b.index_buffer;
+    glEnableClientState gl_vertex_array;
+    glEnableClientState gl_texture_coord_array;
+    glEnableClientState gl_color_array;
+    glVertexPointer 2 gl_float vertex_size 0;
+    glTexCoordPointer 2 gl_float vertex_size 8;
+    glColorPointer 4 gl_unsigned_byte vertex_size 16;
+    let i = ref 0 in
+    while !i < Array.length runs do
+      glBindTexture gl_texture_2d runs.(!i);
+      glDrawElements gl_triangles (runs.(!i + 2) * 6) gl_unsigned_short (runs.(!i + 1) * 6 * 2);
+      i := !i + 3
+    done;
+    glDisableClientState gl_color_array;
+    glDisableClientState gl_texture_coord_array;
+    glDisableClientState gl_vertex_array;
+    glBindBuffer gl_element_array_buffer 0;
+    glBindBuffer gl_array_buffer 0;
+    b.calls <- Array.length runs / 3;
+    b.count <- 0
+  end else
+    b.calls <- 0
+
+let add b texture s =
+  if b.count >= b.capacity then flush b;
+  add_sprite b texture s
+
+let delete b =
+  glDeleteBuffers 2 [| b.vertex_buffer; b.index_buffer |]
@@ -0,0 +1,74 @@
+(** Batched drawing of textured 2D quads.
+
+  Sprites are accumulated in a client side vertex array by C code, one call per sprite,
+  and drawn with a single [glDrawElements] per texture when the batch is flushed,
+  through a streamed vertex buffer object. A batch needs OpenGL 1.5 vertex buffer
+  objects and must be created after the context.
+
+  [flush] sets up the vertex, texture coordinate and colour arrays itself and disables
+  them again afterwards. Blending, the projection and [gl_texture_2d] are left to the
+  caller. *)
+
+(** A sprite, in the caller's 2D coordinates.
+  The quad covers [width * height], placed so that the point [origin_x, origin_y] of
+  the quad (relative to its first corner) is at [x, y], and rotated around that point
+  by [rotation] radians. [u0, v0] are the texture coordinates of the first corner,
+  [u1, v1] of the opposite one. The colour components are from 0.0 to 1.0 and
+  modulate the texture under the default texture environment.
+  All fields are floats and mutable, so one record can be reused without allocation. *)
+type sprite = {
+  mutable x : float;
+  mutable y : float;
+  mutable width : float;
+  mutable height : float;
+  mutable origin_x : float;
+  mutable origin_y : float;
+  mutable rotation : float;
+  mutable u0 : float;
+  mutable v0 : float;
+  mutable u1 : float;
+  mutable v1 : float;
+  mutable red : float;
+  mutable green : float;
+  mutable blue : float;
+  mutable alpha : float;
+}
+
+(** A sprite batch *)
+type t
+
+(** The largest capacity of a batch, limited by 16-bit indices *)
+val max_sprites : int
+
+(** [make_sprite x y width height -> sprite]
+  Makes an unrotated white sprite with its first corner at [x, y] showing the whole texture. *)
+val make_sprite : float -> float -> float -> float -> sprite
+
+(** [create capacity sort_by_texture -> batch]
+  Creates a batch holding up to [capacity] sprites between flushes. When
+  [sort_by_texture] is true, [flush] groups the sprites by texture, so each texture is
+  bound once; sprites with the same texture keep their order, but sprites with
+  different textures may be drawn in another order than they were added. Otherwise
+  only consecutive sprites with the same texture share a draw call. *)
+val create : int -> bool -> t
+
+(** [add batch texture sprite]
+  Adds a sprite drawn with the texture object [texture] (0 for none). Flushes the
+  batch first when it is full. *)
+val add : t -> int -> sprite -> unit
+
+(** [count batch -> sprites]
+  The number of sprites waiting to be drawn *)
+val count : t -> int
+
+(** [flush batch]
+  Draws the sprites added since the last flush and empties the batch. *)
+val flush : t -> unit
+
+(** [draw_calls batch -> n]
+  The number of [glDrawElements] calls made by the last [flush] *)
+val draw_calls : t -> int
+
+(** [delete batch]
+  Deletes the buffer objects of the batch; it must not be used afterwards. *)
+val delete : t -> unit
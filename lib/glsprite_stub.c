@@ -0,0 +1,143 @@
+/*
+ * Glsprite - sprite vertex generation and texture sorting for Glsprite.
+ *
+ * The vertex data is written straight into the batch's float bigarray so
+ * that adding a sprite is one call without allocation; the OpenGL calls
+ * are made from glsprite.ml.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+
+/* fields of Glsprite.t */
+#define BATCH_CAPACITY 0
+#define BATCH_SORT 1
+#define BATCH_VERTICES 2
+#define BATCH_SORTED 3
+#define BATCH_TEXTURES 4
+#define BATCH_COUNT 5
+
+/* fields of Glsprite.sprite, a float record */
+enum {
+    SPRITE_X, SPRITE_Y, SPRITE_WIDTH, SPRITE_HEIGHT, SPRITE_ORIGIN_X, SPRITE_ORIGIN_Y,
+    SPRITE_ROTATION, SPRITE_U0, SPRITE_V0, SPRITE_U1, SPRITE_V1,
+    SPRITE_RED, SPRITE_GREEN, SPRITE_BLUE, SPRITE_ALPHA
+};
+
+/* x, y, u, v and 4 colour bytes per vertex, 4 vertices per sprite */
+#define VERTEX_FLOATS 5
+#define SPRITE_FLOATS (4 * VERTEX_FLOATS)
+
+static unsigned char color_byte(double c)
+{
+    return c <= 0.0 ? 0 : c >= 1.0 ? 255 : (unsigned char)(c * 255.0 + 0.5);
+}
+
+value glspritestub_add(value vbatch, value vtexture, value vsprite)
+{
+    CAMLparam3(vbatch, vtexture, vsprite);
+    int n = Int_val(Field(vbatch, BATCH_COUNT));
+    float *v;
+    double x, y, w, h, ox, oy, r, c = 1.0, s = 0.0;
+    double lx[4], ly[4], tu[4], tv[4];
+    unsigned char rgba[4];
+    int i;
+
+    if (n >= Int_val(Field(vbatch, BATCH_CAPACITY))) invalid_argument("Glsprite.add");
+    v = (float *)Data_bigarray_val(Field(vbatch, BATCH_VERTICES)) + n * SPRITE_FLOATS;
+    x = Double_field(vsprite, SPRITE_X);
+    y = Double_field(vsprite, SPRITE_Y);
+    w = Double_field(vsprite, SPRITE_WIDTH);
+    h = Double_field(vsprite, SPRITE_HEIGHT);
+    ox = Double_field(vsprite, SPRITE_ORIGIN_X);
+    oy = Double_field(vsprite, SPRITE_ORIGIN_Y);
+    r = Double_field(vsprite, SPRITE_ROTATION);
+    if (r != 0.0) {
+        c = cos(r);
+        s = sin(r);
+    }
+    lx[0] = -ox;    ly[0] = -oy;
+    lx[1] = w - ox; ly[1] = -oy;
+    lx[2] = w - ox; ly[2] = h - oy;
+    lx[3] = -ox;    ly[3] = h - oy;
+    tu[0] = tu[3] = Double_field(vsprite, SPRITE_U0);
+    tu[1] = tu[2] = Double_field(vsprite, SPRITE_U1);
+    tv[0] = tv[1] = Double_field(vsprite, SPRITE_V0);
+    tv[2] = tv[3] = Double_field(vsprite, SPRITE_V1);
+    rgba[0] = color_byte(Double_field(vsprite, SPRITE_RED));
+    rgba[1] = color_byte(Double_field(vsprite, SPRITE_GREEN));
+    rgba[2] = color_byte(Double_field(vsprite, SPRITE_BLUE));
+    rgba[3] = color_byte(Double_field(vsprite, SPRITE_ALPHA));
+    for (i = 0; i < 4; i++, v += VERTEX_FLOATS) {
+        v[0] = (float)(x + lx[i] * c - ly[i] * s);
+        v[1] = (float)(y + lx[i] * s + ly[i] * c);
+        v[2] = (float)tu[i];
+        v[3] = (float)tv[i];
+        memcpy(&v[4], rgba, 4);
+    }
+    ((int *)Data_bigarray_val(Field(vbatch, BATCH_TEXTURES)))[n] = Int_val(vtexture);
+    Field(vbatch, BATCH_COUNT) = Val_int(n + 1);
+    CAMLreturn(Val_unit);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Returns [| texture; first; count; ... |] for each run of sprites that
+   share a texture. When the batch sorts, the sprites are first copied to
+   the sorted array in texture order; sprites with the same texture keep
+   the order they were added in. */
+value glspritestub_prepare(value vbatch)
+{
+    CAMLparam1(vbatch);
+    CAMLlocal1(result);
+    int n = Int_val(Field(vbatch, BATCH_COUNT));
+    const unsigned int *tex = Data_bigarray_val(Field(vbatch, BATCH_TEXTURES));
+    unsigned long long *keys = NULL;
+    int *runs;
+    int i, nruns = 0;
+
+    runs = (int *)malloc((n * 3 + 1) * sizeof(int));
+    if (runs == NULL) raise_out_of_memory();
+    if (Bool_val(Field(vbatch, BATCH_SORT)) && n > 0) {
+        const float *src = Data_bigarray_val(Field(vbatch, BATCH_VERTICES));
+        float *dst = Data_bigarray_val(Field(vbatch, BATCH_SORTED));
+        keys = (unsigned long long *)malloc(n * sizeof(unsigned long long));
+        if (keys == NULL) {
+            free(runs);
+            raise_out_of_memory();
+        }
+        for (i = 0; i < n; i++) keys[i] = (unsigned long long)tex[i] << 32 | (unsigned int)i;
+        qsort(keys, n, sizeof(unsigned long long), compare_keys);
+        for (i = 0; i < n; i++) {
+            unsigned int k = (unsigned int)keys[i];
+            memcpy(dst + i * SPRITE_FLOATS, src + k * SPRITE_FLOATS, SPRITE_FLOATS * sizeof(float));
+        }
+    }
+    for (i = 0; i < n; i++) {
+        unsigned int t = keys != NULL ? (unsigned int)(keys[i] >> 32) : tex[i];
+        if (nruns > 0 && (unsigned int)runs[(nruns - 1) * 3] == t) {
+            runs[(nruns - 1) * 3 + 2]++;
+        } else {
+            runs[nruns * 3] = t;
+            runs[nruns * 3 + 1] = i;
+            runs[nruns * 3 + 2] = 1;
+            nruns++;
+        }
+    }
+    free(keys);
+    result = alloc(nruns * 3, 0);
+    for (i = 0; i < nruns * 3; i++) Field(result, i) = Val_int(runs[i]);
+    free(runs);
+    CAMLreturn(result);
+}
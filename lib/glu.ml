@@ -0,0 +1,6 @@
+(* Polygon tessellation and mipmap generation without GLU *)
+
+external tessellate : Glcaml.float_array -> int array -> ('a, 'b, Bigarray.c_layout) Bigarray.Array1.t -> int
+= "glustub_tessellate"
+external build_mipmaps : Glcaml.ubyte_array -> int -> int -> bool -> Glcaml.ubyte_array array
+= "glustub_build_mipmaps"
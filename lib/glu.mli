@@ -0,0 +1,23 @@
+(** Polygon tessellation and mipmap generation, in place of the GLU library.
+
+  Neither function calls OpenGL and both release the OCaml runtime while they work,
+  so they can run on other threads and before a context has been created. *)
+
+(** [tessellate points contours indices -> index_count]
+  Triangulates a polygon with holes. [points] holds [x, y] pairs; [contours] gives the
+  number of points in each ring, taken from [points] in order: the first ring is the
+  outline, the others are holes. Rings may have either orientation and need not be
+  closed explicitly.
+  The triangles are written to [indices] ([Glcaml.ushort_array] or [Glcaml.word_array])
+  as indices into [points], counter-clockwise, and the number of indices is returned.
+  [indices] needs room for [3 * (points + 2 * holes - 2)] indices; degenerate input
+  produces fewer. Raises [Invalid_argument] if the array is too small. *)
+val tessellate : Glcaml.float_array -> int array -> ('a, 'b, Bigarray.c_layout) Bigarray.Array1.t -> int
+
+(** [build_mipmaps pixels width height srgb -> levels]
+  Builds the full mipmap chain of an RGBA image of [width * height] 4 byte pixels,
+  down to 1x1. Level 0 is [pixels] itself; each further level halves the previous one,
+  rounding down, with a box filter that also handles odd sizes correctly. When [srgb]
+  is true the colour channels are filtered in linear light, as for
+  [gl_srgb8_alpha8] textures. Level [i] is meant for [glTexImage2D] with level [i]. *)
+val build_mipmaps : Glcaml.ubyte_array -> int -> int -> bool -> Glcaml.ubyte_array array
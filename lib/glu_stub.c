@@ -0,0 +1,598 @@
+/*
+ * Glu - polygon tessellation and mipmap generation without GLU.
+ *
+ * Nothing here calls OpenGL, and the work is done with the OCaml runtime
+ * released, so these may run on worker threads before a context exists.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/signals.h>
+#include <caml/bigarray.h>
+
+/* ----------------------------- tessellation ---------------------------- */
+
+/* Ear clipping with hole elimination, following the structure of Mapbox's
+   earcut: holes are joined to the outer ring by bridge edges, ears are
+   clipped from the resulting single ring, and rings that stop yielding
+   ears are cleaned of self intersections or split along a diagonal. */
+
+typedef struct tess_node {
+    int i;
+    double x, y;
+    struct tess_node *prev, *next;
+    int steiner;
+} tess_node;
+
+typedef struct {
+    tess_node *pool;
+    int used, cap;
+    unsigned int *out;
+    int count;
+} tessellator;
+
+static tess_node *insert_node(tessellator *t, int i, double x, double y, tess_node *last)
+{
+    tess_node *p = &t->pool[t->used++];
+    p->i = i; p->x = x; p->y = y; p->steiner = 0;
+    if (last == NULL) {
+        p->prev = p->next = p;
+    } else {
+        p->next = last->next;
+        p->prev = last;
+        last->next->prev = p;
+        last->next = p;
+    }
+    return p;
+}
+
+static void remove_node(tess_node *p)
+{
+    p->next->prev = p->prev;
+    p->prev->next = p->next;
+}
+
+static void emit(tessellator *t, const tess_node *a, const tess_node *b, const tess_node *c)
+{
+    t->out[t->count++] = a->i;
+    t->out[t->count++] = b->i;
+    t->out[t->count++] = c->i;
+}
+
+/* twice the signed area, negative for a counter-clockwise turn */
+static double area(const tess_node *p, const tess_node *q, const tess_node *r)
+{
+    return (q->y - p->y) * (r->x - q->x) - (q->x - p->x) * (r->y - q->y);
+}
+
+static int equals(const tess_node *a, const tess_node *b)
+{
+    return a->x == b->x && a->y == b->y;
+}
+
+static int point_in_triangle(double ax, double ay, double bx, double by, double cx, double cy, double px, double py)
+{
+    return (cx - px) * (ay - py) >= (ax - px) * (cy - py)
+        && (ax - px) * (by - py) >= (bx - px) * (ay - py)
+        && (bx - px) * (cy - py) >= (cx - px) * (by - py);
+}
+
+static int sign(double v)
+{
+    return (v > 0.0) - (v < 0.0);
+}
+
+static int on_segment(const tess_node *p, const tess_node *q, const tess_node *r)
+{
+    return q->x <= (p->x > r->x ? p->x : r->x) && q->x >= (p->x < r->x ? p->x : r->x)
+        && q->y <= (p->y > r->y ? p->y : r->y) && q->y >= (p->y < r->y ? p->y : r->y);
+}
+
+static int intersects(const tess_node *p1, const tess_node *q1, const tess_node *p2, const tess_node *q2)
+{
+    int o1 = sign(area(p1, q1, p2));
+    int o2 = sign(area(p1, q1, q2));
+    int o3 = sign(area(p2, q2, p1));
+    int o4 = sign(area(p2, q2, q1));
+
+    if (o1 != o2 && o3 != o4) return 1;
+    if (o1 == 0 && on_segment(p1, p2, q1)) return 1;
+    if (o2 == 0 && on_segment(p1, q2, q1)) return 1;
+    if (o3 == 0 && on_segment(p2, p1, q2)) return 1;
+    if (o4 == 0 && on_segment(p2, q1, q2)) return 1;
+    return 0;
+}
+
+static int intersects_polygon(const tess_node *a, const tess_node *b)
+{
+    const tess_node *p = a;
+    do {
+        if (p->i != a->i && p->next->i != a->i && p->i != b->i && p->next->i != b->i
+            && intersects(p, p->next, a, b)) return 1;
+        p = p->next;
+    } while (p != a);
+    return 0;
+}
+
+static int locally_inside(const tess_node *a, const tess_node *b)
+{
+    return area(a->prev, a, a->next) < 0.0
+        ? area(a, b, a->next) >= 0.0 && area(a, a->prev, b) >= 0.0
+        : area(a, b, a->prev) < 0.0 || area(a, a->next, b) < 0.0;
+}
+
+static int middle_inside(const tess_node *a, const tess_node *b)
+{
+    const tess_node *p = a;
+    int inside = 0;
+    double px = (a->x + b->x) / 2.0, py = (a->y + b->y) / 2.0;
+    do {
+        if (((p->y > py) != (p->next->y > py)) && p->next->y != p->y
+            && px < (p->next->x - p->x) * (py - p->y) / (p->next->y - p->y) + p->x)
+            inside = !inside;
+        p = p->next;
+    } while (p != a);
+    return inside;
+}
+
+static int is_valid_diagonal(const tess_node *a, const tess_node *b)
+{
+    return a->next->i != b->i && a->prev->i != b->i && !intersects_polygon(a, b)
+        && ((locally_inside(a, b) && locally_inside(b, a) && middle_inside(a, b)
+             && (area(a->prev, a, b->prev) != 0.0 || area(a, b->prev, b) != 0.0))
+            || (equals(a, b) && area(a->prev, a, a->next) > 0.0 && area(b->prev, b, b->next) > 0.0));
+}
+
+/* join a and b with a pair of opposite edges, returning the copy of b */
+static tess_node *split_polygon(tessellator *t, tess_node *a, tess_node *b)
+{
+    tess_node *a2 = insert_node(t, a->i, a->x, a->y, NULL);
+    tess_node *b2 = insert_node(t, b->i, b->x, b->y, NULL);
+    tess_node *an = a->next, *bp = b->prev;
+
+    a->next = b; b->prev = a;
+    a2->next = an; an->prev = a2;
+    b2->next = a2; a2->prev = b2;
+    bp->next = b2; b2->prev = bp;
+    return b2;
+}
+
+/* remove duplicate and collinear points */
+static tess_node *filter_points(tess_node *start, tess_node *end)
+{
+    tess_node *p = start;
+    int again;
+
+    if (start == NULL) return NULL;
+    if (end == NULL) end = start;
+    do {
+        again = 0;
+        if (!p->steiner && (equals(p, p->next) || area(p->prev, p, p->next) == 0.0)) {
+            remove_node(p);
+            p = end = p->prev;
+            if (p == p->next) break;
+            again = 1;
+        } else {
+            p = p->next;
+        }
+    } while (again || p != end);
+    return end;
+}
+
+static int is_ear(const tess_node *ear)
+{
+    const tess_node *a = ear->prev, *b = ear, *c = ear->next, *p;
+
+    if (area(a, b, c) >= 0.0) return 0;
+    for (p = c->next; p != a; p = p->next) {
+        if (!(p->x == a->x && p->y == a->y)
+            && point_in_triangle(a->x, a->y, b->x, b->y, c->x, c->y, p->x, p->y)
+            && area(p->prev, p, p->next) >= 0.0) return 0;
+    }
+    return 1;
+}
+
+static tess_node *cure_local_intersections(tessellator *t, tess_node *start)
+{
+    tess_node *p = start;
+    do {
+        tess_node *a = p->prev, *b = p->next->next;
+        if (!equals(a, b) && intersects(a, p, p->next, b) && locally_inside(a, b) && locally_inside(b, a)) {
+            emit(t, a, p, b);
+            remove_node(p);
+            remove_node(p->next);
+            p = start = b;
+        }
+        p = p->next;
+    } while (p != start);
+    return filter_points(p, NULL);
+}
+
+static void earcut_linked(tessellator *t, tess_node *ear, int pass);
+
+static void split_earcut(tessellator *t, tess_node *start)
+{
+    tess_node *a = start;
+    do {
+        tess_node *b = a->next->next;
+        while (b != a->prev) {
+            if (a->i != b->i && t->used + 2 <= t->cap && is_valid_diagonal(a, b)) {
+                tess_node *c = split_polygon(t, a, b);
+                a = filter_points(a, a->next);
+                c = filter_points(c, c->next);
+                earcut_linked(t, a, 0);
+                earcut_linked(t, c, 0);
+                return;
+            }
+            b = b->next;
+        }
+        a = a->next;
+    } while (a != start);
+}
+
+static void earcut_linked(tessellator *t, tess_node *ear, int pass)
+{
+    tess_node *stop;
+
+    if (ear == NULL) return;
+    stop = ear;
+    while (ear->prev != ear->next) {
+        tess_node *prev = ear->prev, *next = ear->next;
+        if (is_ear(ear)) {
+            emit(t, prev, ear, next);
+            remove_node(ear);
+            ear = stop = next->next;
+            continue;
+        }
+        ear = next;
+        if (ear == stop) {
+            if (pass == 0) {
+                earcut_linked(t, filter_points(ear, NULL), 1);
+            } else if (pass == 1) {
+                earcut_linked(t, cure_local_intersections(t, filter_points(ear, NULL)), 2);
+            } else {
+                split_earcut(t, ear);
+            }
+            break;
+        }
+    }
+}
+
+static double signed_area(const float *pts, int start, int end)
+{
+    double sum = 0.0;
+    int i, j = end - 1;
+    for (i = start; i < end; i++) {
+        sum += ((double)pts[j * 2] - pts[i * 2]) * ((double)pts[i * 2 + 1] + pts[j * 2 + 1]);
+        j = i;
+    }
+    return sum;
+}
+
+/* ring of points [start, end) with the requested orientation */
+static tess_node *linked_list(tessellator *t, const float *pts, int start, int end, int clockwise)
+{
+    tess_node *last = NULL;
+    int i;
+
+    if (end <= start) return NULL;
+    if (clockwise == (signed_area(pts, start, end) > 0.0)) {
+        for (i = start; i < end; i++) last = insert_node(t, i, pts[i * 2], pts[i * 2 + 1], last);
+    } else {
+        for (i = end - 1; i >= start; i--) last = insert_node(t, i, pts[i * 2], pts[i * 2 + 1], last);
+    }
+    if (last != NULL && equals(last, last->next)) {
+        remove_node(last);
+        last = last->next;
+    }
+    return last;
+}
+
+static int sector_contains_sector(const tess_node *m, const tess_node *p)
+{
+    return area(m->prev, m, p->prev) < 0.0 && area(p->next, m, m->next) < 0.0;
+}
+
+/* the outer vertex that the hole's leftmost point can be bridged to */
+static tess_node *find_hole_bridge(tess_node *hole, tess_node *outer)
+{
+    tess_node *p = outer, *m = NULL, *stop;
+    double hx = hole->x, hy = hole->y, qx = -HUGE_VAL, mx, my, tan_min = HUGE_VAL;
+
+    do {
+        if (hy <= p->y && hy >= p->next->y && p->next->y != p->y) {
+            double x = p->x + (hy - p->y) * (p->next->x - p->x) / (p->next->y - p->y);
+            if (x <= hx && x > qx) {
+                qx = x;
+                m = p->x < p->next->x ? p : p->next;
+                if (x == hx) return m;
+            }
+        }
+        p = p->next;
+    } while (p != outer);
+    if (m == NULL) return NULL;
+
+    stop = m;
+    mx = m->x;
+    my = m->y;
+    p = m;
+    do {
+        if (hx >= p->x && p->x >= mx && hx != p->x
+            && point_in_triangle(hy < my ? hx : qx, hy, mx, my, hy < my ? qx : hx, hy, p->x, p->y)) {
+            double tan = fabs(hy - p->y) / (hx - p->x);
+            if (locally_inside(p, hole)
+                && (tan < tan_min || (tan == tan_min && (p->x > m->x || (p->x == m->x && sector_contains_sector(m, p)))))) {
+                m = p;
+                tan_min = tan;
+            }
+        }
+        p = p->next;
+    } while (p != stop);
+    return m;
+}
+
+static int compare_leftmost(const void *a, const void *b)
+{
+    const tess_node *p = *(tess_node * const *)a, *q = *(tess_node * const *)b;
+    if (p->x != q->x) return p->x < q->x ? -1 : 1;
+    if (p->y != q->y) return p->y < q->y ? -1 : 1;
+    return 0;
+}
+
+static tess_node *eliminate_holes(tessellator *t, const float *pts, const int *starts, int nholes, int npts, tess_node *outer)
+{
+    tess_node **queue = (tess_node **)malloc((nholes + 1) * sizeof(tess_node *));
+    int i, n = 0;
+
+    if (queue == NULL) return NULL;
+    for (i = 0; i < nholes; i++) {
+        int end = i + 1 < nholes ? starts[i + 1] : npts;
+        tess_node *list = linked_list(t, pts, starts[i], end, 0), *p, *left;
+        if (list == NULL) continue;
+        if (list == list->next) list->steiner = 1;
+        left = p = list;
+        do {
+            if (p->x < left->x || (p->x == left->x && p->y < left->y)) left = p;
+            p = p->next;
+        } while (p != list);
+        queue[n++] = left;
+    }
+    qsort(queue, n, sizeof(tess_node *), compare_leftmost);
+    for (i = 0; i < n; i++) {
+        tess_node *bridge = find_hole_bridge(queue[i], outer);
+        tess_node *reverse;
+        if (bridge == NULL) continue;
+        reverse = split_polygon(t, bridge, queue[i]);
+        filter_points(reverse, reverse->next);
+        outer = filter_points(bridge, bridge->next);
+    }
+    free(queue);
+    return outer;
+}
+
+value glustub_tessellate(value vpts, value vcontours, value vidx)
+{
+    CAMLparam3(vpts, vcontours, vidx);
+    int ncontours = Wosize_val(vcontours);
+    int npts = Bigarray_val(vpts)->dim[0] / 2;
+    int kind = Bigarray_val(vidx)->flags & BIGARRAY_KIND_MASK;
+    int capacity = Bigarray_val(vidx)->dim[0];
+    const float *pts = Data_bigarray_val(vpts);
+    int *starts;
+    tessellator t;
+    tess_node *outer;
+    int i, total = 0, ok = 1;
+
+    if ((Bigarray_val(vpts)->flags & BIGARRAY_KIND_MASK) != BIGARRAY_FLOAT32)
+        invalid_argument("Glu.tessellate: points must be float_array");
+    if (kind != BIGARRAY_UINT16 && kind != BIGARRAY_INT32)
+        invalid_argument("Glu.tessellate: index array must be ushort_array or word_array");
+    if (ncontours == 0) CAMLreturn(Val_int(0));
+    starts = (int *)malloc(ncontours * sizeof(int));
+    if (starts == NULL) raise_out_of_memory();
+    for (i = 0; i < ncontours; i++) {
+        int len = Int_val(Field(vcontours, i));
+        starts[i] = total;
+        if (len < 0) ok = 0;
+        total += len;
+    }
+    if (!ok || total > npts) {
+        free(starts);
+        invalid_argument("Glu.tessellate: contours exceed the points");
+    }
+    if (kind == BIGARRAY_UINT16 && total > 65536) {
+        free(starts);
+        invalid_argument("Glu.tessellate: too many points for ushort_array");
+    }
+
+    /* bridges and splits add two nodes each; every triangle removes one */
+    t.cap = 4 * total + 8 * ncontours + 16;
+    t.used = 0;
+    t.count = 0;
+    t.pool = (tess_node *)malloc(t.cap * sizeof(tess_node));
+    t.out = (unsigned int *)malloc(3 * t.cap * sizeof(unsigned int));
+    if (t.pool == NULL || t.out == NULL) {
+        free(t.pool); free(t.out); free(starts);
+        raise_out_of_memory();
+    }
+
+    caml_enter_blocking_section();
+    outer = linked_list(&t, pts, 0, ncontours > 1 ? starts[1] : total, 1);
+    if (outer != NULL && outer->next != outer->prev) {
+        if (ncontours > 1) {
+            outer = eliminate_holes(&t, pts, starts + 1, ncontours - 1, total, outer);
+            if (outer == NULL) ok = 0;
+        }
+        if (ok) earcut_linked(&t, outer, 0);
+    }
+    caml_leave_blocking_section();
+
+    free(starts);
+    free(t.pool);
+    if (!ok) {
+        free(t.out);
+        raise_out_of_memory();
+    }
+    if (t.count > capacity) {
+        free(t.out);
+        invalid_argument("Glu.tessellate: index array is too small");
+    }
+    if (kind == BIGARRAY_UINT16) {
+        unsigned short *dst = Data_bigarray_val(vidx);
+        for (i = 0; i < t.count; i++) dst[i] = (unsigned short)t.out[i];
+    } else {
+        memcpy(Data_bigarray_val(vidx), t.out, t.count * sizeof(unsigned int));
+    }
+    free(t.out);
+    CAMLreturn(Val_int(t.count));
+}
+
+/* ------------------------------- mipmaps ------------------------------- */
+
+/* Each level halves the previous one (rounding down, at least 1). Odd
+   sizes use the three tap polyphase box filter so that every source texel
+   contributes with its true coverage instead of dropping the last row or
+   column. Levels are filtered in float from the previous level, in linear
+   light when the source is sRGB encoded. */
+
+static float srgb_to_linear(int c)
+{
+    double v = c / 255.0;
+    return (float)(v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+}
+
+#define LINEAR_STEPS 4096
+
+static unsigned char linear_to_srgb(double v)
+{
+    double s = v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+    return (unsigned char)(s * 255.0 + 0.5);
+}
+
+/* weights of the source texels 2x, 2x+1, 2x+2 for destination texel x */
+static void box_weights(int src, int dst, int x, float *w)
+{
+    if (src == 1) {
+        w[0] = 1.0f; w[1] = 0.0f; w[2] = 0.0f;
+    } else if (src % 2 == 0) {
+        w[0] = 0.5f; w[1] = 0.5f; w[2] = 0.0f;
+    } else {
+        w[0] = (float)(dst - x) / src;
+        w[1] = (float)dst / src;
+        w[2] = (float)(x + 1) / src;
+    }
+}
+
+static void downsample(const float *src, int sw, int sh, float *dst, int dw, int dh)
+{
+    int x, y, i, j, c;
+    for (y = 0; y < dh; y++) {
+        float wy[3];
+        box_weights(sh, dh, y, wy);
+        for (x = 0; x < dw; x++) {
+            float wx[3], acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+            box_weights(sw, dw, x, wx);
+            for (j = 0; j < 3; j++) {
+                int sy = sh == 1 ? 0 : y * 2 + j;
+                if (wy[j] == 0.0f) continue;
+                for (i = 0; i < 3; i++) {
+                    const float *p;
+                    float w = wx[i] * wy[j];
+                    if (w == 0.0f) continue;
+                    p = src + ((size_t)sy * sw + (sw == 1 ? 0 : x * 2 + i)) * 4;
+                    for (c = 0; c < 4; c++) acc[c] += p[c] * w;
+                }
+            }
+            for (c = 0; c < 4; c++) dst[((size_t)y * dw + x) * 4 + c] = acc[c];
+        }
+    }
+}
+
+static int build_mipmaps(const unsigned char *pixels, int w, int h, int srgb, unsigned char **levels, int nlevels)
+{
+    float to_linear[256];
+    unsigned char from_linear[LINEAR_STEPS + 1];
+    float *cur, *next;
+    size_t i;
+    int l, c;
+
+    for (i = 0; i < 256; i++) to_linear[i] = srgb ? srgb_to_linear(i) : i / 255.0f;
+    for (i = 0; i <= LINEAR_STEPS; i++)
+        from_linear[i] = srgb ? linear_to_srgb((double)i / LINEAR_STEPS) : (unsigned char)((double)i / LINEAR_STEPS * 255.0 + 0.5);
+
+    cur = (float *)malloc((size_t)w * h * 4 * sizeof(float));
+    next = (float *)malloc(((size_t)(w / 2 > 0 ? w / 2 : 1) * (h / 2 > 0 ? h / 2 : 1)) * 4 * sizeof(float));
+    if (cur == NULL || next == NULL) {
+        free(cur); free(next);
+        return 0;
+    }
+    for (i = 0; i < (size_t)w * h; i++) {
+        for (c = 0; c < 3; c++) cur[i * 4 + c] = to_linear[pixels[i * 4 + c]];
+        cur[i * 4 + 3] = pixels[i * 4 + 3] / 255.0f;
+    }
+    for (l = 1; l < nlevels; l++) {
+        int nw = w / 2 > 0 ? w / 2 : 1, nh = h / 2 > 0 ? h / 2 : 1;
+        unsigned char *out = levels[l];
+        float *tmp;
+        downsample(cur, w, h, next, nw, nh);
+        for (i = 0; i < (size_t)nw * nh; i++) {
+            for (c = 0; c < 3; c++) {
+                float v = next[i * 4 + c];
+                v = v < 0.0f ? 0.0f : v > 1.0f ? 1.0f : v;
+                out[i * 4 + c] = from_linear[(int)(v * LINEAR_STEPS + 0.5f)];
+            }
+            out[i * 4 + 3] = (unsigned char)(next[i * 4 + 3] * 255.0f + 0.5f);
+        }
+        tmp = cur; cur = next; next = tmp;
+        w = nw;
+        h = nh;
+    }
+    free(cur);
+    free(next);
+    return 1;
+}
+
+value glustub_build_mipmaps(value vpixels, value vw, value vh, value vsrgb)
+{
+    CAMLparam4(vpixels, vw, vh, vsrgb);
+    CAMLlocal2(result, level);
+    const unsigned char *pixels = Data_bigarray_val(vpixels);
+    int w = Int_val(vw), h = Int_val(vh);
+    int nlevels = 1, lw, lh, l, ok;
+    unsigned char **levels;
+
+    if ((Bigarray_val(vpixels)->flags & BIGARRAY_KIND_MASK) != BIGARRAY_UINT8)
+        invalid_argument("Glu.build_mipmaps: pixels must be ubyte_array");
+    if (w <= 0 || h <= 0 || Bigarray_val(vpixels)->dim[0] < (long)w * h * 4)
+        invalid_argument("Glu.build_mipmaps");
+    for (lw = w, lh = h; lw > 1 || lh > 1; nlevels++) {
+        lw = lw / 2 > 0 ? lw / 2 : 1;
+        lh = lh / 2 > 0 ? lh / 2 : 1;
+    }
+
+    /* the OCaml allocations may raise, so they come before the C ones */
+    result = alloc(nlevels, 0);
+    Store_field(result, 0, vpixels);
+    for (l = 1, lw = w, lh = h; l < nlevels; l++) {
+        lw = lw / 2 > 0 ? lw / 2 : 1;
+        lh = lh / 2 > 0 ? lh / 2 : 1;
+        level = alloc_bigarray_dims(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT, 1, NULL, (long)lw * lh * 4);
+        Store_field(result, l, level);
+    }
+    levels = (unsigned char **)malloc(nlevels * sizeof(unsigned char *));
+    if (levels == NULL) raise_out_of_memory();
+    for (l = 1; l < nlevels; l++) levels[l] = Data_bigarray_val(Field(result, l));
+
+    caml_enter_blocking_section();
+    ok = build_mipmaps(pixels, w, h, Bool_val(vsrgb), levels, nlevels);
+    caml_leave_blocking_section();
+    free(levels);
+    if (!ok) raise_out_of_memory();
+    CAMLreturn(result);
+}
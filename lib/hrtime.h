@@ -0,0 +1,58 @@
+/*
+ * hrtime.h - monotonic nanosecond clock and precise waits, shared by the
+ * stubs. Waits sleep until shortly before the deadline and spin the rest,
+ * since sleeps can overshoot by a scheduler tick.
+ */
+
+#ifndef HRTIME_H
+#define HRTIME_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* nanoseconds of a monotonic clock */
+static inline long long hrtime_ns(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER c;
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&c);
+    return c.QuadPart / freq.QuadPart * 1000000000LL
+        + c.QuadPart % freq.QuadPart * 1000000000LL / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+static inline void hrtime_sleep_ns(long long ns)
+{
+#ifdef _WIN32
+    if (ns >= 1000000) Sleep((DWORD)(ns / 1000000));
+#else
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+/* Waits until the clock reaches [deadline], sleeping until [spin]
+   nanoseconds before it and spinning after that. */
+static inline void hrtime_wait_until(long long deadline, long long spin)
+{
+    long long now = hrtime_ns();
+    if (deadline - now > spin) hrtime_sleep_ns(deadline - now - spin);
+    while (hrtime_ns() < deadline) {
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * present_stats.h - frame-time statistics for the buffer swap paths of
+ * win_stub.c and sdl_stub.c.
+ *
+ * Each swap is timed on the CPU. When the platform reports when a frame
+ * actually reached the screen (GLX_OML_sync_control, GLX_INTEL_swap_event)
+ * the frame times are taken from those present times instead. The last
+ * FRAME_WINDOW frame times are kept, with a histogram of them in
+ * BUCKET_NS wide buckets; the last bucket also counts longer frames.
+ */
+
+#ifndef PRESENT_STATS_H
+#define PRESENT_STATS_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hrtime.h"
+
+#define FRAME_WINDOW 256
+#define HISTOGRAM_BUCKETS 80
+#define BUCKET_NS 500000LL
+
+struct present_stats {
+    long long frames;
+    long long swap_start, swap_end;   /* CPU time around the last swap */
+    long long present;                /* last known present time */
+    long long msc;                    /* its vertical retrace count, or -1 */
+    int hardware;                     /* present times come from the driver */
+    long long intervals[FRAME_WINDOW];
+    int head, filled;
+    int histogram[HISTOGRAM_BUCKETS];
+};
+
+static void present_stats_reset(struct present_stats *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->msc = -1;
+}
+
+static int bucket_of(long long interval)
+{
+    long long b = interval / BUCKET_NS;
+    return b >= HISTOGRAM_BUCKETS ? HISTOGRAM_BUCKETS - 1 : (int)b;
+}
+
+/* Adds a frame that reached the screen at [present]. The first frame only
+   sets the reference point. */
+static void present_stats_record(struct present_stats *s, long long present, long long msc, int hardware)
+{
+    if (s->present != 0 && present > s->present) {
+        long long interval = present - s->present;
+        if (s->filled == FRAME_WINDOW)
+            s->histogram[bucket_of(s->intervals[s->head])]--;
+        else
+            s->filled++;
+        s->intervals[s->head] = interval;
+        s->histogram[bucket_of(interval)]++;
+        s->head = (s->head + 1) % FRAME_WINDOW;
+    }
+    s->present = present;
+    s->msc = msc;
+    s->hardware = hardware;
+}
+
+static int compare_intervals(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* [| frames; swap_start; swap_end; present; msc; hardware;
+      mean; min; max; median; 99th percentile |], times in seconds */
+#define PRESENT_FIELDS 11
+
+static value present_stats_value(const struct present_stats *s)
+{
+    CAMLparam0();
+    CAMLlocal1(result);
+    long long sorted[FRAME_WINDOW], sum = 0;
+    double stats[PRESENT_FIELDS];
+    int i, n = s->filled;
+
+    memcpy(sorted, s->intervals, n * sizeof(long long));
+    qsort(sorted, n, sizeof(long long), compare_intervals);
+    for (i = 0; i < n; i++) sum += sorted[i];
+    stats[0] = (double)s->frames;
+    stats[1] = s->swap_start * 1e-9;
+    stats[2] = s->swap_end * 1e-9;
+    stats[3] = s->present * 1e-9;
+    stats[4] = (double)s->msc;
+    stats[5] = s->hardware;
+    stats[6] = n > 0 ? sum * 1e-9 / n : 0.0;
+    stats[7] = n > 0 ? sorted[0] * 1e-9 : 0.0;
+    stats[8] = n > 0 ? sorted[n - 1] * 1e-9 : 0.0;
+    stats[9] = n > 0 ? sorted[n / 2] * 1e-9 : 0.0;
+    stats[10] = n > 0 ? sorted[(n * 99) / 100] * 1e-9 : 0.0;
+    result = alloc(PRESENT_FIELDS * Double_wosize, Double_array_tag);
+    for (i = 0; i < PRESENT_FIELDS; i++) Store_double_field(result, i, stats[i]);
+    CAMLreturn(result);
+}
+
+static value present_histogram_value(const struct present_stats *s)
+{
+    CAMLparam0();
+    CAMLlocal1(result);
+    int i;
+    result = alloc(HISTOGRAM_BUCKETS, 0);
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) Field(result, i) = Val_int(s->histogram[i]);
+    CAMLreturn(result);
+}
+
+#endif
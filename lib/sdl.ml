@@ -71,6 +71,31 @@ module Video = struct
   = "sdlstub_free_surface"
   external surface_pixels : surface -> byte_array
   = "sdlstub_surface_pixels"
+  external surface_pitch : surface -> int
+  = "sdlstub_surface_pitch"
+
+  external surface_rows8_view : surface -> (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array2.t
+  = "sdlstub_surface_rows8"
+  external surface_rows16_view : surface -> (int, Bigarray.int16_unsigned_elt, Bigarray.c_layout) Bigarray.Array2.t
+  = "sdlstub_surface_rows16"
+  external surface_rows32_view : surface -> (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array2.t
+  = "sdlstub_surface_rows32"
+  external surface_channels_view : surface -> (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array3.t
+  = "sdlstub_surface_channels"
+
+  external is_video_surface : surface -> bool
+  = "sdlstub_is_video_surface"
+
+  (* a view holds a reference on its surface until it is collected, except
+     on the display surface, which SDL frees itself *)
+  let keep_surface s view =
+    if not (is_video_surface s) then Gc.finalise (fun _ -> free_surface s) view;
+    view
+
+  let surface_rows8 s = keep_surface s (surface_rows8_view s)
+  let surface_rows16 s = keep_surface s (surface_rows16_view s)
+  let surface_rows32 s = keep_surface s (surface_rows32_view s)
+  let surface_channels s = keep_surface s (surface_channels_view s)
   external surface_width : surface -> int
   = "sdlstub_surface_width"
   external surface_height : surface -> int
@@ -139,6 +164,27 @@ module Video = struct
   = "sdlstub_update_rect"
   external update_rects : surface -> rect array -> unit
   = "sdlstub_update_rects"
+  external track_dirty : surface -> int -> unit
+  = "sdlstub_track_dirty"
+  external untrack_dirty : unit -> unit
+  = "sdlstub_untrack_dirty"
+  external mark_dirty : surface -> int -> int -> int -> int -> unit
+  = "sdlstub_mark_dirty"
+  external flush_dirty : unit -> int
+  = "sdlstub_flush_dirty"
+
+  type dirty_stats = {
+    dirty_flushes : int;
+    dirty_rects : int;
+    pixels_pushed : int;
+    full_screen_pixels : int
+  }
+
+  external dirty_stats' : unit -> int * int * int * int
+  = "sdlstub_dirty_stats"
+  let dirty_stats () =
+    let (f, r, p, full) = dirty_stats' () in
+    { dirty_flushes = f; dirty_rects = r; pixels_pushed = p; full_screen_pixels = full }
   external flip : surface -> unit
   = "sdlstub_flip"
   external blit_surface : surface -> rect option ->
@@ -210,8 +256,53 @@ type gl_attr =
 
   external swap_buffers : unit -> unit = "sdlstub_GL_swap_buffers"
 
+  type present_timing = {
+    frames : int;
+    swap_start : float;
+    swap_end : float;
+    present : float;
+    msc : int;
+    hardware_timing : bool;
+    mean_frame_time : float;
+    min_frame_time : float;
+    max_frame_time : float;
+    median_frame_time : float;
+    p99_frame_time : float;
+  }
+
+  external present_timing' : unit -> float array = "sdlstub_GL_present_timing"
+
+  let present_timing () =
+    let a = present_timing' () in
+    { frames = int_of_float a.(0);
+      swap_start = a.(1);
+      swap_end = a.(2);
+      present = a.(3);
+      msc = int_of_float a.(4);
+      hardware_timing = a.(5) <> 0.0;
+      mean_frame_time = a.(6);
+      min_frame_time = a.(7);
+      max_frame_time = a.(8);
+      median_frame_time = a.(9);
+      p99_frame_time = a.(10) }
+
+  external frame_histogram : unit -> int array = "sdlstub_GL_frame_histogram"
+
+  let histogram_bucket_width = 0.0005
+
+  external reset_present_timing : unit -> unit = "sdlstub_GL_reset_present_timing"
+
   external load_bmp : string -> Video.surface = "sdlstub_GL_load_bmp"
 
+  external prepare_surface : Video.surface -> bool -> bool -> unit = "sdlstub_GL_prepare_surface"
+
+  external prepare_surface_into : Video.surface -> bool -> bool -> byte_array -> unit
+  = "sdlstub_GL_prepare_surface_into"
+
+  external upload_surface : Video.surface -> int -> int -> bool -> unit = "sdlstub_GL_upload_surface"
+
+  external texture_format : Video.surface -> int * int * int = "sdlstub_GL_texture_format"
+
   external set_attribute : gl_attr -> int -> unit = "sdlstub_set_attribute"
 
   external get_attribute : gl_attr -> int = "sdlstub_get_attribute"
@@ -231,6 +322,18 @@ module Event  = struct
 
   external get_mouse_state: unit -> int * int * int = "sdlstub_get_mouse_state"
 
+  type mouse_state = {
+    mutable mouse_buttons : int;
+    mutable mouse_x : int;
+    mutable mouse_y : int;
+    mutable mouse_xrel : int;
+    mutable mouse_yrel : int
+  }
+
+  let make_mouse_state () = { mouse_buttons = 0; mouse_x = 0; mouse_y = 0; mouse_xrel = 0; mouse_yrel = 0 }
+
+  external read_mouse_state : mouse_state -> unit = "sdlstub_read_mouse_state" [@@noalloc]
+
   (* SDLKey enum *)
   type key = K_UNKNOWN | K_FIRST | K_BACKSPACE | K_TAB | K_CLEAR | K_RETURN | K_PAUSE | K_ESCAPE | K_SPACE | K_EXCLAIM | K_QUOTEDBL | K_HASH | K_DOLLAR | K_AMPERSAND | K_QUOTE | K_LEFTPAREN | K_RIGHTPAREN | K_ASTERISK | K_PLUS | K_COMMA | K_MINUS | K_PERIOD | K_SLASH
   | K_0 | K_1 | K_2 | K_3 | K_4 | K_5 | K_6 | K_7 | K_8 | K_9 | K_COLON | K_SEMICOLON | K_LESS | K_EQUALS | K_GREATER | K_QUESTION | K_AT
@@ -259,6 +362,23 @@ module Event  = struct
   external set_mod_state : key_mod list -> unit = "sdlstub_set_mod_state"
   external get_key_name : key -> string = "sdlstub_get_key_name"
 
+  external key_of_code : int -> key = "%identity"
+  external code_of_key : key -> int = "%identity"
+
+  external get_key_state' : unit -> byte_array = "sdlstub_get_key_state"
+  external key_syms : unit -> int array = "sdlstub_key_syms"
+
+  let key_state = ref None
+
+  let get_key_state () =
+    match !key_state with
+    | Some k -> k
+    | None -> let k = get_key_state' () in key_state := Some k; k
+
+  let key_sym = key_syms ()
+
+  let is_key_pressed (keys : byte_array) (k : key) = keys.{key_sym.(code_of_key k)} <> 0
+
   type press_release = RELEASED | PRESSED
 
   type lost_gained = LOST | GAINED
@@ -347,6 +467,37 @@ module Event  = struct
   external pump_events : unit -> unit = "sdlstub_pump_events"
   external poll_event : unit -> event = "sdlstub_poll_event"
   external wait_event : unit -> event = "sdlstub_wait_event"
+  external poll_events : bool -> event array = "sdlstub_poll_events"
+
+  type event_buffer = (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  let event_words = 8
+
+  let make_event_buffer n = Bigarray.Array1.create Bigarray.int32 Bigarray.c_layout (n * event_words)
+
+  external poll_events_into : event_buffer -> bool -> int = "sdlstub_poll_events_into"
+
+  let event_type (b : event_buffer) i = Int32.to_int b.{i * event_words}
+
+  let event_field (b : event_buffer) i k = Int32.to_int b.{i * event_words + k}
+
+  let ev_active = 1 and ev_key = 2 and ev_motion = 3 and ev_button = 4
+  and ev_jaxis = 5 and ev_jball = 6 and ev_jhat = 7 and ev_jbutton = 8
+  and ev_resize = 9 and ev_expose = 10 and ev_quit = 11 and ev_user = 12 and ev_syswm = 13
+
+  let key_mod_mask = function
+    | KMOD_NONE -> 0x0000 | KMOD_LSHIFT -> 0x0001 | KMOD_RSHIFT -> 0x0002
+    | KMOD_LCTRL -> 0x0040 | KMOD_RCTRL -> 0x0080 | KMOD_LALT -> 0x0100 | KMOD_RALT -> 0x0200
+    | KMOD_LMETA -> 0x0400 | KMOD_RMETA -> 0x0800 | KMOD_NUM -> 0x1000 | KMOD_CAPS -> 0x2000
+    | KMOD_MODE -> 0x4000 | KMOD_RESERVED -> 0x8000
+
+  type replay_speed = REALTIME | AS_FAST_AS_POSSIBLE
+
+  external start_recording : string -> unit = "sdlstub_start_recording"
+  external stop_recording : unit -> unit = "sdlstub_stop_recording"
+  external start_replay : string -> replay_speed -> unit = "sdlstub_start_replay"
+  external stop_replay : unit -> unit = "sdlstub_stop_replay"
+  external replaying : unit -> bool = "sdlstub_replaying"
 
 end
 (***************************** End Events. *************************************************)
@@ -360,6 +511,86 @@ module Timer = struct
   external delay : int -> unit
   = "sdlstub_delay"
 
+  external now_ns : unit -> (int64 [@unboxed])
+  = "sdlstub_now_ns_byte" "sdlstub_now_ns" [@@noalloc]
+
+  type scope = int
+
+  external scope : string -> scope = "sdlstub_profile_scope"
+  external start_profiler : int -> unit = "sdlstub_profile_start"
+  external stop_profiler : unit -> unit = "sdlstub_profile_stop"
+  external enter_scope : scope -> unit = "sdlstub_profile_enter" [@@noalloc]
+  external leave_scope : scope -> unit = "sdlstub_profile_leave" [@@noalloc]
+  external profiler_counts : unit -> int * int = "sdlstub_profile_counts"
+  external export_chrome_trace : string -> unit = "sdlstub_profile_export"
+
+  let profile s f =
+    enter_scope s;
+    let r = try f () with e -> leave_scope s; raise e in
+    leave_scope s;
+    r
+
+  type pacer = {
+    mutable pacer_period : float;
+    mutable pacer_spin : float;
+    mutable pacer_deadline : float;
+    mutable pacer_last_wake : float;
+    mutable pacer_frame_time : float;
+    mutable pacer_accumulator : float;
+    mutable pacer_accumulated_at : float;
+    mutable pacer_alpha : float;
+    mutable pacer_frames : float;
+    mutable pacer_late : float;
+    mutable pacer_overshoot_sum : float;
+    mutable pacer_overshoot_max : float;
+    mutable pacer_overshoot_last : float;
+  }
+
+  type pacer_stats = {
+    paced_frames : int;
+    late_frames : int;
+    mean_overshoot : float;
+    max_overshoot : float;
+    last_overshoot : float;
+  }
+
+  external reset_pacer : pacer -> unit = "sdlstub_pacer_reset"
+  external wait_frame : pacer -> unit = "sdlstub_pacer_wait"
+  external fixed_steps : pacer -> float -> int = "sdlstub_pacer_steps"
+
+  let create_pacer period =
+    if period <= 0.0 then invalid_arg "create_pacer";
+    let p = {
+      pacer_period = period *. 1e9;
+      pacer_spin = 2e6;
+      pacer_deadline = 0.0;
+      pacer_last_wake = 0.0;
+      pacer_frame_time = 0.0;
+      pacer_accumulator = 0.0;
+      pacer_accumulated_at = 0.0;
+      pacer_alpha = 0.0;
+      pacer_frames = 0.0;
+      pacer_late = 0.0;
+      pacer_overshoot_sum = 0.0;
+      pacer_overshoot_max = 0.0;
+      pacer_overshoot_last = 0.0 } in
+    reset_pacer p;
+    p
+
+  let set_pacer_spin p seconds = p.pacer_spin <- seconds *. 1e9
+
+  let frame_time p = p.pacer_frame_time *. 1e-9
+
+  let interpolation p = p.pacer_alpha
+
+  let pacer_stats p =
+    let waited = p.pacer_frames -. p.pacer_late in
+    { paced_frames = int_of_float p.pacer_frames;
+      late_frames = int_of_float p.pacer_late;
+      mean_overshoot = if waited > 0.0 then p.pacer_overshoot_sum *. 1e-9 /. waited else 0.0;
+      max_overshoot = p.pacer_overshoot_max *. 1e-9;
+      last_overshoot = p.pacer_overshoot_last *. 1e-9 }
+
 end
 (***************************** End Timer. ******************************************************)
 
@@ -433,115 +664,64 @@ module Draw = struct
   external get_pixel : Video.surface -> int -> int -> int32
   = "sdldraw_get_pixel"
 
+  type pixel_span = (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  let make_pixel_span n = Bigarray.Array1.create Bigarray.int32 Bigarray.c_layout n
+
+  external read_pixels : Video.surface -> int -> int -> int -> int -> pixel_span -> unit
+  = "sdldraw_read_pixels_byte" "sdldraw_read_pixels"
+
+  external write_pixels : Video.surface -> int -> int -> int -> int -> pixel_span -> unit
+  = "sdldraw_write_pixels_byte" "sdldraw_write_pixels"
+
+  external fill_pixels : Video.surface -> int -> int -> int -> int -> int32 -> unit
+  = "sdldraw_fill_pixels_byte" "sdldraw_fill_pixels"
+
+  external copy_pixels : Video.surface -> int -> int -> Video.surface -> int -> int -> int -> int -> unit
+  = "sdldraw_copy_pixels_byte" "sdldraw_copy_pixels"
+
+  type primitive =
+    | Line of int * int * int * int
+    | Aa_line of int * int * int * int
+    | Thick_line of int * int * int * int * int
+    | Rect of int * int * int * int
+    | Fill_rect of int * int * int * int
+    | Circle of int * int * int
+    | Fill_circle of int * int * int
+    | Ellipse of int * int * int * int
+    | Fill_ellipse of int * int * int * int
+    | Polygon of (int * int) array
+    | Fill_polygon of (int * int) array
+
+  external draw : Video.surface -> primitive -> int32 -> unit = "sdldraw_draw"
+
+  external draw_batch : Video.surface -> (primitive * int32) array -> unit = "sdldraw_draw_batch"
+
+  let draw_line s x0 y0 x1 y1 pixel = draw s (Line (x0, y0, x1, y1)) pixel
+  let draw_aa_line s x0 y0 x1 y1 pixel = draw s (Aa_line (x0, y0, x1, y1)) pixel
+  let draw_thick_line s x0 y0 x1 y1 width pixel = draw s (Thick_line (x0, y0, x1, y1, width)) pixel
+  let draw_rect s x y w h pixel = draw s (Rect (x, y, w, h)) pixel
+  let draw_circle s x y r pixel = draw s (Circle (x, y, r)) pixel
+  let fill_circle s x y r pixel = draw s (Fill_circle (x, y, r)) pixel
+  let draw_ellipse s x y rx ry pixel = draw s (Ellipse (x, y, rx, ry)) pixel
+  let fill_ellipse s x y rx ry pixel = draw s (Fill_ellipse (x, y, rx, ry)) pixel
+  let draw_polygon s points pixel = draw s (Polygon points) pixel
+  let fill_polygon s points pixel = draw s (Fill_polygon points) pixel
+
+  type blend_mode = BLEND_OVER | BLEND_ADD | BLEND_MULTIPLY | BLEND_PREMULTIPLIED
+
+  external composite : Video.surface -> Video.rect option -> Video.surface -> int -> int -> blend_mode -> int -> unit
+  = "sdldraw_composite_byte" "sdldraw_composite"
+
   type tga_orientation = From_upper_left | From_lower_left
 
-  let input_int16 ic =
-    let lo = input_byte ic in
-    let hi = input_byte ic in
-    (hi lsl 8) lor lo
-
-  (*  Targa TGA image file reader, based on the specs at http://astronomy.swin.edu.au/~pbourke/dataformats/tga/
-    Takes as parameter the file name and returns a tuple containing the image width, height, bytes-per-pixel
-    and a string containing the image data in BGR(A) format.
-    Reads 15, 16, 24 and 32 bit-per-pixel raw and RLE-compressed images.
-    Throws TGA_exception when anything goes wrong. *)
-  let read_tga file =
-    try
-    let ic = open_in_bin file in
-    (* Read in TGA header *)
-            let idlength = input_byte ic in
-      let (* colourmaptype *) _ = input_byte ic in
-      let datatypecode = input_byte ic in
-      let (* colourmaporigin *) _ = input_int16 ic in
-      let (* colourmaplength *) _ = input_int16 ic in
-      let (* colourmapdepth  *) _ = input_byte ic in
-      let (* x_origin *) _ = input_int16 ic in
-      let (* y_origin *) _ = input_int16 ic in
-      let width = input_int16 ic in
-      let height = input_int16 ic in
-      let bitsperpixel = input_byte ic in
-      let imagedescriptor = input_byte ic in
-      let rec consume_id cnt =
-        if (cnt > 0) then let _ = input_byte ic in consume_id (cnt - 1)
-      in
-      consume_id idlength;
-      (* Read in TGA data *)
-      let bpp = bitsperpixel/8 in
-      let len = width*height*bpp in
-      let data = String.make len ' ' in
-      let rec decode_run byte pos =
-        let rtype = (byte land 0x80) lsr 7
-        and rlen = ((byte land 0x7F) + 1) in
-        let newpos = pos + rlen * bpp in
-        if rtype = 0 then (* RAW unencoded pixels *)
-          really_input ic data pos (rlen*bpp)
-        else  (* Run length encoded pixels *)
-        begin
-          let b = input_byte ic
-          and g = input_byte ic
-          and r = if bpp > 2 then input_byte ic else -1
-          and a = if bpp > 3 then input_byte ic else -1 in
-          for i = 0 to rlen - 1 do
-            String.set data (pos + bpp*i + 0) (char_of_int b);
-            String.set data (pos + bpp*i + 1) (char_of_int g);
-            if bpp > 2 then String.set data (pos + bpp*i + 2) (char_of_int r);
-            if bpp > 3 then String.set data (pos + bpp*i + 3) (char_of_int a);
-          done;
-        end;
-        if newpos < String.length data then decode_run (input_byte ic) (newpos) else ();
-      in
-      if datatypecode = 2 then
-        really_input ic data 0 len
-      else if datatypecode = 10 then
-        decode_run (input_byte ic) 0
-      else raise (TGA_failure "Cannot decode this TGA file type");
-      close_in ic;
-      let orientation =
-        if imagedescriptor land 0x20 = 0
-        then From_lower_left
-        else From_upper_left
-      in
-      (width, height, bitsperpixel, data, orientation);
-      with
-      _ -> raise (TGA_failure "Unable to load TGA file")
-
-
-  (* Returns an RGBA tuple representing the pixel in string s at position (x,y), with texturemap width w and depth bitsperpixel
-     FIXME: Only checked for 24 and 32 bpp; 15 and 16 bpp untested *)
-  let get_tga_pixel s x y w bitsperpixel =
-    let bpp = bitsperpixel / 8 in
-    let b = int_of_char (String.get s (0 + (y*w + x) * bpp))
-    and g = int_of_char (String.get s (1 + (y*w + x) * bpp))
-    and r = if bitsperpixel > 16 then int_of_char (String.get s (2 + (y*w + x) * bpp)) else 0
-    and a = if bitsperpixel > 24 then int_of_char (String.get s (3 + (y*w + x) * bpp)) else 1
-    in
-    if bitsperpixel > 16 then
-      (r, g, b, a)
-    else if bitsperpixel = 15 then
-      ( ((r lsl 1) land 0xF8), ((r lsl 5) + ((g land 0xE0) lsr 2)), (g lsl 3), (r land 0x80) lsr 7 )
-    else
-      ((r land 0xF8), ((r lsl 5) + ((g land 0xE0) lsr 2)), ((g land 0x1F) lsl 3), 0)
-
-  (* Load a TGA file and return the loaded surface. This is the only exported function. *)
-  let load_tga file =
-    let w, h, bitsperpixel, s, orientation = read_tga file in
-    let surf = Video.create_rgb_surface [Video.SWSURFACE] w h bitsperpixel in
-    for y = 0 to (h - 1) do
-      let ysurf =
-        begin
-        match orientation with
-          From_upper_left -> y
-        | From_lower_left -> (h - 1 - y)
-        end
-      in
-      for x = 0 to (w - 1) do
-      begin
-        let (r,g,b,a) = get_tga_pixel s x y w bitsperpixel in
-         put_pixel surf x ysurf (Video.map_rgba surf r g b a);
-      end;
-      done;
-    done;
-    surf
+  let _ = Callback.register_exception "TGA_failure" (TGA_failure "")
+
+  (* Targa TGA images are decoded in C, with the runtime lock released *)
+  external read_tga : string -> int * int * int * string * tga_orientation = "sdldraw_read_tga"
+  external read_tga_rgba : string -> int * int * byte_array = "sdldraw_read_tga_rgba"
+  external load_tga : string -> Video.surface = "sdldraw_load_tga"
+  external load_tga_bytes : byte_array -> Video.surface = "sdldraw_load_tga_bytes"
 
 
   (* SFont texturemapped fonts based on the specifications at http://www.linux-games.com/sfont/
@@ -555,10 +735,12 @@ module Draw = struct
     and pink = Video.map_rgba surf 255 0 255 255
     and w = Video.surface_width surf
     and h = (Video.surface_height surf) - 1 in
+    let first_row = make_pixel_span w in
+    read_pixels surf 0 0 w 1 first_row;
     let rec make_sfont_list lastpink ch x x1 x2 =
       if x >= w then [] else
       begin
-        let pixel = get_pixel surf x 0 in
+        let pixel = first_row.{x} in
         let ispink = (pixel = pink) in
         match lastpink, ispink with
         | true, true -> make_sfont_list ispink ch (x+1) x1 x2;
@@ -593,159 +775,37 @@ module Draw = struct
 
 
 (******************* Bitmap scaling **********************)
-  (*
-  let print_array a =
-    let dim = Array.length a.(0) in
-    for i = 0 to (dim - 1) do
-      for j = 0 to (dim - 1) do
-        Printf.printf "%f\t" a.(i).(j);
-      done;
-      Printf.printf "\n";
-    done
-  *)
-
-  let normalize a =
-    let total = ref 0.0 in
-    let dim = Array.length a.(0) in
-    for i = 0 to (dim - 1) do
-      for j = 0 to (dim - 1) do
-        total := !total +.  a.(i).(j);
-      done;
-    done;
-    for i = 0 to (dim - 1) do
-      for j = 0 to (dim - 1) do
-        a.(i).(j) <- (a.(i).(j) /. !total);
-      done;
-    done;
-    a
-
-  let dist x y dim =
-    let x2 = (float_of_int x) -. ((float_of_int dim) /. 2.0)
-    and y2 = (float_of_int y) -. ((float_of_int dim) /. 2.0)
-    in (sqrt ((x2 *. x2) +. (y2 *. y2)))
-
-  let box_filter dim =
-    normalize (Array.make_matrix dim dim 1.0)
-
-  let tent_filter dim =
-    let t = dist dim dim dim in
-    let f x =  (t -. (abs_float x)) /. t in
-    let a = Array.make_matrix (dim+1) (dim+1) 0.0 in
-    for i = 0 to dim do
-      for j = 0 to dim do
-        a.(i).(j) <- f (dist i j dim);
-      done;
-    done;
-    normalize a
-
-  let lanczos3_filter dim =
-    let f x =
-      if (abs_float x) > 3.0 then 0.0 else
-      let pi = 4.0 *. atan 1.0 in
-      let pix' = pi *. x in
-      let pix = if (abs_float pix') > 0.1 then pix' else 0.1 in
-      let pix3 = pix /. 3.0 in
-      ((sin pix)/. pix) *. ((sin pix3) /. pix3)
-    in
-    let a = Array.make_matrix (dim+1) (dim+1) 0.0 in
-    let dim2 = dist dim dim dim in
-    for i = 0 to dim do
-      for j = 0 to dim do
-        a.(i).(j) <- f ((dist i j dim) *. 3.0 /. dim2);
-      done;
-    done;
-    normalize a
-
-  let create_filter filter dim =
-    if filter = box then (box_filter dim)
-    else if filter = triangle then (tent_filter dim)
-    else lanczos3_filter (dim + 4)
-
-  let round f =
-    (int_of_float (f +. 0.5))
-
-  let pixel_round f =
-    let c = round f in
-    if c > 255 then 255 else if c < 0 then  0 else c
-
-
-  let convolute kernel s x y =
-  let r = ref 0.0 and g = ref 0.0 and b = ref 0.0 and a = ref 0.0 in
-  let h = (Video.surface_height s)
-  and w = (Video.surface_width s) in
-  let len = (Array.length kernel.(0)) in
-  let halflen = len/2 in
-  for i = (x + halflen - len + 1) to (x + halflen) do
-    for j = (y + halflen - len + 1) to (y + halflen) do
-      let k = i - (x + halflen - len + 1) in
-      let l = j - (y + halflen - len + 1) in
-      let x' = if i >= 0 then (if i < w then i else (w - 1)) else 0 in
-      let y' = if j >= 0 then (if j < h then j else (h - 1)) else 0 in
-      let p = get_pixel s x' y' in
-      let (r',g',b',a') = Video.get_rgba s p in
-      r := !r +. ((float_of_int r') *. kernel.(k).(l) );
-      g := !g +. ((float_of_int g') *. kernel.(k).(l) );
-      b := !b +. ((float_of_int b') *. kernel.(k).(l) );
-      a := !a +. ((float_of_int a') *. kernel.(k).(l) );
-    done;
-  done;
-  Video.map_rgba s (pixel_round !r) (pixel_round !g) (pixel_round !b) (pixel_round !a)
-
-
-  let scale_to s w h filter =
-    let t = Video.create_rgb_surface [Video.SWSURFACE] w h (Video.surface_bpp s) in
-    let w' = (Video.surface_width s) and h' = (Video.surface_height s) in
-    let fw = (float_of_int w')/.(float_of_int w) and fh = (float_of_int h')/.(float_of_int h) in
-    let dim = if fw > 1.0 then fw else 1.0/.fw in
-    let filter' = create_filter filter (round dim) in
-    for i = 0 to ((Video.surface_width t) - 1) do
-      for j = 0 to ((Video.surface_height t) - 1) do
-        let si = (float_of_int i) *. fw and sj = (float_of_int j) *. fh in
-        let p = convolute filter' s (int_of_float si) (int_of_float sj) in
-        put_pixel t i j p;
-      done;
-    done;
-    t
+  external scale_to : Video.surface -> int -> int -> filter -> Video.surface
+  = "sdldraw_scale_to"
 
 
   let scale s f filter =
     let w' = (Video.surface_width s) and h' = (Video.surface_height s) in
     scale_to s (int_of_float ((float_of_int w') *. f)) (int_of_float ((float_of_int h') *. f)) filter
 
-  (* Takes in an  Sdl.surface and a filter (type Sdl.Draw.t_filter) as argument, and returns an array of rectangular
-     bitmaps with the sides' dimension a power of two. The largest bitmap is at offset 0, the
-     smallest at n - 1. If the original bitmap is square and the length of the sides are a power of two
-     then it will be placed unchanged into offset 0, else the bitmap will be resized to the closest
-     suitable size and that wil be used as the base *)
-  let make_mipmaps s filter =
-    let p2 n =
-        let rec p2' n i =
-            if n <= 1 then i else (p2' (n/2) (i+1))
-      in p2' n 0
-    in
-    let rec int_exp m e =
-        if e < 0 then 0 else if e = 0 then 1 else m * (int_exp m (e-1))
-    in
-    let closest_power_of_2 n =
-        let i = (p2 n) in
-        let min = (int_exp 2 i)  and max = (int_exp 2 (i+1)) in
-        if (n - min) < (max - n) then min else max
-    in
-    let w = (Video.surface_width s) and h = (Video.surface_height s) in
-    let dimx' = w
-    and dimy' = h in
-    let dimx = (closest_power_of_2 dimx')
-    and dimy = (closest_power_of_2 dimy') in
-    let dim = if (dimx > dimy) then dimx else dimy in
-    let s2 = if (w = dimx && h = dimy) then s else (scale_to s dimx dimy filter) in
-    let num = ((p2 dim) + 1) in
-    let mipmaps = Array.make num s2 in
-    for i =  1 to (num - 1) do
-      let dimx'' = (dimx/(int_exp 2 i))
-      and dimy'' = (dimy/(int_exp 2 i)) in
-      mipmaps.(i) <- (scale_to s dimx'' dimy'' filter);
-    done;
-    mipmaps
+  type mipmap_level = {
+    level_offset : int;
+    level_width : int;
+    level_height : int;
+  }
+
+  external mipmap_chain : Video.surface -> filter -> bool -> bool -> int -> byte_array * mipmap_level array
+  = "sdldraw_build_mipmaps"
+
+  let level_pixels data l =
+    Bigarray.Array1.sub data l.level_offset (l.level_width * l.level_height * 4)
+
+  external surface_of_rgba : Video.surface -> byte_array -> int -> int -> Video.surface
+  = "sdldraw_surface_of_rgba"
+
+  let make_mipmaps_with s filter srgb power_of_two threads =
+    let data, levels = mipmap_chain s filter srgb power_of_two threads in
+    Array.mapi (fun i l ->
+      if i = 0 && l.level_width = Video.surface_width s && l.level_height = Video.surface_height s then s
+      else surface_of_rgba s (level_pixels data l) l.level_width l.level_height) levels
+
+  (* The largest bitmap is at offset 0, the smallest (1x1) at n - 1; see make_mipmaps_with. *)
+  let make_mipmaps s filter = make_mipmaps_with s filter false true 0
 
 
 end
@@ -80,9 +80,34 @@ module Video : sig
   (** A surface is a software or hardware framebuffer *)
   type surface
 
-  (** Get a byte_array containing the raw pixel data. Non-copying *)
+  (** Get a byte_array containing the raw pixel data, [surface_height * surface_pitch] bytes. Non-copying *)
   val surface_pixels : surface -> byte_array
 
+  (** Get the length of a scanline in bytes, including any padding at its end *)
+  val surface_pitch : surface -> int
+
+  (** [surface_rows8 surface -> view]
+    The pixel memory as [surface_height] rows of [surface_pitch] bytes, without copying. Only the first
+    [surface_width * bpp / 8] bytes of a row are pixels. The view holds a reference on the surface, so the
+    memory stays valid after [free_surface] until the view is collected; arrays made from it with
+    [Bigarray.Array2.slice_left] and the like do not. A view of the display surface holds no reference
+    and is only valid until the video mode is set again or SDL is quit. For surfaces that must be locked, take and use the view
+    between [lock_surface] and [unlock_surface]. *)
+  val surface_rows8 : surface -> (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array2.t
+
+  (** [surface_rows16 surface -> view]
+    Like [surface_rows8], one 16 bit pixel per element, for 16 bit surfaces *)
+  val surface_rows16 : surface -> (int, Bigarray.int16_unsigned_elt, Bigarray.c_layout) Bigarray.Array2.t
+
+  (** [surface_rows32 surface -> view]
+    Like [surface_rows8], one 32 bit pixel per element, for 32 bit surfaces *)
+  val surface_rows32 : surface -> (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array2.t
+
+  (** [surface_channels surface -> view]
+    Like [surface_rows8], indexed by row, column and byte within the pixel. Fails with [Invalid_argument]
+    if the pitch is not a whole number of pixels, as can happen with 24 bit surfaces *)
+  val surface_channels : surface -> (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array3.t
+
   (** Get the surface width in pixels *)
   val surface_width : surface -> int
 
@@ -307,9 +332,41 @@ module Video : sig
     Note: It is advised to call this function only once per frame, since each call has some processing overhead.
     This is no restriction since you can pass any number of rectangles each time.
     The rectangles are not automatically merged or checked for overlap. In general, the programmer can use his or her
-    knowledge about his or her particular rectangles to merge them in an efficient way, to avoid overdraw. *)
+    knowledge about his or her particular rectangles to merge them in an efficient way, to avoid overdraw.
+    The rectangles are copied into a buffer kept between calls, so a frame's update does not allocate. *)
   val update_rects : surface ->  rect array -> unit
 
+  (** [track_dirty surface tile]
+    Starts tracking the dirty region of [surface], usually the screen, on a grid of [tile] x [tile] pixel tiles,
+    replacing any surface tracked before. fill_surface, fill_rect, blit_surface and the Draw functions mark the
+    pixels they write to [surface]; other changes can be marked with [mark_dirty]. *)
+  val track_dirty : surface -> int -> unit
+
+  (** [untrack_dirty ()]
+    Stops tracking and frees the tile grid. *)
+  val untrack_dirty : unit -> unit
+
+  (** [mark_dirty surface x y w h]
+    Marks a rectangle of [surface] as changed; it is clipped to the surface, and ignored if [surface] is not tracked. *)
+  val mark_dirty : surface -> int -> int -> int -> int -> unit
+
+  (** [flush_dirty () -> rects]
+    Covers the marked tiles with rectangles, merging runs of tiles along and across rows, updates them
+    with one [update_rects] call and clears the marks. Returns the number of rectangles sent.
+    Raises Failure if no surface is tracked. *)
+  val flush_dirty : unit -> int
+
+  type dirty_stats = {
+    dirty_flushes : int;
+    dirty_rects : int;
+    pixels_pushed : int;  (** pixels sent by flush_dirty *)
+    full_screen_pixels : int  (** pixels update_surface would have sent on each flush *)
+  }
+
+  (** [dirty_stats () -> stats]
+    Totals since [track_dirty] was called. *)
+  val dirty_stats : unit -> dirty_stats
+
   (** [flip surface]
     On hardware that supports double-buffering, this function sets up a flip and returns. The hardware will wait for vertical retrace,
     and then swap video buffers before the next video surface blit or lock will return. On hardware that doesn't support double-buffering,
@@ -366,7 +423,8 @@ module Video : sig
   val free_cursor: cursor -> unit
 
   (** [string_of_pixels surface -> string]
-    Returns a copy of the raw pixel data in a surface as a string. *)
+    Returns a copy of the raw pixel data in a surface as a string, the rows packed without the padding
+    at the end of each scanline. *)
   val string_of_pixels : surface -> string
 
 end
@@ -436,13 +494,74 @@ module SDLGL : sig
     SWAP_CONTROL (** vsync *)
 
   (** [swap_buffers]
-    Swap OpenGL framebuffers/Update Display *)
+    Swap OpenGL framebuffers/Update Display. Other threads keep running while it waits *)
   val swap_buffers : unit -> unit
 
+  (** Timing of the [swap_buffers] calls, times in seconds of a monotonic clock.
+    SDL does not report when frames reach the screen, so [present] is the end of
+    the last swap, [msc] is -1 and [hardware_timing] is false. The frame times are
+    the intervals between swaps over the last 256 frames *)
+  type present_timing = {
+    frames : int;
+    swap_start : float;
+    swap_end : float;
+    present : float;
+    msc : int;
+    hardware_timing : bool;
+    mean_frame_time : float;
+    min_frame_time : float;
+    max_frame_time : float;
+    median_frame_time : float;
+    p99_frame_time : float;
+  }
+
+  (** [present_timing -> timing]
+    Timing of the swaps since the start or the last [reset_present_timing] *)
+  val present_timing : unit -> present_timing
+
+  (** [frame_histogram -> counts]
+    Histogram of the last 256 frame times, in buckets of [histogram_bucket_width] seconds.
+    The last bucket also counts all longer frames *)
+  val frame_histogram : unit -> int array
+
+  (** Width of the [frame_histogram] buckets in seconds, 0.5 ms *)
+  val histogram_bucket_width : float
+
+  (** [reset_present_timing]
+    Clears the present timing and the histogram *)
+  val reset_present_timing : unit -> unit
+
   (** [load_bmp file -> surface]
-    Loads a Windows Bitmap file and loads it into a surface suitable for use as an OpenGL texture *)
+    Loads a Windows Bitmap file and loads it into a surface suitable for use as an OpenGL texture:
+    24 or 32 bit, R, G, B(, A) bytes and rows from the bottom *)
   val load_bmp : string -> Video.surface
 
+  (** [prepare_surface surface premultiply flip]
+    Rewrites the pixels of a 24 or 32 bit surface in place as R, G, B(, A) bytes, ready for [gl_rgb] or [gl_rgba]
+    with [gl_unsigned_byte], and updates its masks to match. With [premultiply] the colours are multiplied by alpha;
+    with [flip] the rows are put in bottom-up order. Done in one SIMD pass with the runtime lock released.
+    Raises [Invalid_argument] for other depths, or channels not in whole bytes *)
+  val prepare_surface : Video.surface -> bool -> bool -> unit
+
+  (** [prepare_surface_into surface premultiply flip pixels]
+    As [prepare_surface], writing packed rows (width * 3 or width * 4 bytes) into [pixels] and leaving the
+    surface unchanged *)
+  val prepare_surface_into : Video.surface -> bool -> bool -> byte_array -> unit
+
+  (** [upload_surface surface target level mipmaps]
+    Uploads the pixels of [surface] into the bound texture [target] (e.g. [gl_texture_2d]) at mipmap [level], straight
+    from surface memory. The GL format and type are picked from the surface masks: R, G, B(, A) and B, G, R(, A) bytes,
+    packed 32 bit pixels and the 565, 1555, 5551 and 4444 16 bit layouts. The unpack row length and alignment are set
+    from the pitch and restored afterwards. Palettized surfaces and other layouts are converted to RGBA first.
+    With [mipmaps] the rest of the chain is generated by GL ([glGenerateMipmap], or [GL_GENERATE_MIPMAP] before GL 3.0).
+    Needs a current OpenGL context; raises [SDL_failure] when OpenGL is not loaded *)
+  val upload_surface : Video.surface -> int -> int -> bool -> unit
+
+  (** [texture_format surface -> internal_format * format * type]
+    The arguments [upload_surface] gives [glTexImage2D] for [surface], for use with [glTexSubImage2D] and the like.
+    Raises [Not_found] when the surface would be converted first *)
+  val texture_format : Video.surface -> int * int * int
+
   (** [set_attribute attr value]
     Sets the OpenGL attribute attr to value. The attributes you set don't take effect until after a call to [set_video_mode].
     You should use [get_attribute] to check the values after a [set_video_mode] call. *)
@@ -490,6 +609,24 @@ module Event : sig
   (* mouse state *)
   val get_mouse_state: unit -> int * int * int
 
+  (** Mouse state filled in by [read_mouse_state]: the button mask, the position and the
+    motion since the previous read *)
+  type mouse_state = {
+    mutable mouse_buttons : int;
+    mutable mouse_x : int;
+    mutable mouse_y : int;
+    mutable mouse_xrel : int;
+    mutable mouse_yrel : int
+  }
+
+  (** [make_mouse_state -> state]
+    Creates a mouse state to be filled in by [read_mouse_state] *)
+  val make_mouse_state : unit -> mouse_state
+
+  (** [read_mouse_state state]
+    Stores the current mouse state into [state], as of the last pump. Does not allocate. *)
+  external read_mouse_state : mouse_state -> unit = "sdlstub_read_mouse_state" [@@noalloc]
+
   (** SDLKey enum
     An enumeration of keysym definitions.
     Note : A lot of the keysyms are unavailable on most keyboards. For example, the [K_1] keysym can't be accessed on a french keyboard.
@@ -548,6 +685,24 @@ module Event : sig
     Returns the SDL-defined name of the key in [key] *)
   val get_key_name : key -> string
 
+  (** [key_of_code code -> key]
+    The key with the given number, as found in an [event_buffer] *)
+  external key_of_code : int -> key = "%identity"
+
+  (** [code_of_key key -> code]
+    The number of a key, as found in an [event_buffer] *)
+  external code_of_key : key -> int = "%identity"
+
+  (** [get_key_state -> keys]
+    A view of SDL's key state array, indexed by SDL key symbol, non-zero for pressed keys.
+    It is not a copy: every [pump_events] (also through polling) updates it in place,
+    and the same view is returned by each call. Use [is_key_pressed] to index it with a [key]. *)
+  val get_key_state : unit -> byte_array
+
+  (** [is_key_pressed keys key -> bool]
+    Whether [key] is pressed in the key state [keys] from [get_key_state]. Does not allocate. *)
+  val is_key_pressed : byte_array -> key -> bool
+
   (** Released/Pressed *)
   type press_release = RELEASED | PRESSED
 
@@ -669,6 +824,94 @@ module Event : sig
     removed from the queue and stored in that area. *)
   val wait_event : unit -> event
 
+  (** [poll_events coalesce -> events]
+    Pumps the event loop once and removes all pending events from the queue, oldest first.
+    If [coalesce] is true, consecutive mouse motion events with the same button state are merged
+    into one, with the position of the last and the summed relative motion. *)
+  val poll_events : bool -> event array
+
+  (** Int32 buffer that [poll_events_into] decodes events into, [event_words] int32 per event.
+    The first word is the event type, one of the [ev_] constants (the number of the [event]
+    constructor); the following words are the fields of the event record in order:
+    - Active: focus (0 lost, 1 gained), state (0 mouse focus, 1 input focus, 2 active)
+    - Key: keystate (0 released, 1 pressed), scancode, sym ([key_of_code]), modifiers (mask, see [key_mod_mask]), unicode
+    - Motion: mousestate, mx, my, mxrel, myrel
+    - Button: mousebutton (0 left .. 4 wheel down), buttonstate, bx, by
+    - Jaxis: which_axis, axis, jvalue; Jball: which_ball, ball, jxrel, jyrel
+    - Jhat: which_hat, hat, hvalue; Jbutton: which_button, joybutton, jstate
+    - Resize: w, h; User: code (the data pointers are not passed) *)
+  type event_buffer = (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  (** Number of int32 per event in an [event_buffer] *)
+  val event_words : int
+
+  (** [make_event_buffer n -> buffer]
+    Creates a buffer for [n] events *)
+  val make_event_buffer : int -> event_buffer
+
+  (** [poll_events_into buffer coalesce -> count]
+    Like [poll_events], but decodes at most as many events as fit into [buffer] and returns their number.
+    Further events stay queued. Does not allocate. *)
+  val poll_events_into : event_buffer -> bool -> int
+
+  (** [event_type buffer i -> type]
+    Type of the [i]th event in the buffer, one of the [ev_] constants *)
+  val event_type : event_buffer -> int -> int
+
+  (** [event_field buffer i k -> value]
+    Field [k] (1 to 7) of the [i]th event in the buffer *)
+  val event_field : event_buffer -> int -> int -> int
+
+  val ev_active : int
+  val ev_key : int
+  val ev_motion : int
+  val ev_button : int
+  val ev_jaxis : int
+  val ev_jball : int
+  val ev_jhat : int
+  val ev_jbutton : int
+  val ev_resize : int
+  val ev_expose : int
+  val ev_quit : int
+  val ev_user : int
+  val ev_syswm : int
+
+  (** [key_mod_mask modifier -> mask]
+    The bit of a modifier in the modifier mask of an [event_buffer] *)
+  val key_mod_mask : key_mod -> int
+
+  (** How [start_replay] hands out recorded events: at the times they were recorded, or each
+    poll gets exactly the events its recorded counterpart got, without waiting *)
+  type replay_speed = REALTIME | AS_FAST_AS_POSSIBLE
+
+  (** [start_recording file]
+    Writes every event handed out by [poll_event], [wait_event], [poll_events] and
+    [poll_events_into] from now on to [file], with its time, before coalescing. The end of
+    each poll is recorded too. The file is binary: an 8 byte header, then [8 + 4 * event_words]
+    bytes per record, the nanoseconds since [start_recording] as a little endian int64 and the
+    words of an [event_buffer] as little endian int32, type 0 for the end of a poll.
+    Window manager events and the data pointers of user events are not kept. *)
+  val start_recording : string -> unit
+
+  (** [stop_recording ()]
+    Stops recording and closes the file *)
+  val stop_recording : unit -> unit
+
+  (** [start_replay file speed]
+    Reads a recording and hands its events out through the poll functions instead of the
+    event queue, until all of them have been handed out. Live events are thrown away during
+    the replay, except a quit, which ends it. Replaying [AS_FAST_AS_POSSIBLE] makes a run
+    independent of the frame rate, for repeatable benchmarks and regression comparisons. *)
+  val start_replay : string -> replay_speed -> unit
+
+  (** [stop_replay ()]
+    Ends the replay and goes back to live events *)
+  val stop_replay : unit -> unit
+
+  (** [replaying () -> bool]
+    Whether a replay is still running *)
+  val replaying : unit -> bool
+
 end
 
 
@@ -684,9 +927,97 @@ module Timer : sig
   (** [delay milliseconds]
     Wait a specified number of milliseconds before returning.
     [delay] will wait at least the specified time, but possible longer due to OS scheduling.
-    Note: Count on a delay granularity of at least 10 ms. Some platforms have shorter clock ticks but this is the most common. *)
+    Note: Count on a delay granularity of at least 10 ms. Some platforms have shorter clock ticks but this is the most common.
+    Other threads keep running during the delay. *)
   val delay : int -> unit
 
+  (** [now_ns -> nanoseconds]
+    Reads a monotonic clock with nanosecond resolution. Does not allocate in native code. *)
+  external now_ns : unit -> (int64 [@unboxed])
+  = "sdlstub_now_ns_byte" "sdlstub_now_ns" [@@noalloc]
+
+  (** A named profiler scope *)
+  type scope
+
+  (** [scope name -> scope]
+    Returns the scope with the given name, registering it the first time *)
+  val scope : string -> scope
+
+  (** [start_profiler capacity]
+    Starts recording scopes into a ring buffer of [capacity] events, dropping anything recorded before.
+    When the buffer is full the oldest scopes are overwritten. *)
+  val start_profiler : int -> unit
+
+  (** [stop_profiler]
+    Stops recording; the recorded scopes are kept for [export_chrome_trace] *)
+  val stop_profiler : unit -> unit
+
+  (** [enter_scope scope]
+    Opens a scope, nested in the scopes already open. Does not allocate. *)
+  external enter_scope : scope -> unit = "sdlstub_profile_enter" [@@noalloc]
+
+  (** [leave_scope scope]
+    Closes the innermost open scope and records it. Does not allocate. *)
+  external leave_scope : scope -> unit = "sdlstub_profile_leave" [@@noalloc]
+
+  (** [profile scope f -> result]
+    Runs [f ()] inside [scope], closing it also when [f] raises *)
+  val profile : scope -> (unit -> 'a) -> 'a
+
+  (** [profiler_counts -> (recorded, overwritten)]
+    Number of scopes in the buffer and number of older scopes overwritten *)
+  val profiler_counts : unit -> int * int
+
+  (** [export_chrome_trace file]
+    Writes the recorded scopes as Chrome trace event JSON, for chrome://tracing or Perfetto *)
+  val export_chrome_trace : string -> unit
+
+  (** Frame pacer. [wait_frame] waits for the next deadline, one period after
+    the previous one, sleeping until [spin] seconds before it and spinning the
+    rest on a monotonic nanosecond clock. A frame that is already past its
+    deadline is counted as late and the following deadlines keep their phase.
+    For fixed timestep updates call [fixed_steps] once per frame, run that many
+    steps and draw with [interpolation] between the last two states. *)
+  type pacer
+
+  (** Statistics of a pacer in seconds. The overshoot is how far past the
+    deadline [wait_frame] woke up, for frames that were not late *)
+  type pacer_stats = {
+    paced_frames : int;
+    late_frames : int;
+    mean_overshoot : float;
+    max_overshoot : float;
+    last_overshoot : float;
+  }
+
+  (** [create_pacer period] makes a pacer for frames of [period] seconds,
+    starting now, spinning the last 2 ms *)
+  val create_pacer : float -> pacer
+
+  (** Sets how long before the deadline to stop sleeping and start spinning.
+    Raise it where sleeps are coarse (Windows without timeBeginPeriod) *)
+  val set_pacer_spin : pacer -> float -> unit
+
+  (** Starts pacing from now and clears the statistics and the accumulator *)
+  val reset_pacer : pacer -> unit
+
+  (** Waits for the next frame deadline. Other threads keep running meanwhile *)
+  val wait_frame : pacer -> unit
+
+  (** Seconds between the last two [wait_frame] *)
+  val frame_time : pacer -> float
+
+  (** [fixed_steps pacer step] adds the time since the last call to the
+    accumulator and returns how many steps of [step] seconds to run now
+    (at most 8, the excess is dropped) *)
+  val fixed_steps : pacer -> float -> int
+
+  (** What is left in the accumulator after [fixed_steps], as a fraction of a step *)
+  val interpolation : pacer -> float
+
+  (** Statistics of the pacer since it was created or reset *)
+  val pacer_stats : pacer -> pacer_stats
+
 end
 
 
@@ -748,7 +1079,8 @@ module Draw : sig
     font_line: int            (** Space between lines in pixels. Default is zero i.e. font design handles it *)
   }
 
-  (** Filters to be used in scaling bitmaps. Currently only box, triangle and lanczos3 filters have been implemented*)
+  (** Filters to be used in scaling bitmaps: box, triangle, bell, B-spline, Hermite, Mitchell (B = C = 1/3)
+    and Lanczos (3 lobes). The int argument is not used *)
   type filter = BOX of int | TRIANGLE of int | BELL of int | BSPLINE of int | HERMITE of int | MITCHELL of int | LANCZOS3 of int
   val box : filter
   val triangle : filter
@@ -766,27 +1098,119 @@ module Draw : sig
     gets an int32 rgb(a) pixel, from surface [surface] at location [(x,y)] *)
   val get_pixel : Video.surface -> int -> int -> int32
 
+  (** Pixels of a rectangle, row after row, as for [put_pixel] and [get_pixel] *)
+  type pixel_span = (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  (** [make_pixel_span n -> span]
+    Creates a span for [n] pixels *)
+  val make_pixel_span : int -> pixel_span
+
+  (** [read_pixels surface x y w h span]
+    Reads the [w * h] pixels of the rectangle at [(x,y)] into [span], locking the surface once *)
+  val read_pixels : Video.surface -> int -> int -> int -> int -> pixel_span -> unit
+
+  (** [write_pixels surface x y w h span]
+    Writes [w * h] pixels from [span] into the rectangle at [(x,y)], locking the surface once *)
+  val write_pixels : Video.surface -> int -> int -> int -> int -> pixel_span -> unit
+
+  (** [fill_pixels surface x y w h pixel]
+    Sets every pixel of the rectangle at [(x,y)] to [pixel] *)
+  val fill_pixels : Video.surface -> int -> int -> int -> int -> int32 -> unit
+
+  (** [copy_pixels src sx sy dst dx dy w h]
+    Copies the [w * h] rectangle at [(sx,sy)] in [src] to [(dx,dy)] in [dst], converting the pixels if the
+    formats differ. Unlike [blit_surface], alpha and colour keys are copied, not applied. [src] and [dst]
+    may be the same surface. *)
+  val copy_pixels : Video.surface -> int -> int -> Video.surface -> int -> int -> int -> int -> unit
+
+  (** 2D primitives, drawn in C with a pixel value of the surface's format (see [Video.map_rgb]) and clipped to the
+    surface's clip rectangle. [Line] and [Polygon] are 1 pixel Bresenham lines; [Aa_line] is anti-aliased, blending
+    the colour of the pixel value into the surface; [Thick_line (x0, y0, x1, y1, width)] fills the rectangle of that
+    width around the line. [Rect] and [Fill_rect] take [x, y, w, h]; circles and ellipses their centre and radii.
+    [Fill_polygon] fills with the even-odd rule, a pixel being inside when its centre is, or lies on a left or top
+    edge: the square with corners (0, 0) and (10, 10) fills the same pixels as [Fill_rect (0, 0, 10, 10)], inside
+    its [Polygon] outline. *)
+  type primitive =
+    | Line of int * int * int * int
+    | Aa_line of int * int * int * int
+    | Thick_line of int * int * int * int * int
+    | Rect of int * int * int * int
+    | Fill_rect of int * int * int * int
+    | Circle of int * int * int
+    | Fill_circle of int * int * int
+    | Ellipse of int * int * int * int
+    | Fill_ellipse of int * int * int * int
+    | Polygon of (int * int) array
+    | Fill_polygon of (int * int) array
+
+  (** [draw surface primitive pixel]
+    Draws one primitive, locking the surface once. Radii above 32767 raise [Invalid_argument] *)
+  val draw : Video.surface -> primitive -> int32 -> unit
+
+  (** [draw_batch surface primitives]
+    Draws the primitives in order, each with its pixel value, under one lock *)
+  val draw_batch : Video.surface -> (primitive * int32) array -> unit
+
+  (** Shorthands for [draw] with one primitive *)
+  val draw_line : Video.surface -> int -> int -> int -> int -> int32 -> unit
+  val draw_aa_line : Video.surface -> int -> int -> int -> int -> int32 -> unit
+  val draw_thick_line : Video.surface -> int -> int -> int -> int -> int -> int32 -> unit
+  val draw_rect : Video.surface -> int -> int -> int -> int -> int32 -> unit
+  val draw_circle : Video.surface -> int -> int -> int -> int32 -> unit
+  val fill_circle : Video.surface -> int -> int -> int -> int32 -> unit
+  val draw_ellipse : Video.surface -> int -> int -> int -> int -> int32 -> unit
+  val fill_ellipse : Video.surface -> int -> int -> int -> int -> int32 -> unit
+  val draw_polygon : Video.surface -> (int * int) array -> int32 -> unit
+  val fill_polygon : Video.surface -> (int * int) array -> int32 -> unit
+
+  (** How [composite] mixes a source pixel into the destination, with [a] the source alpha times the opacity:
+    [BLEND_OVER] is [src * a + dst * (1 - a)]; [BLEND_ADD] adds [src * a], saturating; [BLEND_MULTIPLY] mixes
+    [src * dst] in by [a]; [BLEND_PREMULTIPLIED] is [src * opacity + dst * (1 - a)] for a source whose colours are
+    already multiplied by its alpha. The destination alpha becomes [a + dst_alpha * (1 - a)] *)
+  type blend_mode = BLEND_OVER | BLEND_ADD | BLEND_MULTIPLY | BLEND_PREMULTIPLIED
+
+  (** [composite src srcrect dst x y mode opacity]
+    Draws [srcrect] of [src] (all of it with [None]) at [(x,y)] in [dst] with the blend [mode] and a global [opacity]
+    from 0 to 255, clipped to [src] and to the clip rectangle of [dst]. A source without alpha is opaque; colour keys
+    and [set_alpha] are ignored. Between 32 bit surfaces whose colours are in the same bytes, four pixels are mixed
+    at a time with SSE2; other formats are converted per pixel. [src] and [dst] must differ *)
+  val composite : Video.surface -> Video.rect option -> Video.surface -> int -> int -> blend_mode -> int -> unit
+
   (** [scale surface factor filter -> surface]
     Scales a surface by the given scale [factor], using the given [filter], and returning a new scaled surface *)
   val scale : Video.surface -> float -> filter -> Video.surface
 
   (** [scale_to surface new_width new_height filter -> surface]
-    Scales a surface to the new width and height given, using the given [filter], and returning a new scaled surface *)
+    Scales a surface to the new width and height given, using the given [filter], and returning a new scaled surface
+    in the format of [surface]. Rows and columns are resampled separately in C, as RGBA bytes; the runtime lock
+    is released while scaling *)
   val scale_to : Video.surface -> int -> int -> filter -> Video.surface
 
   (** [read_tga file -> width * height * bitsperpixel * pixel-data]
     Targa TGA image file reader, based on the specs at http://astronomy.swin.edu.au/~pbourke/dataformats/tga/
-    Takes as parameter the file name and returns a tuple containing the image width, height, bytes-per-pixel
-    a string containing the image data in BGR(A) format, and the image orientation.
-    Reads 15, 16, 24 and 32 bit-per-pixel raw and RLE-compressed images.
-    Throws TGA_exception when anything goes wrong. *)
+    Takes as parameter the file name and returns a tuple containing the image width, height, bits-per-pixel
+    a string containing the run-length decoded image data as stored (BGR(A), 16 bit or colour indices),
+    and the image orientation.
+    Reads colour-mapped, true colour and grey, raw and RLE-compressed images of 8, 15, 16, 24 and 32 bits per pixel.
+    Throws TGA_failure when anything goes wrong. *)
   type tga_orientation = From_upper_left | From_lower_left
   val read_tga : string -> int * int * int * string * tga_orientation
 
+  (** [read_tga_rgba file -> width * height * pixels]
+    Decodes a TGA file into RGBA bytes, rows from the top, whatever its type and orientation *)
+  val read_tga_rgba : string -> int * int * byte_array
+
   (** [load_tga file -> surface]
-    Loads a TGA file and returns a surface with the image data *)
+    Loads a TGA file and returns a surface with the image data. True colour images keep their depth with the bytes
+    in R, G, B(, A) order, 15 and 16 bit images become 16 bit A1 R5 G5 B5 surfaces, grey images 8 bit surfaces with
+    a grey palette and colour-mapped images 32 bit RGBA surfaces. The file is read and decoded with the runtime
+    lock released *)
   val load_tga : string -> Video.surface
 
+  (** [load_tga_bytes data -> surface]
+    As [load_tga], decoding a TGA file already in memory *)
+  val load_tga_bytes : byte_array -> Video.surface
+
   (** [make_sfont Surface_containing_loaded_RGBA_texture_map_with_font_characters ->  sfont]
     Takes a surface containing a texture-mapped font (see http://www.linux-games.com/sfont/)
     and returns an sfont structure *)
@@ -799,9 +1223,39 @@ module Draw : sig
     Makes mipmaps suitable for use in OpenGL, by generating an array of mipmaps down to 1x1.
     The side of each mipmap is a power of two; if the sides of the original surface are powers of two then that
     surface will be used as the first mipmap in the array, otherwise it will be scaled to the nearest power of two
-    and the result will be used as the first mipmap. *)
+    and the result will be used as the first mipmap. Same as [make_mipmaps_with surface filter false true 0] *)
   val make_mipmaps : Video.surface ->  filter -> Video.surface array
 
+  (** Where a level is in the pixels of [mipmap_chain]: byte offset, width and height *)
+  type mipmap_level = {
+    level_offset : int;
+    level_width : int;
+    level_height : int;
+  }
+
+  (** [mipmap_chain surface filter srgb power_of_two threads -> pixels * levels]
+    Builds the mipmaps of [surface] down to 1x1 in C, each level filtered from the one before it, and returns
+    them packed as RGBA bytes, ready for [glTexImage2D level gl_rgba w h 0 gl_rgba gl_unsigned_byte].
+    If [power_of_two] is true the first level is [surface] scaled to the nearest power of two on each side,
+    otherwise it has the size of [surface] and each level is half the one before, rounded down.
+    If [srgb] is true the colour channels are taken as sRGB and filtered in linear light.
+    The rows of each level are split among [threads] threads (0 for one per processor), with the runtime
+    lock released. *)
+  val mipmap_chain : Video.surface -> filter -> bool -> bool -> int -> byte_array * mipmap_level array
+
+  (** [level_pixels pixels level -> pixels]
+    The pixels of one level of a [mipmap_chain], without copying *)
+  val level_pixels : byte_array -> mipmap_level -> byte_array
+
+  (** [surface_of_rgba like pixels width height -> surface]
+    A new surface in the format of [like] from [width * height] RGBA bytes *)
+  val surface_of_rgba : Video.surface -> byte_array -> int -> int -> Video.surface
+
+  (** [make_mipmaps_with surface filter srgb power_of_two threads -> array of mipmaps down to 1x1]
+    The levels of [mipmap_chain] as surfaces in the format of [surface]; the first is [surface] itself
+    if it needs no scaling *)
+  val make_mipmaps_with : Video.surface -> filter -> bool -> bool -> int -> Video.surface array
+
 end
 
 (**
@@ -0,0 +1,144 @@
+(* Texture atlases packed with a skyline *)
+
+open Sdl
+
+type placement = {
+  page : int;
+  x : int;
+  y : int;
+  width : int;
+  height : int;
+  rotated : bool;
+  u0 : float;
+  v0 : float;
+  u1 : float;
+  v1 : float;
+}
+
+(* the skyline is a list of (x, y, width) segments from left to right,
+   covering the width of the page *)
+type page = {
+  surface : Video.surface;
+  mutable skyline : (int * int * int) list;
+  mutable dirty : bool;
+  mutable used : int;
+}
+
+type t = {
+  page_width : int;
+  page_height : int;
+  padding : int;
+  allow_rotation : bool;
+  mutable pages : page array;
+}
+
+external create_page : int -> int -> Video.surface
+= "sdlatlasstub_create_page"
+external blit : Video.surface -> Video.surface -> int -> int -> int -> bool -> unit
+= "sdlatlasstub_blit_byte" "sdlatlasstub_blit"
+
+let create page_width page_height padding allow_rotation =
+  if page_width <= 0 || page_height <= 0 || padding < 0 then invalid_arg "Sdl_atlas.create";
+  { page_width = page_width; page_height = page_height; padding = padding;
+    allow_rotation = allow_rotation; pages = [||] }
+
+let new_page a =
+  let p = { surface = create_page a.page_width a.page_height;
+    skyline = [(0, 0, a.page_width)]; dirty = true; used = 0 } in
+  a.pages <- Array.append a.pages [| p |];
+  Array.length a.pages - 1
+
+(* lowest position for a w * h rectangle: (top, x, y), preferring the lowest top
+   edge and then the leftmost place *)
+let find_position a page w h =
+  let segs = Array.of_list page.skyline in
+  let best = ref None in
+  Array.iteri (fun i (x, _, _) ->
+    if x + w <= a.page_width then begin
+      let y = ref 0 and j = ref i and remaining = ref w in
+      while !remaining > 0 do
+        let (_, sy, sw) = segs.(!j) in
+        if sy > !y then y := sy;
+        remaining := !remaining - sw;
+        incr j
+      done;
+      let top = !y + h in
+      if top <= a.page_height then
+        match !best with
+          | Some (t, _, _) when t <= top -> ()
+          | _ -> best := Some (top, x, !y)
+    end) segs;
+  !best
+
+let rec merge = function
+  | (x, y, w) :: (_, y', w') :: rest when y = y' -> merge ((x, y, w + w') :: rest)
+  | s :: rest -> s :: merge rest
+  | [] -> []
+
+let raise_skyline page x w top =
+  let left = List.filter (fun (sx, _, sw) -> sx + sw <= x) page.skyline in
+  let right = List.fold_right (fun (sx, sy, sw) acc ->
+      if sx + sw <= x + w then acc
+      else if sx >= x + w then (sx, sy, sw) :: acc
+      else (x + w, sy, sx + sw - x - w) :: acc) page.skyline [] in
+  page.skyline <- merge (left @ [(x, top, w)] @ right)
+
+(* best place in one page, trying the rotated size too *)
+let place_in a page w h =
+  let upright = find_position a page w h in
+  let turned = if a.allow_rotation && w <> h then find_position a page h w else None in
+  match upright, turned with
+    | Some (t, x, y), Some (t', _, _) when t <= t' -> Some (x, y, false)
+    | _, Some (_, x, y) -> Some (x, y, true)
+    | Some (_, x, y), None -> Some (x, y, false)
+    | None, None -> None
+
+let add a surface =
+  let sw = Video.surface_width surface and sh = Video.surface_height surface in
+  let w = sw + 2 * a.padding and h = sh + 2 * a.padding in
+  let fits w h = w <= a.page_width && h <= a.page_height in
+  if not (fits w h || (a.allow_rotation && fits h w)) then invalid_arg "Sdl_atlas.add";
+  let rec search n =
+    if n = Array.length a.pages then
+      let n = new_page a in
+      match place_in a a.pages.(n) w h with
+        | Some (x, y, r) -> (n, x, y, r)
+        | None -> invalid_arg "Sdl_atlas.add"
+    else
+      match place_in a a.pages.(n) w h with
+        | Some (x, y, r) -> (n, x, y, r)
+        | None -> search (n + 1) in
+  let (n, px, py, rotated) = search 0 in
+  let p = a.pages.(n) in
+  let (pw, ph) = if rotated then (h, w) else (w, h) in
+  raise_skyline p px pw (py + ph);
+  blit surface p.surface px py a.padding rotated;
+  p.dirty <- true;
+  p.used <- p.used + pw * ph;
+  let x = px + a.padding and y = py + a.padding in
+  let width = if rotated then sh else sw and height = if rotated then sw else sh in
+  let fw = float_of_int a.page_width and fh = float_of_int a.page_height in
+  { page = n; x = x; y = y; width = width; height = height; rotated = rotated;
+    u0 = float_of_int x /. fw; v0 = float_of_int y /. fh;
+    u1 = float_of_int (x + width) /. fw; v1 = float_of_int (y + height) /. fh }
+
+let page_count a = Array.length a.pages
+
+let page a n = a.pages.(n).surface
+
+let dirty_pages a =
+  let l = ref [] in
+  for i = Array.length a.pages - 1 downto 0 do
+    if a.pages.(i).dirty then begin
+      a.pages.(i).dirty <- false;
+      l := i :: !l
+    end
+  done;
+  !l
+
+let occupancy a n =
+  float_of_int a.pages.(n).used /. float_of_int (a.page_width * a.page_height)
+
+let free a =
+  Array.iter (fun p -> Video.free_surface p.surface) a.pages;
+  a.pages <- [||]
@@ -0,0 +1,66 @@
+(** Texture atlases: many small surfaces packed into large RGBA pages.
+
+  Images are placed with the skyline bottom-left heuristic, one at a time, so more can
+  be added at any time without moving the ones already placed; a new page is started
+  when an image does not fit in any existing page. The pixels are converted and copied
+  in C.
+
+  Pages are 32 bit surfaces whose pixels are the bytes R, G, B, A in memory order, ready
+  for [glTexImage2D ... gl_rgba gl_unsigned_byte (Video.surface_pixels page)]. *)
+
+open Sdl
+
+(** Where an image was placed.
+  [x], [y], [width] and [height] are the pixels of the image in page [page], excluding
+  the padding; [u0, v0] and [u1, v1] are the texture coordinates of the corners [x, y]
+  and [x + width, y + height].
+  When [rotated] is true the image was turned 90 degrees clockwise to fit, so [width]
+  is its height: its top left pixel is at the top right corner [u1, v0] of the
+  rectangle and its rows run downwards. *)
+type placement = {
+  page : int;
+  x : int;
+  y : int;
+  width : int;
+  height : int;
+  rotated : bool;
+  u0 : float;
+  v0 : float;
+  u1 : float;
+  v1 : float;
+}
+
+(** An atlas *)
+type t
+
+(** [create page_width page_height padding allow_rotation -> atlas]
+  Creates an empty atlas with pages of the given size. Each image gets [padding] pixels
+  of its own edge pixels repeated around it, which keeps bilinear filtering and
+  mipmapping from bleeding in the neighbours (1 for filtering, more for mipmaps). When
+  [allow_rotation] is true images may be turned to fit better. *)
+val create : int -> int -> int -> bool -> t
+
+(** [add atlas surface -> placement]
+  Places a copy of [surface] (any pixel format; a colour key becomes transparent) and
+  returns where it went. Raises [Invalid_argument] if it can not fit in an empty page. *)
+val add : t -> Video.surface -> placement
+
+(** [page_count atlas -> n] *)
+val page_count : t -> int
+
+(** [page atlas n -> surface]
+  Returns the surface of page [n]. It belongs to the atlas. *)
+val page : t -> int -> Video.surface
+
+(** [dirty_pages atlas -> pages]
+  Returns the pages that changed since the previous call (or since creation), in
+  increasing order, so that only those have to be uploaded again. *)
+val dirty_pages : t -> int list
+
+(** [occupancy atlas n -> fraction]
+  The fraction of page [n] covered by images and their padding *)
+val occupancy : t -> int -> float
+
+(** [free atlas]
+  Frees the page surfaces; the atlas must not be used afterwards. *)
+val free : t -> unit
@@ -0,0 +1,142 @@
+/*
+ * Sdl_atlas - page surfaces and blits for the texture atlas packer.
+ *
+ * Pages are 32 bit surfaces with the bytes R, G, B, A in memory order, so
+ * their pixels can be given to glTexImage2D as gl_rgba / gl_unsigned_byte.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <SDL/SDL.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/callback.h>
+
+static void raise_failure(void)
+{
+    raise_with_string(*caml_named_value("SDL_failure"), SDL_GetError());
+}
+
+value sdlatlasstub_create_page(value vw, value vh)
+{
+    CAMLparam2(vw, vh);
+    SDL_Surface *s;
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    s = SDL_CreateRGBSurface(SDL_SWSURFACE, Int_val(vw), Int_val(vh), 32,
+                             0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff);
+#else
+    s = SDL_CreateRGBSurface(SDL_SWSURFACE, Int_val(vw), Int_val(vh), 32,
+                             0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
+#endif
+    if (s == NULL) raise_failure();
+    memset(s->pixels, 0, s->pitch * s->h);
+    CAMLreturn((value) s);
+}
+
+static Uint32 read_pixel(const Uint8 *p, int bpp)
+{
+    switch (bpp) {
+    case 1: return *p;
+    case 2: return *(const Uint16 *)p;
+    case 3:
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        return p[0] << 16 | p[1] << 8 | p[2];
+#else
+        return p[0] | p[1] << 8 | p[2] << 16;
+#endif
+    default: return *(const Uint32 *)p;
+    }
+}
+
+/* Converts one source row to RGBA bytes. 32 bit sources in the page
+   layout are copied; everything else goes through SDL_GetRGBA, with the
+   colour key (if set) made transparent. */
+static void source_row_rgba(SDL_Surface *src, int y, Uint8 *out, const SDL_PixelFormat *page)
+{
+    SDL_PixelFormat *f = src->format;
+    const Uint8 *row = (const Uint8 *)src->pixels + y * src->pitch;
+    int keyed = (src->flags & SDL_SRCCOLORKEY) != 0;
+    int x;
+
+    if (f->BytesPerPixel == 4 && !keyed && f->Rmask == page->Rmask && f->Gmask == page->Gmask
+        && f->Bmask == page->Bmask && f->Amask == page->Amask) {
+        memcpy(out, row, src->w * 4);
+        return;
+    }
+    for (x = 0; x < src->w; x++, out += 4) {
+        Uint32 p = read_pixel(row + x * f->BytesPerPixel, f->BytesPerPixel);
+        if (keyed && p == f->colorkey) {
+            out[0] = out[1] = out[2] = out[3] = 0;
+        } else {
+            SDL_GetRGBA(p, f, &out[0], &out[1], &out[2], &out[3]);
+        }
+    }
+}
+
+/* [blit src page x y padding rotated]: copies src into the page with its
+   top left corner at (x + padding, y + padding), turned 90 degrees
+   clockwise if rotated, and repeats the outermost pixels into the padding
+   so that filtering at the edges does not pick up the neighbours. */
+value sdlatlasstub_blit(value vsrc, value vpage, value vx, value vy, value vpad, value vrot)
+{
+    CAMLparam5(vsrc, vpage, vx, vy, vpad);
+    CAMLxparam1(vrot);
+    SDL_Surface *src = (SDL_Surface *) vsrc;
+    SDL_Surface *page = (SDL_Surface *) vpage;
+    int pad = Int_val(vpad), rotated = Bool_val(vrot);
+    int x0 = Int_val(vx), y0 = Int_val(vy);
+    int w = rotated ? src->h : src->w, h = rotated ? src->w : src->h;
+    int pw = w + 2 * pad, ph = h + 2 * pad;
+    Uint8 *row, *base;
+    int x, y, i;
+
+    if (x0 < 0 || y0 < 0 || x0 + pw > page->w || y0 + ph > page->h)
+        invalid_argument("Sdl_atlas.blit");
+    row = (Uint8 *)malloc(src->w * 4 + 1);
+    if (row == NULL) raise_out_of_memory();
+    if (SDL_MUSTLOCK(src) && SDL_LockSurface(src) < 0) {
+        free(row);
+        raise_failure();
+    }
+    if (SDL_MUSTLOCK(page) && SDL_LockSurface(page) < 0) {
+        if (SDL_MUSTLOCK(src)) SDL_UnlockSurface(src);
+        free(row);
+        raise_failure();
+    }
+    base = (Uint8 *)page->pixels + y0 * page->pitch + x0 * 4;
+    for (y = 0; y < src->h; y++) {
+        source_row_rgba(src, y, row, page->format);
+        if (!rotated) {
+            memcpy(base + (pad + y) * page->pitch + pad * 4, row, src->w * 4);
+        } else {
+            /* source (x, y) goes to (h - 1 - y, x) */
+            for (x = 0; x < src->w; x++)
+                memcpy(base + (pad + x) * page->pitch + (pad + src->h - 1 - y) * 4, row + x * 4, 4);
+        }
+    }
+    if (pad > 0) {
+        for (y = pad; y < pad + h; y++) {
+            Uint32 *r = (Uint32 *)(base + y * page->pitch);
+            for (i = 0; i < pad; i++) {
+                r[i] = r[pad];
+                r[pad + w + i] = r[pad + w - 1];
+            }
+        }
+        for (i = 0; i < pad; i++) {
+            memcpy(base + i * page->pitch, base + pad * page->pitch, pw * 4);
+            memcpy(base + (pad + h + i) * page->pitch, base + (pad + h - 1) * page->pitch, pw * 4);
+        }
+    }
+    if (SDL_MUSTLOCK(page)) SDL_UnlockSurface(page);
+    if (SDL_MUSTLOCK(src)) SDL_UnlockSurface(src);
+    free(row);
+    CAMLreturn(Val_unit);
+}
+
+value sdlatlasstub_blit_byte(value *argv, __attribute__((unused)) int n)
+{
+    return sdlatlasstub_blit(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
@@ -0,0 +1,2176 @@
+/*
+ * Sdl.Draw - native image resampling, mipmaps, pixel spans and TGA
+ * decoding.
+ *
+ * Images are scaled as RGBA bytes in two separable passes, rows then
+ * columns, with the weights of every output pixel computed once per axis.
+ * Weights are 14 bit fixed point; when downscaling, the filter is widened
+ * by the scale factor so that every source pixel contributes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL/SDL.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/callback.h>
+#include <caml/signals.h>
+#include <caml/bigarray.h>
+
+#include "dirty_rects.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define WEIGHT_BITS 14
+
+static void raise_failure(void)
+{
+    raise_with_string(*caml_named_value("SDL_failure"), SDL_GetError());
+}
+
+/* The filters of Graphics Gems III, "General Filtered Image Rescaling". */
+
+static double box_filter(double x)
+{
+    return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+}
+
+static double triangle_filter(double x)
+{
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+static double bell_filter(double x)
+{
+    x = fabs(x);
+    if (x < 0.5) return 0.75 - x * x;
+    if (x < 1.5) return 0.5 * (x - 1.5) * (x - 1.5);
+    return 0.0;
+}
+
+static double bspline_filter(double x)
+{
+    x = fabs(x);
+    if (x < 1.0) return 0.5 * x * x * x - x * x + 2.0 / 3.0;
+    if (x < 2.0) return (2.0 - x) * (2.0 - x) * (2.0 - x) / 6.0;
+    return 0.0;
+}
+
+static double hermite_filter(double x)
+{
+    x = fabs(x);
+    return x < 1.0 ? (2.0 * x - 3.0) * x * x + 1.0 : 0.0;
+}
+
+/* B = C = 1/3 */
+static double mitchell_filter(double x)
+{
+    const double b = 1.0 / 3.0, c = 1.0 / 3.0;
+    x = fabs(x);
+    if (x < 1.0)
+        return ((12.0 - 9.0 * b - 6.0 * c) * x * x * x + (-18.0 + 12.0 * b + 6.0 * c) * x * x + (6.0 - 2.0 * b)) / 6.0;
+    if (x < 2.0)
+        return ((-b - 6.0 * c) * x * x * x + (6.0 * b + 30.0 * c) * x * x + (-12.0 * b - 48.0 * c) * x + (8.0 * b + 24.0 * c)) / 6.0;
+    return 0.0;
+}
+
+static double sinc(double x)
+{
+    x *= M_PI;
+    return x != 0.0 ? sin(x) / x : 1.0;
+}
+
+static double lanczos3_filter(double x)
+{
+    return fabs(x) < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+/* in the order of the constructors of Draw.filter */
+static const struct {
+    double (*f)(double);
+    double support;
+} filters[] = {
+    { box_filter, 0.5 },
+    { triangle_filter, 1.0 },
+    { bell_filter, 1.5 },
+    { bspline_filter, 2.0 },
+    { hermite_filter, 1.0 },
+    { mitchell_filter, 2.0 },
+    { lanczos3_filter, 3.0 },
+};
+
+/* Output pixel i of an axis is the sum of weight[i * taps + k] times
+   source pixel first[i] + k, for k below count[i]; fweight has the same
+   weights as floats, for linear light. */
+struct axis_weights {
+    int taps;
+    int *first, *count;
+    short *weight;
+    float *fweight;
+};
+
+static void free_weights(struct axis_weights *a)
+{
+    free(a->first);
+    free(a->count);
+    free(a->weight);
+    free(a->fweight);
+}
+
+static int make_weights(struct axis_weights *a, int in, int out, int filter)
+{
+    double scale = (double)out / in;
+    double widen = scale < 1.0 ? 1.0 / scale : 1.0;
+    double radius = filters[filter].support * widen;
+    double *w;
+    int i, k;
+
+    a->taps = (int)ceil(radius) * 2 + 1;
+    a->first = (int *)malloc(out * sizeof(int));
+    a->count = (int *)malloc(out * sizeof(int));
+    a->weight = (short *)malloc(out * a->taps * sizeof(short));
+    a->fweight = (float *)malloc(out * a->taps * sizeof(float));
+    w = (double *)malloc(a->taps * sizeof(double));
+    if (a->first == NULL || a->count == NULL || a->weight == NULL || a->fweight == NULL || w == NULL) {
+        free_weights(a);
+        free(w);
+        return 0;
+    }
+    for (i = 0; i < out; i++) {
+        double center = (i + 0.5) / scale, total = 0.0;
+        int lo = (int)floor(center - radius), hi = (int)ceil(center + radius);
+        if (lo < 0) lo = 0;
+        if (hi > in) hi = in;
+        if (hi - lo > a->taps) hi = lo + a->taps;
+        for (k = 0; k < hi - lo; k++) {
+            w[k] = filters[filter].f((lo + k + 0.5 - center) / widen);
+            total += w[k];
+        }
+        /* a box narrower than the pixel spacing can miss: take the nearest */
+        if (total == 0.0) {
+            lo = (int)center < in ? (int)center : in - 1;
+            hi = lo + 1;
+            w[0] = total = 1.0;
+        }
+        a->first[i] = lo;
+        a->count[i] = hi - lo;
+        for (k = 0; k < hi - lo; k++) {
+            a->weight[i * a->taps + k] = (short)floor(w[k] / total * (1 << WEIGHT_BITS) + 0.5);
+            a->fweight[i * a->taps + k] = (float)(w[k] / total);
+        }
+    }
+    free(w);
+    return 1;
+}
+
+static Uint8 clamp_byte(int x)
+{
+    x = (x + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+    return x < 0 ? 0 : x > 255 ? 255 : (Uint8)x;
+}
+
+/* Scales the rows of [src] ([sw] pixels wide) to [a]'s output width. */
+static void scale_rows(const Uint8 *src, int sw, Uint8 *dst, int dw, int rows, const struct axis_weights *a)
+{
+    int y, x, k;
+    for (y = 0; y < rows; y++) {
+        const Uint8 *in = src + (size_t)y * sw * 4;
+        Uint8 *o = dst + (size_t)y * dw * 4;
+        for (x = 0; x < dw; x++, o += 4) {
+            const short *w = a->weight + x * a->taps;
+            const Uint8 *p = in + a->first[x] * 4;
+            int n = a->count[x];
+#ifdef __SSE2__
+            __m128i zero = _mm_setzero_si128(), acc = _mm_setzero_si128();
+            /* two taps per madd: channels of both pixels side by side */
+            for (k = 0; k + 1 < n; k += 2) {
+                __m128i pix = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + k * 4)), zero);
+                __m128i pair = _mm_unpacklo_epi16(pix, _mm_srli_si128(pix, 8));
+                __m128i ww = _mm_set1_epi32((w[k + 1] << 16) | (w[k] & 0xffff));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(pair, ww));
+            }
+            if (k < n) {
+                int last;
+                __m128i pair;
+                memcpy(&last, p + k * 4, 4);
+                pair = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(last), zero), zero);
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(pair, _mm_set1_epi32(w[k] & 0xffff)));
+            }
+            acc = _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(1 << (WEIGHT_BITS - 1))), WEIGHT_BITS);
+            acc = _mm_packs_epi32(acc, acc);
+            {
+                int packed = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+                memcpy(o, &packed, 4);
+            }
+#else
+            int r = 0, g = 0, b = 0, al = 0;
+            for (k = 0; k < n; k++) {
+                r += p[k * 4] * w[k];
+                g += p[k * 4 + 1] * w[k];
+                b += p[k * 4 + 2] * w[k];
+                al += p[k * 4 + 3] * w[k];
+            }
+            o[0] = clamp_byte(r);
+            o[1] = clamp_byte(g);
+            o[2] = clamp_byte(b);
+            o[3] = clamp_byte(al);
+#endif
+        }
+    }
+}
+
+/* Scales the columns of [src] ([w] pixels wide) to [a]'s output height. */
+static void scale_columns(const Uint8 *src, Uint8 *dst, int w, int y0, int y1, const struct axis_weights *a)
+{
+    size_t stride = (size_t)w * 4;
+    int y, x, k;
+    for (y = y0; y < y1; y++) {
+        const short *wt = a->weight + y * a->taps;
+        const Uint8 *in = src + a->first[y] * stride;
+        Uint8 *o = dst + y * stride;
+        int n = a->count[y];
+        x = 0;
+#ifdef __SSE2__
+        /* four pixels at a time, two rows per madd */
+        for (; x + 4 <= w; x += 4) {
+            __m128i zero = _mm_setzero_si128();
+            __m128i a0 = zero, a1 = zero, a2 = zero, a3 = zero, lo, hi;
+            for (k = 0; k < n; k += 2) {
+                __m128i r0 = _mm_loadu_si128((const __m128i *)(in + k * stride + x * 4));
+                __m128i r1 = k + 1 < n ? _mm_loadu_si128((const __m128i *)(in + (k + 1) * stride + x * 4)) : zero;
+                __m128i ww = _mm_set1_epi32(((k + 1 < n ? wt[k + 1] : 0) << 16) | (wt[k] & 0xffff));
+                lo = _mm_unpacklo_epi8(r0, r1);
+                hi = _mm_unpackhi_epi8(r0, r1);
+                a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), ww));
+                a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), ww));
+                a2 = _mm_add_epi32(a2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), ww));
+                a3 = _mm_add_epi32(a3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), ww));
+            }
+            {
+                __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+                a0 = _mm_srai_epi32(_mm_add_epi32(a0, round), WEIGHT_BITS);
+                a1 = _mm_srai_epi32(_mm_add_epi32(a1, round), WEIGHT_BITS);
+                a2 = _mm_srai_epi32(_mm_add_epi32(a2, round), WEIGHT_BITS);
+                a3 = _mm_srai_epi32(_mm_add_epi32(a3, round), WEIGHT_BITS);
+                _mm_storeu_si128((__m128i *)(o + x * 4),
+                                 _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3)));
+            }
+        }
+#endif
+        for (; x < w; x++) {
+            int c;
+            for (c = 0; c < 4; c++) {
+                int sum = 0;
+                for (k = 0; k < n; k++) sum += in[k * stride + x * 4 + c] * wt[k];
+                o[x * 4 + c] = clamp_byte(sum);
+            }
+        }
+    }
+}
+
+/* scale_rows and scale_columns for linear light: four floats a pixel */
+static void scale_rows_linear(const float *src, int sw, float *dst, int dw, int rows, const struct axis_weights *a)
+{
+    int y, x, k;
+    for (y = 0; y < rows; y++) {
+        const float *in = src + (size_t)y * sw * 4;
+        float *o = dst + (size_t)y * dw * 4;
+        for (x = 0; x < dw; x++, o += 4) {
+            const float *w = a->fweight + x * a->taps;
+            const float *p = in + a->first[x] * 4;
+            float r = 0.0f, g = 0.0f, b = 0.0f, al = 0.0f;
+            for (k = 0; k < a->count[x]; k++, p += 4) {
+                r += p[0] * w[k];
+                g += p[1] * w[k];
+                b += p[2] * w[k];
+                al += p[3] * w[k];
+            }
+            o[0] = r;
+            o[1] = g;
+            o[2] = b;
+            o[3] = al;
+        }
+    }
+}
+
+static void scale_columns_linear(const float *src, float *dst, int w, int y0, int y1, const struct axis_weights *a)
+{
+    size_t stride = (size_t)w * 4, i;
+    int y, k;
+    for (y = y0; y < y1; y++) {
+        const float *wt = a->fweight + y * a->taps;
+        float *o = dst + y * stride;
+        memset(o, 0, stride * sizeof(float));
+        for (k = 0; k < a->count[y]; k++) {
+            const float *in = src + (a->first[y] + k) * stride;
+            for (i = 0; i < stride; i++) o[i] += in[i] * wt[k];
+        }
+    }
+}
+
+/* Scales an RGBA image; returns 0 when out of memory. Touches no OCaml
+   values, so it can run in a blocking section. */
+static int resample(const Uint8 *src, int sw, int sh, Uint8 *dst, int dw, int dh, int filter)
+{
+    struct axis_weights h, v;
+    Uint8 *tmp;
+
+    if (!make_weights(&h, sw, dw, filter)) return 0;
+    if (!make_weights(&v, sh, dh, filter)) {
+        free_weights(&h);
+        return 0;
+    }
+    tmp = (Uint8 *)malloc((size_t)dw * sh * 4);
+    if (tmp != NULL) {
+        scale_rows(src, sw, tmp, dw, sh, &h);
+        scale_columns(tmp, dst, dw, 0, dh, &v);
+        free(tmp);
+    }
+    free_weights(&h);
+    free_weights(&v);
+    return tmp != NULL;
+}
+
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+#define RGBA_MASKS 0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff
+#else
+#define RGBA_MASKS 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000
+#endif
+
+static int is_rgba_bytes(const SDL_PixelFormat *f)
+{
+    static const Uint32 masks[4] = { RGBA_MASKS };
+    return f->BytesPerPixel == 4 && f->Rmask == masks[0] && f->Gmask == masks[1]
+        && f->Bmask == masks[2] && f->Amask == masks[3];
+}
+
+static Uint32 read_pixel(const Uint8 *p, int bpp)
+{
+    switch (bpp) {
+    case 1: return *p;
+    case 2: return *(const Uint16 *)p;
+    case 3:
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        return p[0] << 16 | p[1] << 8 | p[2];
+#else
+        return p[0] | p[1] << 8 | p[2] << 16;
+#endif
+    default: return *(const Uint32 *)p;
+    }
+}
+
+static void write_pixel(Uint8 *p, int bpp, Uint32 c)
+{
+    switch (bpp) {
+    case 1: *p = (Uint8)c; break;
+    case 2: *(Uint16 *)p = (Uint16)c; break;
+    case 3:
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        p[0] = (Uint8)(c >> 16); p[1] = (Uint8)(c >> 8); p[2] = (Uint8)c;
+#else
+        p[0] = (Uint8)c; p[1] = (Uint8)(c >> 8); p[2] = (Uint8)(c >> 16);
+#endif
+        break;
+    default: *(Uint32 *)p = c; break;
+    }
+}
+
+/* Copies a locked surface into packed RGBA bytes. */
+static void surface_to_rgba(SDL_Surface *s, Uint8 *out)
+{
+    SDL_PixelFormat *f = s->format;
+    int x, y;
+    for (y = 0; y < s->h; y++, out += s->w * 4) {
+        const Uint8 *row = (const Uint8 *)s->pixels + y * s->pitch;
+        if (is_rgba_bytes(f)) {
+            memcpy(out, row, s->w * 4);
+        } else {
+            for (x = 0; x < s->w; x++)
+                SDL_GetRGBA(read_pixel(row + x * f->BytesPerPixel, f->BytesPerPixel), f,
+                            &out[x * 4], &out[x * 4 + 1], &out[x * 4 + 2], &out[x * 4 + 3]);
+        }
+    }
+}
+
+/* Copies packed RGBA bytes into a locked surface of the same size. */
+static void rgba_to_surface(const Uint8 *in, SDL_Surface *s)
+{
+    SDL_PixelFormat *f = s->format;
+    int x, y;
+    for (y = 0; y < s->h; y++, in += s->w * 4) {
+        Uint8 *row = (Uint8 *)s->pixels + y * s->pitch;
+        if (is_rgba_bytes(f)) {
+            memcpy(row, in, s->w * 4);
+        } else {
+            for (x = 0; x < s->w; x++)
+                write_pixel(row + x * f->BytesPerPixel, f->BytesPerPixel,
+                            SDL_MapRGBA(f, in[x * 4], in[x * 4 + 1], in[x * 4 + 2], in[x * 4 + 3]));
+        }
+    }
+}
+
+/* A software surface of the given size in the format of [s]. */
+static SDL_Surface *create_like(SDL_Surface *s, int w, int h)
+{
+    SDL_PixelFormat *f = s->format;
+    SDL_Surface *t = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, f->BitsPerPixel,
+                                          f->Rmask, f->Gmask, f->Bmask, f->Amask);
+    if (t != NULL && f->palette != NULL)
+        SDL_SetColors(t, f->palette->colors, 0, f->palette->ncolors);
+    return t;
+}
+
+/* Reads [s] into a new RGBA buffer, or NULL with the SDL error set. */
+static Uint8 *read_surface(SDL_Surface *s)
+{
+    Uint8 *rgba = (Uint8 *)malloc((size_t)s->w * s->h * 4 + 1);
+    if (rgba == NULL) {
+        SDL_SetError("Out of memory");
+        return NULL;
+    }
+    if (SDL_MUSTLOCK(s) && SDL_LockSurface(s) < 0) {
+        free(rgba);
+        return NULL;
+    }
+    surface_to_rgba(s, rgba);
+    if (SDL_MUSTLOCK(s)) SDL_UnlockSurface(s);
+    return rgba;
+}
+
+/* Stores an RGBA buffer into a new surface like [like]. */
+static SDL_Surface *write_surface(SDL_Surface *like, const Uint8 *rgba, int w, int h)
+{
+    SDL_Surface *t = create_like(like, w, h);
+    if (t == NULL) return NULL;
+    if (SDL_MUSTLOCK(t) && SDL_LockSurface(t) < 0) {
+        SDL_FreeSurface(t);
+        return NULL;
+    }
+    rgba_to_surface(rgba, t);
+    if (SDL_MUSTLOCK(t)) SDL_UnlockSurface(t);
+    return t;
+}
+
+/* [scale_to s w h filter]: a new surface in the format of s. */
+value sdldraw_scale_to(value vs, value vw, value vh, value vfilter)
+{
+    CAMLparam4(vs, vw, vh, vfilter);
+    SDL_Surface *s = (SDL_Surface *) vs, *t;
+    int w = Int_val(vw), h = Int_val(vh), filter = Tag_val(vfilter), ok;
+    Uint8 *src, *dst;
+
+    if (w <= 0 || h <= 0 || s->w <= 0 || s->h <= 0) invalid_argument("Draw.scale_to");
+    src = read_surface(s);
+    if (src == NULL) raise_failure();
+    dst = (Uint8 *)malloc((size_t)w * h * 4 + 1);
+    if (dst == NULL) {
+        free(src);
+        raise_out_of_memory();
+    }
+    caml_enter_blocking_section();
+    ok = resample(src, s->w, s->h, dst, w, h, filter);
+    caml_leave_blocking_section();
+    free(src);
+    if (!ok) {
+        free(dst);
+        raise_out_of_memory();
+    }
+    t = write_surface(s, dst, w, h);
+    free(dst);
+    if (t == NULL) raise_failure();
+    CAMLreturn((value) t);
+}
+
+/* Mipmaps. Every level is resampled from the one before it. The rows of a
+   pass are cut into tiles which a pool of SDL threads and the calling
+   thread take in turn; the horizontal pass of a level is finished before
+   its vertical pass starts. With sRGB the levels are filtered as linear
+   floats and only rounded to sRGB bytes for the output, so the cascade
+   does not pile up rounding errors. */
+#define MAX_WORKERS 16
+#define MIN_TILE_PIXELS 16384
+#define LINEAR_STEPS 16384
+
+static float srgb_to_linear[256];
+static Uint8 linear_to_srgb[LINEAR_STEPS];
+
+static void init_srgb_tables(void)
+{
+    static int done = 0;
+    int i;
+    if (done) return;
+    for (i = 0; i < 256; i++) {
+        double c = i / 255.0;
+        srgb_to_linear[i] = (float)(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+    }
+    for (i = 0; i < LINEAR_STEPS; i++) {
+        double l = (double)i / (LINEAR_STEPS - 1);
+        double c = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1.0 / 2.4) - 0.055;
+        linear_to_srgb[i] = (Uint8)floor(c * 255.0 + 0.5);
+    }
+    done = 1;
+}
+
+static Uint8 encode_channel(float x, int srgb)
+{
+    if (x <= 0.0f) return 0;
+    if (x >= 1.0f) return 255;
+    return srgb ? linear_to_srgb[(int)(x * (LINEAR_STEPS - 1) + 0.5f)] : (Uint8)(x * 255.0f + 0.5f);
+}
+
+/* One pass over the rows y0 to y1 of a level. */
+struct level_pass {
+    void (*run)(const struct level_pass *, int, int);
+    const void *src;
+    void *tmp, *dst;
+    int sw, dw;
+    const struct axis_weights *h, *v;
+};
+
+static void rows_bytes(const struct level_pass *p, int y0, int y1)
+{
+    scale_rows((const Uint8 *)p->src + (size_t)y0 * p->sw * 4, p->sw,
+               (Uint8 *)p->tmp + (size_t)y0 * p->dw * 4, p->dw, y1 - y0, p->h);
+}
+
+static void columns_bytes(const struct level_pass *p, int y0, int y1)
+{
+    scale_columns((const Uint8 *)p->tmp, (Uint8 *)p->dst, p->dw, y0, y1, p->v);
+}
+
+static void rows_linear(const struct level_pass *p, int y0, int y1)
+{
+    scale_rows_linear((const float *)p->src + (size_t)y0 * p->sw * 4, p->sw,
+                      (float *)p->tmp + (size_t)y0 * p->dw * 4, p->dw, y1 - y0, p->h);
+}
+
+static void columns_linear(const struct level_pass *p, int y0, int y1)
+{
+    scale_columns_linear((const float *)p->tmp, (float *)p->dst, p->dw, y0, y1, p->v);
+}
+
+/* sRGB bytes to linear floats; alpha is linear already */
+static void decode_rows(const struct level_pass *p, int y0, int y1)
+{
+    const Uint8 *in = (const Uint8 *)p->src + (size_t)y0 * p->sw * 4;
+    float *out = (float *)p->dst + (size_t)y0 * p->sw * 4;
+    size_t i, n = (size_t)(y1 - y0) * p->sw;
+    for (i = 0; i < n; i++, in += 4, out += 4) {
+        out[0] = srgb_to_linear[in[0]];
+        out[1] = srgb_to_linear[in[1]];
+        out[2] = srgb_to_linear[in[2]];
+        out[3] = in[3] / 255.0f;
+    }
+}
+
+static void encode_rows(const struct level_pass *p, int y0, int y1)
+{
+    const float *in = (const float *)p->src + (size_t)y0 * p->sw * 4;
+    Uint8 *out = (Uint8 *)p->dst + (size_t)y0 * p->sw * 4;
+    size_t i, n = (size_t)(y1 - y0) * p->sw;
+    for (i = 0; i < n; i++, in += 4, out += 4) {
+        out[0] = encode_channel(in[0], 1);
+        out[1] = encode_channel(in[1], 1);
+        out[2] = encode_channel(in[2], 1);
+        out[3] = encode_channel(in[3], 0);
+    }
+}
+
+struct pool {
+    SDL_mutex *lock;
+    SDL_cond *wake, *finished;
+    SDL_Thread *threads[MAX_WORKERS];
+    int workers, generation, quit;
+    struct level_pass pass;
+    int rows, tile, next_tile, tiles, done;
+};
+
+/* Takes tiles until none are left; called with the lock held. */
+static void run_tiles(struct pool *p)
+{
+    while (p->next_tile < p->tiles) {
+        struct level_pass pass = p->pass;
+        int y0 = p->next_tile++ * p->tile;
+        int y1 = y0 + p->tile < p->rows ? y0 + p->tile : p->rows;
+        SDL_mutexV(p->lock);
+        pass.run(&pass, y0, y1);
+        SDL_mutexP(p->lock);
+        if (++p->done == p->tiles) SDL_CondBroadcast(p->finished);
+    }
+}
+
+static int pool_worker(void *data)
+{
+    struct pool *p = (struct pool *)data;
+    int seen = 0;
+    SDL_mutexP(p->lock);
+    while (!p->quit) {
+        if (p->generation == seen) {
+            SDL_CondWait(p->wake, p->lock);
+        } else {
+            seen = p->generation;
+            run_tiles(p);
+        }
+    }
+    SDL_mutexV(p->lock);
+    return 0;
+}
+
+static int cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+/* Starts [workers] threads; if SDL cannot make them, the calling thread
+   does all the work. */
+static void start_pool(struct pool *p, int workers)
+{
+    memset(p, 0, sizeof(*p));
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    if (workers <= 0) return;
+    p->lock = SDL_CreateMutex();
+    p->wake = SDL_CreateCond();
+    p->finished = SDL_CreateCond();
+    if (p->lock == NULL || p->wake == NULL || p->finished == NULL) return;
+    while (p->workers < workers) {
+        p->threads[p->workers] = SDL_CreateThread(pool_worker, p);
+        if (p->threads[p->workers] == NULL) break;
+        p->workers++;
+    }
+}
+
+static void stop_pool(struct pool *p)
+{
+    int i;
+    if (p->workers > 0) {
+        SDL_mutexP(p->lock);
+        p->quit = 1;
+        SDL_CondBroadcast(p->wake);
+        SDL_mutexV(p->lock);
+        for (i = 0; i < p->workers; i++) SDL_WaitThread(p->threads[i], NULL);
+    }
+    if (p->finished != NULL) SDL_DestroyCond(p->finished);
+    if (p->wake != NULL) SDL_DestroyCond(p->wake);
+    if (p->lock != NULL) SDL_DestroyMutex(p->lock);
+}
+
+/* Runs [pass] over [rows] rows of [width] pixels; small passes are not
+   worth waking the workers for. */
+static void run_pass(struct pool *p, const struct level_pass *pass, int rows, int width)
+{
+    int tile;
+    if (p->workers == 0 || (long)rows * width < 2 * MIN_TILE_PIXELS) {
+        pass->run(pass, 0, rows);
+        return;
+    }
+    /* about four tiles per thread, but not too small */
+    tile = (rows + 4 * (p->workers + 1) - 1) / (4 * (p->workers + 1));
+    if ((long)tile * width < MIN_TILE_PIXELS) tile = (MIN_TILE_PIXELS + width - 1) / width;
+    SDL_mutexP(p->lock);
+    p->pass = *pass;
+    p->rows = rows;
+    p->tile = tile;
+    p->tiles = (rows + tile - 1) / tile;
+    p->next_tile = p->done = 0;
+    p->generation++;
+    SDL_CondBroadcast(p->wake);
+    run_tiles(p);
+    while (p->done < p->tiles) SDL_CondWait(p->finished, p->lock);
+    SDL_mutexV(p->lock);
+}
+
+/* Scales a level into the next through [tmp]; returns 0 when out of memory. */
+static int resample_level(struct pool *p, const void *src, int sw, int sh, void *dst, int dw, int dh,
+                          int filter, int linear, void *tmp)
+{
+    struct axis_weights h, v;
+    struct level_pass pass;
+
+    if (!make_weights(&h, sw, dw, filter)) return 0;
+    if (!make_weights(&v, sh, dh, filter)) {
+        free_weights(&h);
+        return 0;
+    }
+    pass.src = src;
+    pass.tmp = tmp;
+    pass.dst = dst;
+    pass.sw = sw;
+    pass.dw = dw;
+    pass.h = &h;
+    pass.v = &v;
+    pass.run = linear ? rows_linear : rows_bytes;
+    run_pass(p, &pass, sh, dw);
+    pass.run = linear ? columns_linear : columns_bytes;
+    run_pass(p, &pass, dh, dw);
+    free_weights(&h);
+    free_weights(&v);
+    return 1;
+}
+
+struct mip_level {
+    size_t offset;
+    int w, h;
+};
+
+#define MAX_LEVELS 32
+
+static int closest_power_of_2(int n)
+{
+    int lo = 1;
+    while (lo * 2 <= n) lo *= 2;
+    return n - lo < lo * 2 - n ? lo : lo * 2;
+}
+
+/* Fills [packed] with all levels; [cur] and [next] hold a level as linear
+   floats when [srgb]. Touches no OCaml values. */
+static int build_chain(struct pool *p, const Uint8 *src, int sw, int sh, const struct mip_level *lv, int n,
+                       Uint8 *packed, int filter, int srgb, void *tmp, float *cur, float *next)
+{
+    struct level_pass pass;
+    int i;
+
+    if (!srgb) {
+        if (lv[0].w == sw && lv[0].h == sh)
+            memcpy(packed, src, (size_t)sw * sh * 4);
+        else if (!resample_level(p, src, sw, sh, packed, lv[0].w, lv[0].h, filter, 0, tmp))
+            return 0;
+        for (i = 1; i < n; i++)
+            if (!resample_level(p, packed + lv[i - 1].offset, lv[i - 1].w, lv[i - 1].h,
+                                packed + lv[i].offset, lv[i].w, lv[i].h, filter, 0, tmp))
+                return 0;
+        return 1;
+    }
+    memset(&pass, 0, sizeof(pass));
+    pass.run = decode_rows;
+    pass.src = src;
+    pass.dst = cur;
+    pass.sw = sw;
+    run_pass(p, &pass, sh, sw);
+    for (i = 0; i < n; i++) {
+        const struct mip_level *from = i == 0 ? NULL : &lv[i - 1];
+        int fw = from ? from->w : sw, fh = from ? from->h : sh;
+        if (i == 0 && lv[0].w == sw && lv[0].h == sh) {
+            memcpy(packed, src, (size_t)sw * sh * 4);
+            continue;
+        }
+        if (!resample_level(p, cur, fw, fh, next, lv[i].w, lv[i].h, filter, 1, tmp)) return 0;
+        pass.run = encode_rows;
+        pass.src = next;
+        pass.dst = packed + lv[i].offset;
+        pass.sw = lv[i].w;
+        run_pass(p, &pass, lv[i].h, lv[i].w);
+        { float *t = cur; cur = next; next = t; }
+    }
+    return 1;
+}
+
+/* [build_mipmaps s filter srgb power_of_two threads]: the levels down to
+   1x1 packed as RGBA bytes, with the offset and size of each. */
+value sdldraw_build_mipmaps(value vs, value vfilter, value vsrgb, value vpot, value vthreads)
+{
+    CAMLparam5(vs, vfilter, vsrgb, vpot, vthreads);
+    CAMLlocal3(data, levels, level);
+    SDL_Surface *s = (SDL_Surface *) vs;
+    int filter = Tag_val(vfilter), srgb = Bool_val(vsrgb), threads = Int_val(vthreads);
+    struct mip_level lv[MAX_LEVELS];
+    size_t total = 0, tmp_size, linear_size;
+    Uint8 *src, *packed;
+    void *tmp;
+    float *cur = NULL, *next = NULL;
+    struct pool pool;
+    int i, n, ok;
+
+    if (s->w <= 0 || s->h <= 0 || threads < 0) invalid_argument("Draw.build_mipmaps");
+    lv[0].w = Bool_val(vpot) ? closest_power_of_2(s->w) : s->w;
+    lv[0].h = Bool_val(vpot) ? closest_power_of_2(s->h) : s->h;
+    tmp_size = (size_t)lv[0].w * s->h;
+    linear_size = (size_t)s->w * s->h > (size_t)lv[0].w * lv[0].h ? (size_t)s->w * s->h : (size_t)lv[0].w * lv[0].h;
+    for (n = 0; ; n++) {
+        if (n > 0) {
+            lv[n].w = lv[n - 1].w > 1 ? lv[n - 1].w / 2 : 1;
+            lv[n].h = lv[n - 1].h > 1 ? lv[n - 1].h / 2 : 1;
+            if ((size_t)lv[n].w * lv[n - 1].h > tmp_size) tmp_size = (size_t)lv[n].w * lv[n - 1].h;
+        }
+        lv[n].offset = total;
+        total += (size_t)lv[n].w * lv[n].h * 4;
+        if (lv[n].w == 1 && lv[n].h == 1) break;
+    }
+    n++;
+
+    src = read_surface(s);
+    if (src == NULL) raise_failure();
+    packed = (Uint8 *)malloc(total);
+    tmp = malloc(tmp_size * (srgb ? 4 * sizeof(float) : 4));
+    if (srgb) {
+        init_srgb_tables();
+        cur = (float *)malloc(linear_size * 4 * sizeof(float));
+        next = (float *)malloc(linear_size * 4 * sizeof(float));
+    }
+    ok = packed != NULL && tmp != NULL && (!srgb || (cur != NULL && next != NULL));
+    if (ok) {
+        caml_enter_blocking_section();
+        start_pool(&pool, (threads == 0 ? cpu_count() : threads) - 1);
+        ok = build_chain(&pool, src, s->w, s->h, lv, n, packed, filter, srgb, tmp, cur, next);
+        stop_pool(&pool);
+        caml_leave_blocking_section();
+    }
+    free(src);
+    free(tmp);
+    free(cur);
+    free(next);
+    if (!ok) {
+        free(packed);
+        raise_out_of_memory();
+    }
+    data = alloc_bigarray_dims(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT | BIGARRAY_MANAGED, 1, packed, (long)total);
+    levels = alloc(n, 0);
+    for (i = 0; i < n; i++) {
+        level = alloc_tuple(3);
+        Store_field(level, 0, Val_long(lv[i].offset));
+        Store_field(level, 1, Val_int(lv[i].w));
+        Store_field(level, 2, Val_int(lv[i].h));
+        Store_field(levels, i, level);
+    }
+    level = alloc_tuple(2);
+    Store_field(level, 0, data);
+    Store_field(level, 1, levels);
+    CAMLreturn(level);
+}
+
+/* [surface_of_rgba like pixels w h]: a new surface in the format of like. */
+value sdldraw_surface_of_rgba(value vlike, value vpixels, value vw, value vh)
+{
+    CAMLparam4(vlike, vpixels, vw, vh);
+    int w = Int_val(vw), h = Int_val(vh);
+    SDL_Surface *t;
+
+    if (w <= 0 || h <= 0 || Bigarray_val(vpixels)->dim[0] < (long)w * h * 4)
+        invalid_argument("Draw.surface_of_rgba");
+    t = write_surface((SDL_Surface *) vlike, (const Uint8 *)Data_bigarray_val(vpixels), w, h);
+    if (t == NULL) raise_failure();
+    CAMLreturn((value) t);
+}
+
+/* Pixel spans: rectangles of pixels moved between a surface and an int32
+   bigarray (row after row, w pixels each) under one lock, with the pixel
+   size looked at once per row rather than per pixel. */
+
+static void check_rect(SDL_Surface *s, int x, int y, int w, int h, const char *name)
+{
+    if (x < 0 || y < 0 || w < 0 || h < 0 || x > s->w - w || y > s->h - h) invalid_argument(name);
+}
+
+static void lock_surface(SDL_Surface *s)
+{
+    if (SDL_MUSTLOCK(s) && SDL_LockSurface(s) < 0) raise_failure();
+}
+
+static void unlock_surface(SDL_Surface *s)
+{
+    if (SDL_MUSTLOCK(s)) SDL_UnlockSurface(s);
+}
+
+static void load_row(const Uint8 *row, int bpp, Uint32 *out, int n)
+{
+    int i;
+    switch (bpp) {
+    case 1:
+        for (i = 0; i < n; i++) out[i] = row[i];
+        break;
+    case 2:
+        for (i = 0; i < n; i++) out[i] = ((const Uint16 *)row)[i];
+        break;
+    case 3:
+        for (i = 0; i < n; i++) out[i] = read_pixel(row + i * 3, 3);
+        break;
+    default:
+        memcpy(out, row, n * 4);
+        break;
+    }
+}
+
+static void store_row(Uint8 *row, int bpp, const Uint32 *in, int n)
+{
+    int i;
+    switch (bpp) {
+    case 1:
+        for (i = 0; i < n; i++) row[i] = (Uint8)in[i];
+        break;
+    case 2:
+        for (i = 0; i < n; i++) ((Uint16 *)row)[i] = (Uint16)in[i];
+        break;
+    case 3:
+        for (i = 0; i < n; i++) write_pixel(row + i * 3, 3, in[i]);
+        break;
+    default:
+        memcpy(row, in, n * 4);
+        break;
+    }
+}
+
+static void fill_row(Uint8 *row, int bpp, Uint32 pixel, int n)
+{
+    int i;
+    switch (bpp) {
+    case 1:
+        memset(row, (Uint8)pixel, n);
+        break;
+    case 2:
+        for (i = 0; i < n; i++) ((Uint16 *)row)[i] = (Uint16)pixel;
+        break;
+    case 3:
+        for (i = 0; i < n; i++) write_pixel(row + i * 3, 3, pixel);
+        break;
+    default:
+        for (i = 0; i < n; i++) ((Uint32 *)row)[i] = pixel;
+        break;
+    }
+}
+
+static Uint8 *pixel_address(SDL_Surface *s, int x, int y)
+{
+    return (Uint8 *)s->pixels + y * s->pitch + x * s->format->BytesPerPixel;
+}
+
+/* [read_pixels s x y w h buf] */
+value sdldraw_read_pixels(value vs, value vx, value vy, value vw, value vh, value vbuf)
+{
+    CAMLparam5(vs, vx, vy, vw, vh);
+    CAMLxparam1(vbuf);
+    SDL_Surface *s = (SDL_Surface *) vs;
+    int x = Int_val(vx), y = Int_val(vy), w = Int_val(vw), h = Int_val(vh), i;
+    Uint32 *buf = (Uint32 *)Data_bigarray_val(vbuf);
+
+    check_rect(s, x, y, w, h, "Draw.read_pixels");
+    if (Bigarray_val(vbuf)->dim[0] < (long)w * h) invalid_argument("Draw.read_pixels");
+    lock_surface(s);
+    for (i = 0; i < h; i++)
+        load_row(pixel_address(s, x, y + i), s->format->BytesPerPixel, buf + (size_t)i * w, w);
+    unlock_surface(s);
+    CAMLreturn(Val_unit);
+}
+
+value sdldraw_read_pixels_byte(value *argv, __attribute__((unused)) int n)
+{
+    return sdldraw_read_pixels(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+/* [write_pixels s x y w h buf] */
+value sdldraw_write_pixels(value vs, value vx, value vy, value vw, value vh, value vbuf)
+{
+    CAMLparam5(vs, vx, vy, vw, vh);
+    CAMLxparam1(vbuf);
+    SDL_Surface *s = (SDL_Surface *) vs;
+    int x = Int_val(vx), y = Int_val(vy), w = Int_val(vw), h = Int_val(vh), i;
+    const Uint32 *buf = (const Uint32 *)Data_bigarray_val(vbuf);
+
+    check_rect(s, x, y, w, h, "Draw.write_pixels");
+    if (Bigarray_val(vbuf)->dim[0] < (long)w * h) invalid_argument("Draw.write_pixels");
+    lock_surface(s);
+    for (i = 0; i < h; i++)
+        store_row(pixel_address(s, x, y + i), s->format->BytesPerPixel, buf + (size_t)i * w, w);
+    unlock_surface(s);
+    sdl_mark_dirty(s, x, y, w, h);
+    CAMLreturn(Val_unit);
+}
+
+value sdldraw_write_pixels_byte(value *argv, __attribute__((unused)) int n)
+{
+    return sdldraw_write_pixels(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+/* [fill_pixels s x y w h pixel] */
+value sdldraw_fill_pixels(value vs, value vx, value vy, value vw, value vh, value vpixel)
+{
+    CAMLparam5(vs, vx, vy, vw, vh);
+    CAMLxparam1(vpixel);
+    SDL_Surface *s = (SDL_Surface *) vs;
+    int x = Int_val(vx), y = Int_val(vy), w = Int_val(vw), h = Int_val(vh), i;
+    Uint32 pixel = (Uint32)Int32_val(vpixel);
+
+    check_rect(s, x, y, w, h, "Draw.fill_pixels");
+    lock_surface(s);
+    for (i = 0; i < h; i++) fill_row(pixel_address(s, x, y + i), s->format->BytesPerPixel, pixel, w);
+    unlock_surface(s);
+    sdl_mark_dirty(s, x, y, w, h);
+    CAMLreturn(Val_unit);
+}
+
+value sdldraw_fill_pixels_byte(value *argv, __attribute__((unused)) int n)
+{
+    return sdldraw_fill_pixels(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+static int same_format(const SDL_PixelFormat *a, const SDL_PixelFormat *b)
+{
+    if (a->BytesPerPixel != b->BytesPerPixel) return 0;
+    if (a->palette != NULL || b->palette != NULL)
+        return a->palette != NULL && b->palette != NULL && a->palette->ncolors == b->palette->ncolors
+            && memcmp(a->palette->colors, b->palette->colors, a->palette->ncolors * sizeof(SDL_Color)) == 0;
+    return a->Rmask == b->Rmask && a->Gmask == b->Gmask && a->Bmask == b->Bmask && a->Amask == b->Amask;
+}
+
+/* SDL_GetRGBA and SDL_MapRGBA, without a call unless there is a palette */
+static void unmap_pixel(const SDL_PixelFormat *f, Uint32 v, Uint8 *r, Uint8 *g, Uint8 *b, Uint8 *a)
+{
+    Uint32 c;
+    if (f->palette != NULL) {
+        const SDL_Color *col = &f->palette->colors[v < (Uint32)f->palette->ncolors ? v : 0];
+        *r = col->r;
+        *g = col->g;
+        *b = col->b;
+        *a = 255;
+        return;
+    }
+    c = (v & f->Rmask) >> f->Rshift;
+    *r = (Uint8)((c << f->Rloss) + (c >> (8 - (f->Rloss << 1))));
+    c = (v & f->Gmask) >> f->Gshift;
+    *g = (Uint8)((c << f->Gloss) + (c >> (8 - (f->Gloss << 1))));
+    c = (v & f->Bmask) >> f->Bshift;
+    *b = (Uint8)((c << f->Bloss) + (c >> (8 - (f->Bloss << 1))));
+    if (f->Amask) {
+        c = (v & f->Amask) >> f->Ashift;
+        *a = (Uint8)((c << f->Aloss) + (c >> (8 - (f->Aloss << 1))));
+    } else {
+        *a = 255;
+    }
+}
+
+static Uint32 map_pixel(const SDL_PixelFormat *f, Uint8 r, Uint8 g, Uint8 b, Uint8 a)
+{
+    if (f->palette != NULL) return SDL_MapRGBA((SDL_PixelFormat *)f, r, g, b, a);
+    return (r >> f->Rloss) << f->Rshift | (g >> f->Gloss) << f->Gshift
+         | (b >> f->Bloss) << f->Bshift | (((Uint32)a >> f->Aloss) << f->Ashift & f->Amask);
+}
+
+/* Converts pixels in place between formats. */
+static void convert_row(Uint32 *p, int n, const SDL_PixelFormat *from, const SDL_PixelFormat *to)
+{
+    int i;
+    Uint8 r, g, b, a;
+    for (i = 0; i < n; i++) {
+        unmap_pixel(from, p[i], &r, &g, &b, &a);
+        p[i] = map_pixel(to, r, g, b, a);
+    }
+}
+
+/* [copy_pixels src sx sy dst dx dy w h], converting between the formats
+   if they differ; src and dst may be the same surface. */
+value sdldraw_copy_pixels(value vsrc, value vsx, value vsy, value vdst, value vdx, value vdy, value vw, value vh)
+{
+    CAMLparam5(vsrc, vsx, vsy, vdst, vdx);
+    CAMLxparam3(vdy, vw, vh);
+    SDL_Surface *src = (SDL_Surface *) vsrc, *dst = (SDL_Surface *) vdst;
+    int sx = Int_val(vsx), sy = Int_val(vsy), dx = Int_val(vdx), dy = Int_val(vdy);
+    int w = Int_val(vw), h = Int_val(vh), i, row, step;
+    int same = same_format(src->format, dst->format);
+    Uint32 *tmp = NULL;
+
+    check_rect(src, sx, sy, w, h, "Draw.copy_pixels");
+    check_rect(dst, dx, dy, w, h, "Draw.copy_pixels");
+    if (!same) {
+        tmp = (Uint32 *)malloc(w * sizeof(Uint32) + 1);
+        if (tmp == NULL) raise_out_of_memory();
+    }
+    if (SDL_MUSTLOCK(src) && SDL_LockSurface(src) < 0) {
+        free(tmp);
+        raise_failure();
+    }
+    if (dst != src && SDL_MUSTLOCK(dst) && SDL_LockSurface(dst) < 0) {
+        unlock_surface(src);
+        free(tmp);
+        raise_failure();
+    }
+    /* bottom up when copying down within one surface */
+    row = src == dst && dy > sy ? h - 1 : 0;
+    step = row == 0 ? 1 : -1;
+    for (i = 0; i < h; i++, row += step) {
+        const Uint8 *from = pixel_address(src, sx, sy + row);
+        Uint8 *to = pixel_address(dst, dx, dy + row);
+        if (same) {
+            memmove(to, from, (size_t)w * src->format->BytesPerPixel);
+        } else {
+            load_row(from, src->format->BytesPerPixel, tmp, w);
+            convert_row(tmp, w, src->format, dst->format);
+            store_row(to, dst->format->BytesPerPixel, tmp, w);
+        }
+    }
+    if (dst != src) unlock_surface(dst);
+    unlock_surface(src);
+    free(tmp);
+    sdl_mark_dirty(dst, dx, dy, w, h);
+    CAMLreturn(Val_unit);
+}
+
+value sdldraw_copy_pixels_byte(value *argv, __attribute__((unused)) int n)
+{
+    return sdldraw_copy_pixels(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7]);
+}
+
+/* TGA images: colour mapped (types 1 and 9), true colour (2 and 10) and
+   grey (3 and 11), raw or run-length encoded, at 8, 15, 16, 24 and 32 bits
+   per pixel, stored from either corner. The file is read and decoded with
+   the runtime lock released; errors are raised afterwards as TGA_failure. */
+
+enum { TGA_OK, TGA_NO_FILE, TGA_TRUNCATED, TGA_UNSUPPORTED, TGA_NO_MEMORY, TGA_NO_SURFACE };
+
+static const char *tga_errors[] = {
+    "", "Unable to load TGA file", "Truncated TGA file", "Cannot decode this TGA file type",
+    "Out of memory", "Cannot create surface"
+};
+
+struct tga {
+    int type, width, height, bits, bytes, descriptor;
+    int map_first, map_length, map_bytes;
+    const Uint8 *map, *data;
+    size_t data_size;
+};
+
+static void raise_tga(int error)
+{
+    raise_with_string(*caml_named_value("TGA_failure"), tga_errors[error]);
+}
+
+static int tga_header(const Uint8 *f, size_t n, struct tga *t)
+{
+    size_t offset;
+    int base;
+
+    if (n < 18) return TGA_TRUNCATED;
+    t->type = f[2];
+    t->map_first = f[3] | f[4] << 8;
+    t->map_length = f[5] | f[6] << 8;
+    t->map_bytes = (f[7] + 7) / 8;
+    t->width = f[12] | f[13] << 8;
+    t->height = f[14] | f[15] << 8;
+    t->bits = f[16];
+    t->descriptor = f[17];
+    t->bytes = (t->bits + 7) / 8;
+    base = t->type & ~8;
+    if (t->width == 0 || t->height == 0 || (t->type & ~(8 | 3)) != 0 || base == 0) return TGA_UNSUPPORTED;
+    if (base == 1 && (f[1] != 1 || t->bits != 8 || t->map_bytes < 2 || t->map_bytes > 4)) return TGA_UNSUPPORTED;
+    if (base == 2 && t->bits != 15 && t->bits != 16 && t->bits != 24 && t->bits != 32) return TGA_UNSUPPORTED;
+    if (base == 3 && t->bits != 8) return TGA_UNSUPPORTED;
+    /* the colour map is skipped unless the image uses it */
+    offset = 18 + f[0];
+    t->map = f + offset;
+    if (f[1] == 1) offset += (size_t)t->map_length * t->map_bytes;
+    if (offset > n) return TGA_TRUNCATED;
+    t->data = f + offset;
+    t->data_size = n - offset;
+    return TGA_OK;
+}
+
+/* Expands the packets into width * height pixels in file order. */
+static int tga_unpack(const struct tga *t, Uint8 *out)
+{
+    size_t total = (size_t)t->width * t->height * t->bytes, pos = 0, in = 0, len, done;
+    int count;
+
+    if (!(t->type & 8)) {
+        if (t->data_size < total) return TGA_TRUNCATED;
+        memcpy(out, t->data, total);
+        return TGA_OK;
+    }
+    while (pos < total) {
+        if (in >= t->data_size) return TGA_TRUNCATED;
+        count = (t->data[in] & 0x7f) + 1;
+        len = (size_t)count * t->bytes;
+        if (len > total - pos) len = total - pos;
+        if (t->data[in++] & 0x80) {
+            if ((size_t)t->bytes > t->data_size - in) return TGA_TRUNCATED;
+            /* one pixel, then doubling copies */
+            memcpy(out + pos, t->data + in, t->bytes);
+            for (done = t->bytes; done < len; done *= 2)
+                memcpy(out + pos + done, out + pos, done < len - done ? done : len - done);
+            in += t->bytes;
+        } else {
+            if (len > t->data_size - in) return TGA_TRUNCATED;
+            memcpy(out + pos, t->data + in, len);
+            in += len;
+        }
+        pos += len;
+    }
+    return TGA_OK;
+}
+
+/* 15 and 16 bit colours are little endian A1 R5 G5 B5 */
+static void tga_rgba(const Uint8 *p, int bytes, Uint8 *out)
+{
+    Uint16 c;
+    switch (bytes) {
+    case 2:
+        c = (Uint16)(p[0] | p[1] << 8);
+        out[0] = (Uint8)((c >> 7 & 0xf8) | (c >> 12 & 7));
+        out[1] = (Uint8)((c >> 2 & 0xf8) | (c >> 7 & 7));
+        out[2] = (Uint8)((c << 3 & 0xf8) | (c >> 2 & 7));
+        out[3] = 255;
+        break;
+    case 3:
+        out[0] = p[2];
+        out[1] = p[1];
+        out[2] = p[0];
+        out[3] = 255;
+        break;
+    default:
+        out[0] = p[2];
+        out[1] = p[1];
+        out[2] = p[0];
+        out[3] = p[3];
+        break;
+    }
+}
+
+/* Converts one row of unpacked pixels to RGBA. */
+static void tga_row_rgba(const struct tga *t, const Uint8 *in, Uint8 *out)
+{
+    int x, base = t->type & ~8;
+    for (x = 0; x < t->width; x++, out += 4) {
+        const Uint8 *p = in + x * t->bytes;
+        if (base == 3) {
+            out[0] = out[1] = out[2] = *p;
+            out[3] = 255;
+        } else if (base == 1) {
+            int i = *p - t->map_first;
+            if (i >= 0 && i < t->map_length) {
+                tga_rgba(t->map + i * t->map_bytes, t->map_bytes, out);
+            } else {
+                out[0] = out[1] = out[2] = out[3] = 0;
+            }
+        } else {
+            tga_rgba(p, t->bytes, out);
+        }
+    }
+}
+
+/* Converts one row into the surface format chosen by tga_surface. */
+static void tga_row_native(const struct tga *t, const Uint8 *in, Uint8 *out)
+{
+    int x;
+    switch ((t->type & ~8) == 2 ? t->bytes : 0) {
+    case 2:
+        for (x = 0; x < t->width; x++) ((Uint16 *)out)[x] = (Uint16)(in[x * 2] | in[x * 2 + 1] << 8);
+        break;
+    case 3:
+        for (x = 0; x < t->width; x++, in += 3, out += 3) {
+            out[0] = in[2];
+            out[1] = in[1];
+            out[2] = in[0];
+        }
+        break;
+    case 4:
+        for (x = 0; x < t->width; x++, in += 4, out += 4) {
+            out[0] = in[2];
+            out[1] = in[1];
+            out[2] = in[0];
+            out[3] = in[3];
+        }
+        break;
+    default:
+        if ((t->type & ~8) == 3) memcpy(out, in, t->width);
+        else tga_row_rgba(t, in, out);
+        break;
+    }
+}
+
+/* True colour keeps its depth with bytes in R, G, B(, A) order, 15 and 16
+   bit images become A1 R5 G5 B5 surfaces, grey images 8 bit surfaces with
+   a grey palette and colour mapped ones RGBA surfaces. */
+static SDL_Surface *tga_surface(const struct tga *t)
+{
+    SDL_Surface *s;
+    int base = t->type & ~8;
+    if (base == 2 && t->bytes == 2) {
+        s = SDL_CreateRGBSurface(SDL_SWSURFACE, t->width, t->height, 16, 0x7c00, 0x03e0, 0x001f,
+                                 (t->descriptor & 0x0f) != 0 ? 0x8000 : 0);
+    } else if (base == 2 && t->bytes == 3) {
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        s = SDL_CreateRGBSurface(SDL_SWSURFACE, t->width, t->height, 24, 0xff0000, 0x00ff00, 0x0000ff, 0);
+#else
+        s = SDL_CreateRGBSurface(SDL_SWSURFACE, t->width, t->height, 24, 0x0000ff, 0x00ff00, 0xff0000, 0);
+#endif
+    } else if (base == 3) {
+        SDL_Color grey[256];
+        int i;
+        s = SDL_CreateRGBSurface(SDL_SWSURFACE, t->width, t->height, 8, 0, 0, 0, 0);
+        for (i = 0; i < 256; i++) grey[i].r = grey[i].g = grey[i].b = (Uint8)i;
+        if (s != NULL) SDL_SetColors(s, grey, 0, 256);
+    } else {
+        s = SDL_CreateRGBSurface(SDL_SWSURFACE, t->width, t->height, 32, RGBA_MASKS);
+    }
+    return s;
+}
+
+/* Unpacks the image and hands each row, top to bottom and left to right,
+   to [row]; out_row is where row y goes. */
+static int tga_decode(const struct tga *t, void (*row)(const struct tga *, const Uint8 *, Uint8 *),
+                      Uint8 *out, size_t out_pitch)
+{
+    size_t in_pitch = (size_t)t->width * t->bytes;
+    Uint8 *pixels = (Uint8 *)malloc(in_pitch * t->height), *flipped = NULL;
+    int y, x, error;
+
+    if (pixels == NULL) return TGA_NO_MEMORY;
+    error = tga_unpack(t, pixels);
+    if (error == TGA_OK && (t->descriptor & 0x10)) {
+        /* stored right to left */
+        flipped = (Uint8 *)malloc(in_pitch);
+        if (flipped == NULL) error = TGA_NO_MEMORY;
+    }
+    for (y = 0; error == TGA_OK && y < t->height; y++) {
+        const Uint8 *in = pixels + (t->descriptor & 0x20 ? y : t->height - 1 - y) * in_pitch;
+        if (flipped != NULL) {
+            for (x = 0; x < t->width; x++)
+                memcpy(flipped + x * t->bytes, in + (t->width - 1 - x) * t->bytes, t->bytes);
+            in = flipped;
+        }
+        row(t, in, out + y * out_pitch);
+    }
+    free(flipped);
+    free(pixels);
+    return error;
+}
+
+static int read_file(const char *path, Uint8 **data, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    long n;
+    if (f == NULL) return TGA_NO_FILE;
+    if (fseek(f, 0, SEEK_END) != 0 || (n = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return TGA_NO_FILE;
+    }
+    *data = (Uint8 *)malloc(n + 1);
+    if (*data == NULL) {
+        fclose(f);
+        return TGA_NO_MEMORY;
+    }
+    *size = fread(*data, 1, n, f);
+    fclose(f);
+    return TGA_OK;
+}
+
+static char *copy_path(value vpath)
+{
+    char *path = (char *)malloc(strlen(String_val(vpath)) + 1);
+    if (path == NULL) raise_out_of_memory();
+    strcpy(path, String_val(vpath));
+    return path;
+}
+
+static int tga_to_surface(const Uint8 *data, size_t size, SDL_Surface **s)
+{
+    struct tga t;
+    int error = tga_header(data, size, &t);
+    if (error != TGA_OK) return error;
+    *s = tga_surface(&t);
+    if (*s == NULL) return TGA_NO_SURFACE;
+    error = tga_decode(&t, tga_row_native, (Uint8 *)(*s)->pixels, (*s)->pitch);
+    if (error != TGA_OK) {
+        SDL_FreeSurface(*s);
+        *s = NULL;
+    }
+    return error;
+}
+
+value sdldraw_load_tga(value vpath)
+{
+    CAMLparam1(vpath);
+    char *path = copy_path(vpath);
+    Uint8 *data = NULL;
+    size_t size = 0;
+    SDL_Surface *s = NULL;
+    int error;
+
+    caml_enter_blocking_section();
+    error = read_file(path, &data, &size);
+    if (error == TGA_OK) error = tga_to_surface(data, size, &s);
+    caml_leave_blocking_section();
+    free(data);
+    free(path);
+    if (error != TGA_OK) raise_tga(error);
+    CAMLreturn((value) s);
+}
+
+value sdldraw_load_tga_bytes(value vdata)
+{
+    CAMLparam1(vdata);
+    const Uint8 *data = (const Uint8 *)Data_bigarray_val(vdata);
+    size_t size = Bigarray_val(vdata)->dim[0];
+    SDL_Surface *s = NULL;
+    int error;
+
+    caml_enter_blocking_section();
+    error = tga_to_surface(data, size, &s);
+    caml_leave_blocking_section();
+    if (error != TGA_OK) raise_tga(error);
+    CAMLreturn((value) s);
+}
+
+/* [read_tga_rgba file -> (w, h, pixels)], rows from the top */
+value sdldraw_read_tga_rgba(value vpath)
+{
+    CAMLparam1(vpath);
+    CAMLlocal2(result, pixels);
+    char *path = copy_path(vpath);
+    Uint8 *data = NULL, *rgba = NULL;
+    size_t size = 0;
+    struct tga t;
+    int error;
+
+    caml_enter_blocking_section();
+    error = read_file(path, &data, &size);
+    if (error == TGA_OK) error = tga_header(data, size, &t);
+    if (error == TGA_OK) {
+        rgba = (Uint8 *)malloc((size_t)t.width * t.height * 4);
+        error = rgba == NULL ? TGA_NO_MEMORY : tga_decode(&t, tga_row_rgba, rgba, (size_t)t.width * 4);
+    }
+    caml_leave_blocking_section();
+    free(data);
+    free(path);
+    if (error != TGA_OK) {
+        free(rgba);
+        raise_tga(error);
+    }
+    pixels = alloc_bigarray_dims(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT | BIGARRAY_MANAGED, 1, rgba,
+                                 (long)t.width * t.height * 4);
+    result = alloc_tuple(3);
+    Store_field(result, 0, Val_int(t.width));
+    Store_field(result, 1, Val_int(t.height));
+    Store_field(result, 2, pixels);
+    CAMLreturn(result);
+}
+
+/* [read_tga file -> (w, h, bits, data, orientation)] with the pixels as
+   stored, after run-length decoding */
+value sdldraw_read_tga(value vpath)
+{
+    CAMLparam1(vpath);
+    CAMLlocal2(result, raw);
+    char *path = copy_path(vpath);
+    Uint8 *data = NULL, *pixels = NULL;
+    size_t size = 0, n = 0;
+    struct tga t;
+    int error;
+
+    caml_enter_blocking_section();
+    error = read_file(path, &data, &size);
+    if (error == TGA_OK) error = tga_header(data, size, &t);
+    if (error == TGA_OK) {
+        n = (size_t)t.width * t.height * t.bytes;
+        pixels = (Uint8 *)malloc(n);
+        error = pixels == NULL ? TGA_NO_MEMORY : tga_unpack(&t, pixels);
+    }
+    caml_leave_blocking_section();
+    free(data);
+    free(path);
+    if (error != TGA_OK) {
+        free(pixels);
+        raise_tga(error);
+    }
+    raw = alloc_string(n);
+    memcpy(String_val(raw), pixels, n);
+    free(pixels);
+    result = alloc_tuple(5);
+    Store_field(result, 0, Val_int(t.width));
+    Store_field(result, 1, Val_int(t.height));
+    Store_field(result, 2, Val_int(t.bits));
+    Store_field(result, 3, raw);
+    /* From_upper_left | From_lower_left */
+    Store_field(result, 4, Val_int(t.descriptor & 0x20 ? 0 : 1));
+    CAMLreturn(result);
+}
+
+/* Primitives: lines, anti-aliased lines, thick lines, rectangles,
+   ellipses and polygons, drawn with a pixel value of the surface format
+   and clipped to the surface's clip rectangle. A primitive, or a whole
+   batch of them, is drawn under one lock. */
+
+/* constructors of Draw.primitive */
+enum { LINE, AA_LINE, THICK_LINE, RECT, FILL_RECT, CIRCLE, FILL_CIRCLE, ELLIPSE, FILL_ELLIPSE,
+       POLYGON, FILL_POLYGON };
+
+#define MAX_RADIUS 32767
+
+struct canvas {
+    SDL_Surface *s;
+    int bpp;
+    int left, top, right, bottom;   /* clip rectangle, right and bottom excluded */
+};
+
+static void init_canvas(struct canvas *c, SDL_Surface *s)
+{
+    c->s = s;
+    c->bpp = s->format->BytesPerPixel;
+    c->left = s->clip_rect.x;
+    c->top = s->clip_rect.y;
+    c->right = s->clip_rect.x + s->clip_rect.w;
+    c->bottom = s->clip_rect.y + s->clip_rect.h;
+}
+
+static void plot(const struct canvas *c, int x, int y, Uint32 pixel)
+{
+    if (x >= c->left && x < c->right && y >= c->top && y < c->bottom)
+        write_pixel(pixel_address(c->s, x, y), c->bpp, pixel);
+}
+
+/* Pixels x0 to x1 of row y, in either order. */
+static void hspan(const struct canvas *c, int x0, int x1, int y, Uint32 pixel)
+{
+    int t;
+    if (y < c->top || y >= c->bottom) return;
+    if (x0 > x1) {
+        t = x0;
+        x0 = x1;
+        x1 = t;
+    }
+    if (x0 < c->left) x0 = c->left;
+    if (x1 >= c->right) x1 = c->right - 1;
+    if (x0 <= x1) fill_row(pixel_address(c->s, x0, y), c->bpp, pixel, x1 - x0 + 1);
+}
+
+/* Pixels y0 to y1 of column x; nothing when y1 < y0. */
+static void vspan(const struct canvas *c, int x, int y0, int y1, Uint32 pixel)
+{
+    int y;
+    for (y = y0 < c->top ? c->top : y0; y <= y1 && y < c->bottom; y++) plot(c, x, y, pixel);
+}
+
+/* Mixes [coverage] / 255 of the colour into the pixel at x, y. */
+static void blend(const struct canvas *c, int x, int y, Uint8 r, Uint8 g, Uint8 b, int coverage)
+{
+    Uint8 *p, dr, dg, db, da;
+    if (x < c->left || x >= c->right || y < c->top || y >= c->bottom || coverage <= 0) return;
+    p = pixel_address(c->s, x, y);
+    unmap_pixel(c->s->format, read_pixel(p, c->bpp), &dr, &dg, &db, &da);
+    dr = (Uint8)(dr + (r - dr) * coverage / 255);
+    dg = (Uint8)(dg + (g - dg) * coverage / 255);
+    db = (Uint8)(db + (b - db) * coverage / 255);
+    da = (Uint8)(da + (255 - da) * coverage / 255);
+    write_pixel(p, c->bpp, map_pixel(c->s->format, dr, dg, db, da));
+}
+
+/* Bresenham, stepping only over the part of the major axis inside the
+   clip rectangle; the error term at the first step is computed directly. */
+static void line(const struct canvas *c, int x0, int y0, int x1, int y1, Uint32 pixel)
+{
+    int steep = abs(y1 - y0) > abs(x1 - x0), lo, hi, start, end, x, y, sy, t;
+    long long adx, ady, num, err;
+
+    if (steep) {
+        t = x0; x0 = y0; y0 = t;
+        t = x1; x1 = y1; y1 = t;
+        lo = c->top;
+        hi = c->bottom;
+    } else {
+        lo = c->left;
+        hi = c->right;
+    }
+    if (x0 > x1) {
+        t = x0; x0 = x1; x1 = t;
+        t = y0; y0 = y1; y1 = t;
+    }
+    adx = (long long)x1 - x0;
+    ady = llabs((long long)y1 - y0);
+    sy = y1 < y0 ? -1 : 1;
+    start = x0 < lo ? lo : x0;
+    end = x1 >= hi ? hi - 1 : x1;
+    if (start > end) return;
+    if (adx == 0) {
+        plot(c, x0, y0, pixel);
+        return;
+    }
+    num = 2 * ady * (start - x0) + adx;
+    y = y0 + sy * (int)(num / (2 * adx));
+    err = num % (2 * adx);
+    for (x = start; x <= end; x++) {
+        if (steep) plot(c, y, x, pixel);
+        else plot(c, x, y, pixel);
+        err += 2 * ady;
+        if (err >= 2 * adx) {
+            err -= 2 * adx;
+            y += sy;
+        }
+    }
+}
+
+/* Xiaolin Wu's line: two pixels across the minor axis at each step, with
+   coverage split by the distance to the line. */
+static void aa_line(const struct canvas *c, int x0, int y0, int x1, int y1, Uint32 pixel)
+{
+    int steep = abs(y1 - y0) > abs(x1 - x0), lo, hi, start, end, x, iy, t;
+    double gradient, y, f;
+    Uint8 r, g, b, a;
+
+    unmap_pixel(c->s->format, pixel, &r, &g, &b, &a);
+    if (steep) {
+        t = x0; x0 = y0; y0 = t;
+        t = x1; x1 = y1; y1 = t;
+        lo = c->top;
+        hi = c->bottom;
+    } else {
+        lo = c->left;
+        hi = c->right;
+    }
+    if (x0 > x1) {
+        t = x0; x0 = x1; x1 = t;
+        t = y0; y0 = y1; y1 = t;
+    }
+    gradient = x1 == x0 ? 0.0 : (double)(y1 - y0) / (x1 - x0);
+    start = x0 < lo ? lo : x0;
+    end = x1 >= hi ? hi - 1 : x1;
+    for (x = start; x <= end; x++) {
+        y = y0 + gradient * (x - x0);
+        iy = (int)floor(y);
+        f = y - iy;
+        if (steep) {
+            blend(c, iy, x, r, g, b, (int)((1.0 - f) * 255 + 0.5));
+            blend(c, iy + 1, x, r, g, b, (int)(f * 255 + 0.5));
+        } else {
+            blend(c, x, iy, r, g, b, (int)((1.0 - f) * 255 + 0.5));
+            blend(c, x, iy + 1, r, g, b, (int)(f * 255 + 0.5));
+        }
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Even-odd scanline fill of the polygon [xy] (n points, x and y
+   interleaved), in the coordinates of pixel centres. Pixel x, y is filled
+   when the point x, y is inside or on a left or top edge, so adjacent
+   polygons sharing an edge do not overlap. Returns 0 when out of memory. */
+static int fill_polygon(const struct canvas *c, const double *xy, int n, Uint32 pixel)
+{
+    double ymin, ymax, *xs;
+    int i, j, k, y, y0, y1, crossings;
+
+    if (n < 3) return 1;
+    ymin = ymax = xy[1];
+    for (i = 1; i < n; i++) {
+        if (xy[2 * i + 1] < ymin) ymin = xy[2 * i + 1];
+        if (xy[2 * i + 1] > ymax) ymax = xy[2 * i + 1];
+    }
+    y0 = ymin < c->top ? c->top : (int)ceil(ymin);
+    y1 = ymax > c->bottom ? c->bottom : (int)ceil(ymax);
+    if (y0 >= y1) return 1;
+    xs = (double *)malloc(n * sizeof(double));
+    if (xs == NULL) return 0;
+    for (y = y0; y < y1; y++) {
+        crossings = 0;
+        for (i = 0, j = n - 1; i < n; j = i++) {
+            double ax = xy[2 * j], ay = xy[2 * j + 1], bx = xy[2 * i], by = xy[2 * i + 1];
+            if ((ay <= y && y < by) || (by <= y && y < ay))
+                xs[crossings++] = ax + (y - ay) * (bx - ax) / (by - ay);
+        }
+        qsort(xs, crossings, sizeof(double), compare_doubles);
+        for (k = 0; k + 1 < crossings; k += 2) {
+            double a = xs[k] < c->left ? c->left : xs[k];
+            double b = xs[k + 1] > c->right ? c->right : xs[k + 1];
+            if (a < b) hspan(c, (int)ceil(a), (int)ceil(b) - 1, y, pixel);
+        }
+    }
+    free(xs);
+    return 1;
+}
+
+/* A line [width] pixels wide is the rectangle around it, reaching half a
+   pixel past either end so both end pixels are covered as by line. */
+static int thick_line(const struct canvas *c, int x0, int y0, int x1, int y1, int width, Uint32 pixel)
+{
+    double dx = x1 - x0, dy = y1 - y0, len = sqrt(dx * dx + dy * dy), nx, ny, ex, ey, xy[8];
+
+    if (width <= 1) {
+        line(c, x0, y0, x1, y1, pixel);
+        return 1;
+    }
+    if (len == 0.0) {
+        dx = 1.0;
+        len = 1.0;
+    }
+    nx = -dy / len * width / 2;
+    ny = dx / len * width / 2;
+    ex = dx / len / 2;
+    ey = dy / len / 2;
+    xy[0] = x0 - ex + nx; xy[1] = y0 - ey + ny;
+    xy[2] = x1 + ex + nx; xy[3] = y1 + ey + ny;
+    xy[4] = x1 + ex - nx; xy[5] = y1 + ey - ny;
+    xy[6] = x0 - ex - nx; xy[7] = y0 - ey - ny;
+    return fill_polygon(c, xy, 4, pixel);
+}
+
+/* Midpoint ellipse, in units of a quarter pixel so the arithmetic stays
+   in integers; the four quadrants are plotted, or joined by spans. */
+static void ellipse(const struct canvas *c, int cx, int cy, int rx, int ry, int filled, Uint32 pixel)
+{
+    long long rx2 = (long long)rx * rx, ry2 = (long long)ry * ry, dx, dy, d;
+    int x = 0, y = ry;
+
+    if (rx < 0 || ry < 0) return;
+    if (ry == 0) {
+        hspan(c, cx - rx, cx + rx, cy, pixel);
+        return;
+    }
+    dx = 0;
+    dy = 2 * rx2 * y;
+    d = 4 * ry2 - 4 * rx2 * ry + rx2;
+    for (;;) {
+        if (filled) {
+            hspan(c, cx - x, cx + x, cy - y, pixel);
+            hspan(c, cx - x, cx + x, cy + y, pixel);
+        } else {
+            plot(c, cx + x, cy + y, pixel);
+            plot(c, cx - x, cy + y, pixel);
+            plot(c, cx + x, cy - y, pixel);
+            plot(c, cx - x, cy - y, pixel);
+        }
+        if (dx >= dy) break;
+        x++;
+        dx += 2 * ry2;
+        if (d < 0) {
+            d += 4 * (dx + ry2);
+        } else {
+            y--;
+            dy -= 2 * rx2;
+            d += 4 * (dx - dy + ry2);
+        }
+    }
+    d = ry2 * (2 * x + 1) * (2 * x + 1) + 4 * rx2 * (y - 1) * (y - 1) - 4 * rx2 * ry2;
+    while (y > 0) {
+        y--;
+        dy -= 2 * rx2;
+        if (d > 0) {
+            d += 4 * (rx2 - dy);
+        } else {
+            x++;
+            dx += 2 * ry2;
+            d += 4 * (dx - dy + rx2);
+        }
+        if (filled) {
+            hspan(c, cx - x, cx + x, cy - y, pixel);
+            hspan(c, cx - x, cx + x, cy + y, pixel);
+        } else {
+            plot(c, cx + x, cy + y, pixel);
+            plot(c, cx - x, cy + y, pixel);
+            plot(c, cx + x, cy - y, pixel);
+            plot(c, cx - x, cy - y, pixel);
+        }
+    }
+}
+
+/* Copies an (int * int) array into interleaved doubles. */
+static double *polygon_points(value vpoints, int *n)
+{
+    double *xy;
+    int i;
+    *n = Wosize_val(vpoints);
+    xy = (double *)malloc((*n > 0 ? *n : 1) * 2 * sizeof(double));
+    if (xy == NULL) return NULL;
+    for (i = 0; i < *n; i++) {
+        xy[2 * i] = Int_val(Field(Field(vpoints, i), 0));
+        xy[2 * i + 1] = Int_val(Field(Field(vpoints, i), 1));
+    }
+    return xy;
+}
+
+/* Marks the pixels a primitive can touch as dirty. */
+static void mark_primitive(const struct canvas *c, value vprim)
+{
+    int x0, y0, x1, y1, pad = 1, i, n;
+    value points;
+
+    if (Tag_val(vprim) >= POLYGON) {
+        points = Field(vprim, 0);
+        n = Wosize_val(points);
+        if (n == 0) return;
+        x0 = x1 = Int_val(Field(Field(points, 0), 0));
+        y0 = y1 = Int_val(Field(Field(points, 0), 1));
+        for (i = 1; i < n; i++) {
+            int x = Int_val(Field(Field(points, i), 0)), y = Int_val(Field(Field(points, i), 1));
+            if (x < x0) x0 = x;
+            if (x > x1) x1 = x;
+            if (y < y0) y0 = y;
+            if (y > y1) y1 = y;
+        }
+    } else if (Tag_val(vprim) >= CIRCLE) {
+        int rx = Int_val(Field(vprim, 2)), ry = Tag_val(vprim) >= ELLIPSE ? Int_val(Field(vprim, 3)) : rx;
+        x0 = Int_val(Field(vprim, 0)) - rx;
+        x1 = Int_val(Field(vprim, 0)) + rx;
+        y0 = Int_val(Field(vprim, 1)) - ry;
+        y1 = Int_val(Field(vprim, 1)) + ry;
+    } else if (Tag_val(vprim) >= RECT) {
+        sdl_mark_dirty(c->s, Int_val(Field(vprim, 0)), Int_val(Field(vprim, 1)), Int_val(Field(vprim, 2)),
+                       Int_val(Field(vprim, 3)));
+        return;
+    } else {
+        x0 = Int_val(Field(vprim, 0));
+        y0 = Int_val(Field(vprim, 1));
+        x1 = Int_val(Field(vprim, 2));
+        y1 = Int_val(Field(vprim, 3));
+        if (x0 > x1) { i = x0; x0 = x1; x1 = i; }
+        if (y0 > y1) { i = y0; y0 = y1; y1 = i; }
+        if (Tag_val(vprim) == THICK_LINE) pad += Int_val(Field(vprim, 4)) / 2 + 1;
+    }
+    sdl_mark_dirty(c->s, x0 - pad, y0 - pad, x1 - x0 + 2 * pad + 1, y1 - y0 + 2 * pad + 1);
+}
+
+/* Draws one primitive on a locked surface; returns 0 when out of memory
+   and -1 when the primitive is invalid. */
+static int draw_primitive(const struct canvas *c, value vprim, Uint32 pixel)
+{
+    int a[5], i, n, done = 1;
+    double *xy;
+
+    mark_primitive(c, vprim);
+    if (Tag_val(vprim) < POLYGON)
+        for (i = 0; i < 5 && i < (int)Wosize_val(vprim); i++) a[i] = Int_val(Field(vprim, i));
+    switch (Tag_val(vprim)) {
+    case LINE:
+        line(c, a[0], a[1], a[2], a[3], pixel);
+        break;
+    case AA_LINE:
+        aa_line(c, a[0], a[1], a[2], a[3], pixel);
+        break;
+    case THICK_LINE:
+        done = thick_line(c, a[0], a[1], a[2], a[3], a[4], pixel);
+        break;
+    case RECT:
+        if (a[2] <= 0 || a[3] <= 0) break;
+        hspan(c, a[0], a[0] + a[2] - 1, a[1], pixel);
+        hspan(c, a[0], a[0] + a[2] - 1, a[1] + a[3] - 1, pixel);
+        vspan(c, a[0], a[1] + 1, a[1] + a[3] - 2, pixel);
+        vspan(c, a[0] + a[2] - 1, a[1] + 1, a[1] + a[3] - 2, pixel);
+        break;
+    case FILL_RECT:
+        for (i = a[1] < c->top ? c->top : a[1]; i < a[1] + a[3] && i < c->bottom; i++)
+            if (a[2] > 0) hspan(c, a[0], a[0] + a[2] - 1, i, pixel);
+        break;
+    case CIRCLE:
+    case FILL_CIRCLE:
+        if (a[2] > MAX_RADIUS) return -1;
+        ellipse(c, a[0], a[1], a[2], a[2], Tag_val(vprim) == FILL_CIRCLE, pixel);
+        break;
+    case ELLIPSE:
+    case FILL_ELLIPSE:
+        if (a[2] > MAX_RADIUS || a[3] > MAX_RADIUS) return -1;
+        ellipse(c, a[0], a[1], a[2], a[3], Tag_val(vprim) == FILL_ELLIPSE, pixel);
+        break;
+    case POLYGON:
+        n = Wosize_val(Field(vprim, 0));
+        for (i = 0; i < n; i++) {
+            value p = Field(Field(vprim, 0), i), q = Field(Field(vprim, 0), (i + 1) % n);
+            line(c, Int_val(Field(p, 0)), Int_val(Field(p, 1)), Int_val(Field(q, 0)), Int_val(Field(q, 1)), pixel);
+        }
+        break;
+    default:
+        xy = polygon_points(Field(vprim, 0), &n);
+        if (xy == NULL) return 0;
+        done = fill_polygon(c, xy, n, pixel);
+        free(xy);
+        break;
+    }
+    return done;
+}
+
+/* [draw s primitive pixel] */
+value sdldraw_draw(value vs, value vprim, value vpixel)
+{
+    CAMLparam3(vs, vprim, vpixel);
+    struct canvas c;
+    int done;
+
+    init_canvas(&c, (SDL_Surface *) vs);
+    lock_surface(c.s);
+    done = draw_primitive(&c, vprim, (Uint32)Int32_val(vpixel));
+    unlock_surface(c.s);
+    if (done < 0) invalid_argument("Draw.draw");
+    if (done == 0) raise_out_of_memory();
+    CAMLreturn(Val_unit);
+}
+
+/* [draw_batch s primitives], an array of (primitive, pixel) pairs */
+value sdldraw_draw_batch(value vs, value vprims)
+{
+    CAMLparam2(vs, vprims);
+    struct canvas c;
+    int i, n = Wosize_val(vprims), done = 1;
+
+    init_canvas(&c, (SDL_Surface *) vs);
+    lock_surface(c.s);
+    for (i = 0; i < n && done > 0; i++)
+        done = draw_primitive(&c, Field(Field(vprims, i), 0), (Uint32)Int32_val(Field(Field(vprims, i), 1)));
+    unlock_surface(c.s);
+    if (done < 0) invalid_argument("Draw.draw_batch");
+    if (done == 0) raise_out_of_memory();
+    CAMLreturn(Val_unit);
+}
+
+/* Compositing: [src] drawn onto [dst] with a blend mode and a global
+   opacity, clipped to both surfaces. Colours are mixed as bytes with exact
+   rounding. Between 32 bit surfaces whose colour masks match, four pixels
+   go at a time; every other pair of formats is converted per pixel. */
+
+/* constructors of Draw.blend_mode */
+enum { BLEND_OVER, BLEND_ADD, BLEND_MULTIPLY, BLEND_PREMULTIPLIED };
+
+/* round(x / 255) for x up to 255 * 255 */
+static int div255(int x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/* One pixel, channels R, G, B, A in any order with alpha last. */
+static void blend_pixel(int mode, const Uint8 *s, Uint8 *d, int opacity)
+{
+    int a = div255(s[3] * opacity), i, x;
+    for (i = 0; i < 3; i++) {
+        switch (mode) {
+        case BLEND_ADD:
+            x = d[i] + div255(s[i] * a);
+            break;
+        case BLEND_MULTIPLY:
+            x = div255(div255(d[i] * s[i]) * a + d[i] * (255 - a));
+            break;
+        case BLEND_PREMULTIPLIED:
+            x = div255(s[i] * opacity) + div255(d[i] * (255 - a));
+            break;
+        default:
+            x = div255(s[i] * a + d[i] * (255 - a));
+            break;
+        }
+        d[i] = (Uint8)(x > 255 ? 255 : x);
+    }
+    if (mode == BLEND_PREMULTIPLIED) d[3] = (Uint8)(a + div255(d[3] * (255 - a)));
+    else d[3] = (Uint8)div255(255 * a + d[3] * (255 - a));
+}
+
+/* A 32 bit pixel value turned so that alpha is its top byte, and back;
+   the colours then sit in the three bytes below in the same order for
+   both surfaces. */
+static Uint32 rotate_right(Uint32 v, int n)
+{
+    return n == 0 ? v : v >> n | v << (32 - n);
+}
+
+static void composite_row_scalar(int mode, const Uint32 *src, Uint32 *dst, int n, int shift, Uint32 opaque, int opacity)
+{
+    int x, i, turn = (shift + 8) & 31;
+    Uint8 s[4], d[4];
+    for (x = 0; x < n; x++) {
+        Uint32 sv = rotate_right(src[x] | opaque, turn), dv = rotate_right(dst[x], turn);
+        for (i = 0; i < 4; i++) {
+            s[i] = (Uint8)(sv >> (8 * i));
+            d[i] = (Uint8)(dv >> (8 * i));
+        }
+        blend_pixel(mode, s, d, opacity);
+        dv = (Uint32)d[0] | (Uint32)d[1] << 8 | (Uint32)d[2] << 16 | (Uint32)d[3] << 24;
+        dst[x] = rotate_right(dv, (32 - turn) & 31);
+    }
+}
+
+#ifdef __SSE2__
+static __m128i div255_epi16(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/* Two pixels as 16 bit lanes, alpha in lanes 3 and 7. */
+static __m128i blend_epi16(int mode, __m128i s, __m128i d, __m128i opacity)
+{
+    const __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0), full = _mm_set1_epi16(255);
+    __m128i a = div255_epi16(_mm_mullo_epi16(_mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff), opacity));
+    __m128i inv = _mm_sub_epi16(full, a), x, over;
+
+    switch (mode) {
+    case BLEND_PREMULTIPLIED:
+        return _mm_add_epi16(div255_epi16(_mm_mullo_epi16(s, opacity)), div255_epi16(_mm_mullo_epi16(d, inv)));
+    case BLEND_MULTIPLY:
+        x = _mm_or_si128(_mm_andnot_si128(alpha_lanes, div255_epi16(_mm_mullo_epi16(d, s))), _mm_and_si128(alpha_lanes, full));
+        break;
+    default:
+        x = _mm_or_si128(s, _mm_and_si128(alpha_lanes, full));
+        break;
+    }
+    over = div255_epi16(_mm_add_epi16(_mm_mullo_epi16(x, a), _mm_mullo_epi16(d, inv)));
+    if (mode != BLEND_ADD) return over;
+    return _mm_or_si128(_mm_andnot_si128(alpha_lanes, _mm_add_epi16(d, div255_epi16(_mm_mullo_epi16(x, a)))),
+                        _mm_and_si128(alpha_lanes, over));
+}
+
+/* Four pixels at a time; returns how many were done. */
+static int composite_row_sse2(int mode, const Uint32 *src, Uint32 *dst, int n, int shift, Uint32 opaque, int opacity)
+{
+    const int turn = (shift + 8) & 31;
+    const __m128i zero = _mm_setzero_si128(), o = _mm_set1_epi16((short)opacity);
+    const __m128i right = _mm_cvtsi32_si128(turn), left = _mm_cvtsi32_si128(32 - turn);
+    const __m128i back_right = _mm_cvtsi32_si128((32 - turn) & 31), back_left = _mm_cvtsi32_si128(turn == 0 ? 32 : turn);
+    const __m128i set_opaque = _mm_set1_epi32((int)opaque);
+    int x;
+
+    for (x = 0; x + 4 <= n; x += 4) {
+        __m128i s = _mm_or_si128(_mm_loadu_si128((const __m128i *)(src + x)), set_opaque);
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + x)), lo, hi;
+        s = _mm_or_si128(_mm_srl_epi32(s, right), _mm_sll_epi32(s, left));
+        d = _mm_or_si128(_mm_srl_epi32(d, right), _mm_sll_epi32(d, left));
+        lo = blend_epi16(mode, _mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), o);
+        hi = blend_epi16(mode, _mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), o);
+        d = _mm_packus_epi16(lo, hi);
+        d = _mm_or_si128(_mm_srl_epi32(d, back_right), _mm_sll_epi32(d, back_left));
+        _mm_storeu_si128((__m128i *)(dst + x), d);
+    }
+    return x;
+}
+#endif
+
+static void composite_row_any(int mode, const SDL_PixelFormat *sf, const Uint8 *src, const SDL_PixelFormat *df,
+                              Uint8 *dst, int n, int opacity)
+{
+    int x, sbpp = sf->BytesPerPixel, dbpp = df->BytesPerPixel;
+    Uint8 s[4], d[4];
+    for (x = 0; x < n; x++, src += sbpp, dst += dbpp) {
+        unmap_pixel(sf, read_pixel(src, sbpp), &s[0], &s[1], &s[2], &s[3]);
+        unmap_pixel(df, read_pixel(dst, dbpp), &d[0], &d[1], &d[2], &d[3]);
+        blend_pixel(mode, s, d, opacity);
+        write_pixel(dst, dbpp, map_pixel(df, d[0], d[1], d[2], d[3]));
+    }
+}
+
+static int whole_byte(Uint32 mask)
+{
+    return mask == 0x000000ff || mask == 0x0000ff00 || mask == 0x00ff0000 || mask == 0xff000000;
+}
+
+/* The 32 bit path needs the colours in the same bytes of both surfaces,
+   each a whole byte, and alpha in the byte left over; a destination
+   without alpha gets it in its unused byte. Returns the shift of alpha,
+   or -1. */
+static int composite_shift(const SDL_PixelFormat *sf, const SDL_PixelFormat *df)
+{
+    Uint32 alpha = ~(sf->Rmask | sf->Gmask | sf->Bmask);
+    if (sf->BytesPerPixel != 4 || df->BytesPerPixel != 4 || sf->palette != NULL || df->palette != NULL) return -1;
+    if (sf->Rmask != df->Rmask || sf->Gmask != df->Gmask || sf->Bmask != df->Bmask) return -1;
+    if (!whole_byte(sf->Rmask) || !whole_byte(sf->Gmask) || !whole_byte(sf->Bmask) || !whole_byte(alpha)) return -1;
+    if ((sf->Amask != 0 && sf->Amask != alpha) || (df->Amask != 0 && df->Amask != alpha)) return -1;
+    return alpha == 0x000000ff ? 0 : alpha == 0x0000ff00 ? 8 : alpha == 0x00ff0000 ? 16 : 24;
+}
+
+struct composite {
+    int mode, opacity, shift;
+    Uint32 opaque;
+    SDL_Surface *src, *dst;
+    int sx, sy, dx, dy, w, h;
+};
+
+static void composite_rows(const struct composite *c)
+{
+    int y, done;
+    for (y = 0; y < c->h; y++) {
+        Uint8 *s = pixel_address(c->src, c->sx, c->sy + y), *d = pixel_address(c->dst, c->dx, c->dy + y);
+        if (c->shift < 0) {
+            composite_row_any(c->mode, c->src->format, s, c->dst->format, d, c->w, c->opacity);
+            continue;
+        }
+        done = 0;
+#ifdef __SSE2__
+        done = composite_row_sse2(c->mode, (const Uint32 *)s, (Uint32 *)d, c->w, c->shift, c->opaque, c->opacity);
+#endif
+        composite_row_scalar(c->mode, (const Uint32 *)s + done, (Uint32 *)d + done, c->w - done, c->shift,
+                             c->opaque, c->opacity);
+    }
+}
+
+/* [composite src srcrect dst x y mode opacity] */
+value sdldraw_composite(value vsrc, value vsrcrect, value vdst, value vx, value vy, value vmode, value vopacity)
+{
+    CAMLparam5(vsrc, vsrcrect, vdst, vx, vy);
+    CAMLxparam2(vmode, vopacity);
+    struct composite c;
+    SDL_Rect *clip;
+    int x, y, w, h, t;
+
+    c.src = (SDL_Surface *) vsrc;
+    c.dst = (SDL_Surface *) vdst;
+    c.mode = Int_val(vmode);
+    c.opacity = Int_val(vopacity) < 0 ? 0 : Int_val(vopacity) > 255 ? 255 : Int_val(vopacity);
+    if (c.src == c.dst) invalid_argument("Draw.composite");
+    if (Is_block(vsrcrect)) {
+        value r = Field(vsrcrect, 0);
+        x = Int_val(Field(r, 0));
+        y = Int_val(Field(r, 1));
+        w = Int_val(Field(r, 2));
+        h = Int_val(Field(r, 3));
+    } else {
+        x = y = 0;
+        w = c.src->w;
+        h = c.src->h;
+    }
+    c.dx = Int_val(vx);
+    c.dy = Int_val(vy);
+    /* clip to the source, then to the destination's clip rectangle */
+    if (x < 0) { w += x; c.dx -= x; x = 0; }
+    if (y < 0) { h += y; c.dy -= y; y = 0; }
+    if (w > c.src->w - x) w = c.src->w - x;
+    if (h > c.src->h - y) h = c.src->h - y;
+    clip = &c.dst->clip_rect;
+    if ((t = clip->x - c.dx) > 0) { x += t; w -= t; c.dx = clip->x; }
+    if ((t = clip->y - c.dy) > 0) { y += t; h -= t; c.dy = clip->y; }
+    if (w > clip->x + clip->w - c.dx) w = clip->x + clip->w - c.dx;
+    if (h > clip->y + clip->h - c.dy) h = clip->y + clip->h - c.dy;
+    if (w <= 0 || h <= 0) CAMLreturn(Val_unit);
+    c.sx = x;
+    c.sy = y;
+    c.w = w;
+    c.h = h;
+    c.shift = composite_shift(c.src->format, c.dst->format);
+    c.opaque = c.src->format->Amask == 0 && c.shift >= 0 ? (Uint32)0xff << c.shift : 0;
+
+    lock_surface(c.src);
+    if (SDL_MUSTLOCK(c.dst) && SDL_LockSurface(c.dst) < 0) {
+        unlock_surface(c.src);
+        raise_failure();
+    }
+    caml_enter_blocking_section();
+    composite_rows(&c);
+    caml_leave_blocking_section();
+    unlock_surface(c.dst);
+    unlock_surface(c.src);
+    sdl_mark_dirty(c.dst, c.dx, c.dy, c.w, c.h);
+    CAMLreturn(Val_unit);
+}
+
+value sdldraw_composite_byte(value *argv, __attribute__((unused)) int n)
+{
+    return sdldraw_composite(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+}
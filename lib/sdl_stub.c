@@ -23,9 +23,12 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <math.h>
 #include <SDL/SDL.h>
+#include <SDL/SDL_opengl.h>
 
 
 /*  CAML - C interface */
@@ -37,6 +40,17 @@
 #include <caml/signals.h>
 #include <caml/bigarray.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "present_stats.h"
+#include "frame_pacer.h"
+#include "dirty_rects.h"
+
 
 /*  Caml list manipulations */
 #define NIL_tag 0
@@ -251,44 +265,293 @@ value sdlstub_save_bmp(value s, value vfile) {
     CAMLreturn (Val_unit);
 }
 
-/* Code by Jeff Molofee's openGL tutorial */
+/* Surfaces for OpenGL: the pixels of a 24 or 32 bit surface are rewritten
+   as R, G, B(, A) bytes, optionally with the colours multiplied by alpha
+   and with the rows in bottom-up order, in one pass over the pixels. */
+
+struct gl_swizzle {
+    int bytes;          /* 3 or 4 */
+    int shift[4];       /* of R, G, B, A in a 32 bit pixel; A is -1 if absent */
+    int index[3];       /* byte offsets of R, G, B in a 24 bit pixel */
+    int premultiply;
+};
+
+/* Only formats with every channel in a whole byte qualify. */
+static int gl_swizzle_of(const SDL_PixelFormat *f, int premultiply, struct gl_swizzle *z)
+{
+    Uint32 masks[4];
+    int shifts[4], c;
+
+    masks[0] = f->Rmask; masks[1] = f->Gmask; masks[2] = f->Bmask; masks[3] = f->Amask;
+    shifts[0] = f->Rshift; shifts[1] = f->Gshift; shifts[2] = f->Bshift; shifts[3] = f->Ashift;
+    if (f->BytesPerPixel != 3 && f->BytesPerPixel != 4) return 0;
+    if (f->BytesPerPixel == 3 && f->Amask != 0) return 0;
+    z->bytes = f->BytesPerPixel;
+    for (c = 0; c < 4; c++) {
+        if (c == 3 && masks[3] == 0) {
+            z->shift[3] = -1;
+            continue;
+        }
+        if (shifts[c] % 8 != 0 || shifts[c] >= 8 * z->bytes || masks[c] != (Uint32)0xff << shifts[c]) return 0;
+        z->shift[c] = shifts[c];
+        if (c < 3) {
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+            z->index[c] = z->bytes - 1 - shifts[c] / 8;
+#else
+            z->index[c] = shifts[c] / 8;
+#endif
+        }
+    }
+    z->premultiply = premultiply && z->shift[3] >= 0;
+    return 1;
+}
+
+/* round(c * a / 255) */
+static Uint8 gl_mul255(int c, int a)
+{
+    int t = c * a + 128;
+    return (Uint8)((t + (t >> 8)) >> 8);
+}
+
+static void gl_row_scalar(const struct gl_swizzle *z, const Uint8 *in, Uint8 *out, int n)
+{
+    int x;
+    Uint32 p;
+    Uint8 r, g, b, a;
+
+    for (x = 0; x < n; x++, in += z->bytes, out += z->bytes) {
+        if (z->bytes == 3) {
+            r = in[z->index[0]];
+            g = in[z->index[1]];
+            b = in[z->index[2]];
+            out[0] = r;
+            out[1] = g;
+            out[2] = b;
+            continue;
+        }
+        memcpy(&p, in, 4);
+        r = (Uint8)(p >> z->shift[0]);
+        g = (Uint8)(p >> z->shift[1]);
+        b = (Uint8)(p >> z->shift[2]);
+        a = z->shift[3] < 0 ? 255 : (Uint8)(p >> z->shift[3]);
+        if (z->premultiply) {
+            r = gl_mul255(r, a);
+            g = gl_mul255(g, a);
+            b = gl_mul255(b, a);
+        }
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+        out[3] = a;
+    }
+}
+
+#ifdef __SSE2__
+/* Four 32 bit pixels at a time; returns how many pixels were done. */
+static int gl_row_sse2(const struct gl_swizzle *z, const Uint8 *in, Uint8 *out, int n)
+{
+    const __m128i byte = _mm_set1_epi32(0xff), zero = _mm_setzero_si128();
+    const __m128i rs = _mm_cvtsi32_si128(z->shift[0]), gs = _mm_cvtsi32_si128(z->shift[1]);
+    const __m128i bs = _mm_cvtsi32_si128(z->shift[2]), as = _mm_cvtsi32_si128(z->shift[3] < 0 ? 0 : z->shift[3]);
+    const __m128i colours = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i keep_alpha = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0), half = _mm_set1_epi16(128);
+    int x;
+
+    for (x = 0; x + 4 <= n; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(in + x * 4));
+        __m128i q = _mm_and_si128(_mm_srl_epi32(p, rs), byte);
+        q = _mm_or_si128(q, _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(p, gs), byte), 8));
+        q = _mm_or_si128(q, _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(p, bs), byte), 16));
+        if (z->shift[3] < 0) q = _mm_or_si128(q, _mm_set1_epi32((int)0xff000000));
+        else q = _mm_or_si128(q, _mm_slli_epi32(_mm_srl_epi32(p, as), 24));
+        if (z->premultiply) {
+            __m128i lo = _mm_unpacklo_epi8(q, zero), hi = _mm_unpackhi_epi8(q, zero);
+            __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff);
+            __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff);
+            /* alpha itself is multiplied by 255 */
+            alo = _mm_or_si128(_mm_and_si128(alo, colours), keep_alpha);
+            ahi = _mm_or_si128(_mm_and_si128(ahi, colours), keep_alpha);
+            lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), half);
+            hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), half);
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+            q = _mm_packus_epi16(lo, hi);
+        }
+        _mm_storeu_si128((__m128i *)(out + x * 4), q);
+    }
+    return x;
+}
+#endif
+
+#ifdef __SSSE3__
+/* Five 24 bit pixels per shuffle; the sixteenth byte is stored unchanged
+   and rewritten by the next step or the scalar tail. */
+static int gl_row_ssse3(const struct gl_swizzle *z, const Uint8 *in, Uint8 *out, int n)
+{
+    char order[16];
+    __m128i shuffle;
+    int i, x;
+
+    for (i = 0; i < 15; i++) order[i] = (char)(i - i % 3 + z->index[i % 3]);
+    order[15] = 15;
+    shuffle = _mm_loadu_si128((const __m128i *)order);
+    for (x = 0; (x + 5) * 3 + 1 <= n * 3; x += 5) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(in + x * 3));
+        _mm_storeu_si128((__m128i *)(out + x * 3), _mm_shuffle_epi8(p, shuffle));
+    }
+    return x;
+}
+#endif
+
+/* [in] and [out] are the same row or do not overlap. */
+static void gl_row(const struct gl_swizzle *z, const Uint8 *in, Uint8 *out, int n)
+{
+    int x = 0;
+#ifdef __SSE2__
+    if (z->bytes == 4) x = gl_row_sse2(z, in, out, n);
+#endif
+#ifdef __SSSE3__
+    if (z->bytes == 3) x = gl_row_ssse3(z, in, out, n);
+#endif
+    gl_row_scalar(z, in + x * z->bytes, out + x * z->bytes, n - x);
+}
+
+/* Rewrites the pixels into [out], rows [out_pitch] bytes apart, or in
+   place when [out] is NULL. Returns 0 when out of memory. */
+static int gl_prepare(SDL_Surface *s, const struct gl_swizzle *z, int flip, Uint8 *out, int out_pitch)
+{
+    Uint8 *pixels = (Uint8 *)s->pixels, *tmp;
+    int y, h = s->h;
+
+    if (out != NULL) {
+        for (y = 0; y < h; y++)
+            gl_row(z, pixels + (flip ? h - 1 - y : y) * s->pitch, out + y * out_pitch, s->w);
+        return 1;
+    }
+    if (!flip) {
+        for (y = 0; y < h; y++) gl_row(z, pixels + y * s->pitch, pixels + y * s->pitch, s->w);
+        return 1;
+    }
+    tmp = (Uint8 *)malloc(s->w * z->bytes);
+    if (tmp == NULL) return 0;
+    for (y = 0; y < h / 2; y++) {
+        Uint8 *hi = pixels + y * s->pitch, *lo = pixels + (h - 1 - y) * s->pitch;
+        gl_row(z, hi, tmp, s->w);
+        gl_row(z, lo, hi, s->w);
+        memcpy(lo, tmp, s->w * z->bytes);
+    }
+    if (h & 1) gl_row(z, pixels + (h / 2) * s->pitch, pixels + (h / 2) * s->pitch, s->w);
+    free(tmp);
+    return 1;
+}
+
+/* After an in place rewrite the masks describe R, G, B(, A) bytes. */
+static void gl_set_byte_order(SDL_PixelFormat *f)
+{
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    int last = 8 * (f->BytesPerPixel - 1);
+    f->Rshift = (Uint8)last;
+    f->Gshift = (Uint8)(last - 8);
+    f->Bshift = (Uint8)(last - 16);
+    f->Ashift = 0;
+#else
+    f->Rshift = 0;
+    f->Gshift = 8;
+    f->Bshift = 16;
+    f->Ashift = 24;
+#endif
+    f->Rmask = (Uint32)0xff << f->Rshift;
+    f->Gmask = (Uint32)0xff << f->Gshift;
+    f->Bmask = (Uint32)0xff << f->Bshift;
+    if (f->Amask != 0) f->Amask = (Uint32)0xff << f->Ashift;
+}
+
+/* SDL caches a blit converter for each pair of surfaces and does not
+   notice a format changed in place. Toggling the alpha flag drops the
+   surface's own converter and a new format_version those of surfaces
+   blitting into it. */
+static void gl_format_changed(SDL_Surface *s)
+{
+    Uint32 flags = (s->flags & SDL_SRCALPHA) | (s->flags & SDL_RLEACCELOK ? SDL_RLEACCEL : 0);
+    Uint8 alpha = s->format->alpha;
+
+    SDL_SetAlpha(s, flags ^ SDL_SRCALPHA, alpha);
+    SDL_SetAlpha(s, flags, alpha);
+    s->format_version++;
+}
+
+static void prepare_surface(SDL_Surface *s, int premultiply, int flip, Uint8 *out, const char *name)
+{
+    struct gl_swizzle z;
+    int done;
+
+    if (!gl_swizzle_of(s->format, premultiply, &z)) invalid_argument(name);
+    if (SDL_MUSTLOCK(s) && SDL_LockSurface(s) < 0) raise_failure();
+    caml_enter_blocking_section();
+    done = gl_prepare(s, &z, flip, out, s->w * z.bytes);
+    caml_leave_blocking_section();
+    if (SDL_MUSTLOCK(s)) SDL_UnlockSurface(s);
+    if (!done) raise_out_of_memory();
+    if (out == NULL) {
+        gl_set_byte_order(s->format);
+        gl_format_changed(s);
+    }
+}
+
+value sdlstub_GL_prepare_surface(value s, value vpremultiply, value vflip)
+{
+    CAMLparam3(s, vpremultiply, vflip);
+    prepare_surface((SDL_Surface *) s, Bool_val(vpremultiply), Bool_val(vflip), NULL, "GL.prepare_surface");
+    CAMLreturn(Val_unit);
+}
+
+value sdlstub_GL_prepare_surface_into(value s, value vpremultiply, value vflip, value vdst)
+{
+    CAMLparam4(s, vpremultiply, vflip, vdst);
+    SDL_Surface *surf = (SDL_Surface *) s;
+
+    if (Bigarray_val(vdst)->dim[0] < (long)surf->w * surf->h * surf->format->BytesPerPixel)
+        invalid_argument("GL.prepare_surface_into");
+    prepare_surface(surf, Bool_val(vpremultiply), Bool_val(vflip), (Uint8 *)Data_bigarray_val(vdst),
+                    "GL.prepare_surface_into");
+    CAMLreturn(Val_unit);
+}
+
+/* Code by Jeff Molofee's openGL tutorial;
+   bitmaps of other depths are converted to 24 bits first. */
 static SDL_Surface * GLLoadBMP(char *filename)
 {
-    Uint8 *rowhi, *rowlo;
-    Uint8 *tmpbuf, tmpch;
-    SDL_Surface *image;
-    int i, j;
+    SDL_Surface *image, *rgb;
+    struct gl_swizzle z;
 
     image = SDL_LoadBMP(filename);
     if (image == NULL) {
         fprintf(stderr, "Unable to load %s: %s\n", filename, SDL_GetError());
         raise_failure();
     }
+    if (!gl_swizzle_of(image->format, 0, &z)) {
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        rgb = SDL_CreateRGBSurface(SDL_SWSURFACE, image->w, image->h, 24, 0xff0000, 0x00ff00, 0x0000ff, 0);
+#else
+        rgb = SDL_CreateRGBSurface(SDL_SWSURFACE, image->w, image->h, 24, 0x0000ff, 0x00ff00, 0xff0000, 0);
+#endif
+        if (rgb == NULL || SDL_BlitSurface(image, NULL, rgb, NULL) < 0) {
+            SDL_FreeSurface(image);
+            if (rgb != NULL) SDL_FreeSurface(rgb);
+            raise_failure();
+        }
+        SDL_FreeSurface(image);
+        image = rgb;
+        gl_swizzle_of(image->format, 0, &z);
+    }
 
     /* GL surfaces are upsidedown and RGB, not BGR :-) */
-    tmpbuf = (Uint8 *)malloc(image->pitch);
-    if (tmpbuf == NULL) {
+    if (!gl_prepare(image, &z, 1, NULL, 0)) {
+        SDL_FreeSurface(image);
         fprintf(stderr, "Out of memory\n");
-        raise_failure();
-    }
-    rowhi = (Uint8 *)image->pixels;
-    rowlo = rowhi + (image->h * image->pitch) - image->pitch;
-    for ( i=0; i<image->h/2; ++i ) {
-        for ( j=0; j<image->w; ++j ) {
-            tmpch = rowhi[j*3];
-            rowhi[j*3] = rowhi[j*3+2];
-            rowhi[j*3+2] = tmpch;
-            tmpch = rowlo[j*3];
-            rowlo[j*3] = rowlo[j*3+2];
-            rowlo[j*3+2] = tmpch;
-        }
-        memcpy(tmpbuf, rowhi, image->pitch);
-        memcpy(rowhi, rowlo, image->pitch);
-        memcpy(rowlo, tmpbuf, image->pitch);
-        rowhi += image->pitch;
-        rowlo -= image->pitch;
+        raise_out_of_memory();
     }
-    free(tmpbuf);
+    gl_set_byte_order(image->format);
     return(image);
 }
 
@@ -297,13 +560,234 @@ value sdlstub_GL_load_bmp(value f) {
     CAMLreturn ((value)GLLoadBMP(String_val(f)));
 }
 
+/* Uploading surfaces as textures. The GL entry points are looked up
+   through SDL_GL_GetProcAddress, so this library does not link against
+   OpenGL; a context must be current. The pixels go to glTexImage2D
+   straight from surface memory, with the unpack row length and alignment
+   set from the pitch and restored afterwards. */
+
+typedef void (APIENTRY *tex_image_2d_fn)(GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum, const GLvoid *);
+typedef void (APIENTRY *tex_sub_image_2d_fn)(GLenum, GLint, GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, const GLvoid *);
+typedef void (APIENTRY *pixel_store_fn)(GLenum, GLint);
+typedef void (APIENTRY *get_integer_fn)(GLenum, GLint *);
+typedef void (APIENTRY *tex_parameter_fn)(GLenum, GLenum, GLint);
+typedef void (APIENTRY *generate_mipmap_fn)(GLenum);
+typedef const GLubyte *(APIENTRY *get_string_fn)(GLenum);
+
+static struct {
+    int loaded;
+    tex_image_2d_fn tex_image_2d;
+    tex_sub_image_2d_fn tex_sub_image_2d;
+    pixel_store_fn pixel_store;
+    get_integer_fn get_integer;
+    tex_parameter_fn tex_parameter;
+    generate_mipmap_fn generate_mipmap;     /* GL 3.0 or EXT_framebuffer_object, may be NULL */
+} gl;
+
+static int gl_has_extension(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = list;
+    while (p != NULL && (p = strstr(p, name)) != NULL) {
+        if ((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) return 1;
+        p += len;
+    }
+    return 0;
+}
+
+/* With GLX the address of any gl* name comes back whether or not the
+   context implements it, so glGenerateMipmap is only taken when the
+   version or the extensions promise it. */
+static generate_mipmap_fn load_generate_mipmap(get_string_fn get_string)
+{
+    const char *version = (const char *) get_string(GL_VERSION);
+    const char *extensions;
+
+    while (version != NULL && *version != '\0' && (*version < '0' || *version > '9')) version++;
+    if (version != NULL && atoi(version) >= 3)
+        return (generate_mipmap_fn) SDL_GL_GetProcAddress("glGenerateMipmap");
+    extensions = (const char *) get_string(GL_EXTENSIONS);
+    if (gl_has_extension(extensions, "GL_ARB_framebuffer_object"))
+        return (generate_mipmap_fn) SDL_GL_GetProcAddress("glGenerateMipmap");
+    if (gl_has_extension(extensions, "GL_EXT_framebuffer_object"))
+        return (generate_mipmap_fn) SDL_GL_GetProcAddress("glGenerateMipmapEXT");
+    return NULL;
+}
+
+static void load_gl(void)
+{
+    get_string_fn get_string;
+
+    if (gl.loaded) return;
+    gl.tex_image_2d = (tex_image_2d_fn) SDL_GL_GetProcAddress("glTexImage2D");
+    gl.tex_sub_image_2d = (tex_sub_image_2d_fn) SDL_GL_GetProcAddress("glTexSubImage2D");
+    gl.pixel_store = (pixel_store_fn) SDL_GL_GetProcAddress("glPixelStorei");
+    gl.get_integer = (get_integer_fn) SDL_GL_GetProcAddress("glGetIntegerv");
+    gl.tex_parameter = (tex_parameter_fn) SDL_GL_GetProcAddress("glTexParameteri");
+    get_string = (get_string_fn) SDL_GL_GetProcAddress("glGetString");
+    if (gl.tex_image_2d == NULL || gl.tex_sub_image_2d == NULL || gl.pixel_store == NULL
+        || gl.get_integer == NULL || gl.tex_parameter == NULL || get_string == NULL) {
+        SDL_SetError("OpenGL is not loaded");
+        raise_failure();
+    }
+    gl.generate_mipmap = load_generate_mipmap(get_string);
+    gl.loaded = 1;
+}
+
+/* Masks are those of the pixel value, as SDL gives them, so the packed
+   types are right on either byte order. Without an alpha mask in the
+   surface the alpha bits of the type are ignored. */
+struct gl_texture_format {
+    int bytes;
+    Uint32 r, g, b, a;
+    GLenum format, type;
+    GLint internal, internal_alpha;
+};
+
+static const struct gl_texture_format gl_texture_formats[] = {
+    { 4, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV, GL_RGB8, GL_RGBA8 },
+    { 4, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, GL_RGB8, GL_RGBA8 },
+    { 4, 0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8, GL_RGB8, GL_RGBA8 },
+    { 4, 0x0000ff00, 0x00ff0000, 0xff000000, 0x000000ff, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8, GL_RGB8, GL_RGBA8 },
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    { 3, 0xff0000, 0x00ff00, 0x0000ff, 0, GL_RGB, GL_UNSIGNED_BYTE, GL_RGB8, GL_RGB8 },
+    { 3, 0x0000ff, 0x00ff00, 0xff0000, 0, GL_BGR, GL_UNSIGNED_BYTE, GL_RGB8, GL_RGB8 },
+#else
+    { 3, 0x0000ff, 0x00ff00, 0xff0000, 0, GL_RGB, GL_UNSIGNED_BYTE, GL_RGB8, GL_RGB8 },
+    { 3, 0xff0000, 0x00ff00, 0x0000ff, 0, GL_BGR, GL_UNSIGNED_BYTE, GL_RGB8, GL_RGB8 },
+#endif
+    { 2, 0xf800, 0x07e0, 0x001f, 0, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, GL_RGB5, GL_RGB5 },
+    { 2, 0x001f, 0x07e0, 0xf800, 0, GL_RGB, GL_UNSIGNED_SHORT_5_6_5_REV, GL_RGB5, GL_RGB5 },
+    { 2, 0x7c00, 0x03e0, 0x001f, 0x8000, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, GL_RGB5, GL_RGB5_A1 },
+    { 2, 0xf800, 0x07c0, 0x003e, 0x0001, GL_RGBA, GL_UNSIGNED_SHORT_5_5_5_1, GL_RGB5, GL_RGB5_A1 },
+    { 2, 0x0f00, 0x00f0, 0x000f, 0xf000, GL_BGRA, GL_UNSIGNED_SHORT_4_4_4_4_REV, GL_RGB4, GL_RGBA4 },
+    { 2, 0xf000, 0x0f00, 0x00f0, 0x000f, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, GL_RGB4, GL_RGBA4 },
+};
+
+static const struct gl_texture_format *gl_texture_format_of(const SDL_PixelFormat *f)
+{
+    unsigned i;
+    for (i = 0; i < sizeof(gl_texture_formats) / sizeof(gl_texture_formats[0]); i++) {
+        const struct gl_texture_format *t = &gl_texture_formats[i];
+        if (t->bytes == f->BytesPerPixel && t->r == f->Rmask && t->g == f->Gmask && t->b == f->Bmask
+            && (f->Amask == 0 || f->Amask == t->a))
+            return t;
+    }
+    return NULL;
+}
+
+/* Palettized surfaces and unusual masks are uploaded through an RGBA copy. */
+static SDL_Surface *rgba_copy(SDL_Surface *s)
+{
+    SDL_Surface *c;
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    c = SDL_CreateRGBSurface(SDL_SWSURFACE, s->w, s->h, 32, 0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff);
+#else
+    c = SDL_CreateRGBSurface(SDL_SWSURFACE, s->w, s->h, 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
+#endif
+    if (c == NULL) raise_failure();
+    if (SDL_BlitSurface(s, NULL, c, NULL) < 0) {
+        SDL_FreeSurface(c);
+        raise_failure();
+    }
+    return c;
+}
+
+/* Largest of 8, 4, 2 and 1 dividing the pitch; with that alignment
+   the rows of [row_length] pixels land [pitch] bytes apart whenever the
+   padding is smaller than it, which holds for every SDL surface. */
+static int unpack_alignment(int pitch)
+{
+    int a = 8;
+    while (pitch % a != 0) a /= 2;
+    return a;
+}
+
+static void upload_texture(SDL_Surface *s, GLenum target, GLint level, int mipmaps)
+{
+    const struct gl_texture_format *t;
+    SDL_Surface *copy = NULL;
+    GLint saved[4];
+    int bpp, row_length, alignment, y;
+
+    load_gl();
+    t = gl_texture_format_of(s->format);
+    if (t == NULL) {
+        copy = s = rgba_copy(s);
+        t = gl_texture_format_of(s->format);
+    }
+    if (SDL_MUSTLOCK(s) && SDL_LockSurface(s) < 0) {
+        if (copy != NULL) SDL_FreeSurface(copy);
+        raise_failure();
+    }
+    bpp = t->bytes;
+    row_length = s->pitch / bpp;
+    alignment = unpack_alignment(s->pitch);
+
+    gl.get_integer(GL_UNPACK_ALIGNMENT, &saved[0]);
+    gl.get_integer(GL_UNPACK_ROW_LENGTH, &saved[1]);
+    gl.get_integer(GL_UNPACK_SKIP_ROWS, &saved[2]);
+    gl.get_integer(GL_UNPACK_SKIP_PIXELS, &saved[3]);
+    gl.pixel_store(GL_UNPACK_SKIP_ROWS, 0);
+    gl.pixel_store(GL_UNPACK_SKIP_PIXELS, 0);
+    if (mipmaps && gl.generate_mipmap == NULL) gl.tex_parameter(target, GL_GENERATE_MIPMAP, GL_TRUE);
+    if (s->pitch - row_length * bpp < alignment) {
+        gl.pixel_store(GL_UNPACK_ALIGNMENT, alignment);
+        gl.pixel_store(GL_UNPACK_ROW_LENGTH, row_length);
+        gl.tex_image_2d(target, level, s->format->Amask != 0 ? t->internal_alpha : t->internal,
+                        s->w, s->h, 0, t->format, t->type, s->pixels);
+    } else {
+        /* a pitch GL cannot describe: one row at a time */
+        gl.pixel_store(GL_UNPACK_ALIGNMENT, 1);
+        gl.pixel_store(GL_UNPACK_ROW_LENGTH, 0);
+        gl.tex_image_2d(target, level, s->format->Amask != 0 ? t->internal_alpha : t->internal,
+                        s->w, s->h, 0, t->format, t->type, NULL);
+        for (y = 0; y < s->h; y++)
+            gl.tex_sub_image_2d(target, level, 0, y, s->w, 1, t->format, t->type, (Uint8 *)s->pixels + y * s->pitch);
+    }
+    if (mipmaps && gl.generate_mipmap != NULL) gl.generate_mipmap(target);
+    gl.pixel_store(GL_UNPACK_ALIGNMENT, saved[0]);
+    gl.pixel_store(GL_UNPACK_ROW_LENGTH, saved[1]);
+    gl.pixel_store(GL_UNPACK_SKIP_ROWS, saved[2]);
+    gl.pixel_store(GL_UNPACK_SKIP_PIXELS, saved[3]);
+
+    if (SDL_MUSTLOCK(s)) SDL_UnlockSurface(s);
+    if (copy != NULL) SDL_FreeSurface(copy);
+}
+
+value sdlstub_GL_upload_surface(value s, value vtarget, value vlevel, value vmipmaps)
+{
+    CAMLparam4(s, vtarget, vlevel, vmipmaps);
+    upload_texture((SDL_Surface *) s, Int_val(vtarget), Int_val(vlevel), Bool_val(vmipmaps));
+    CAMLreturn(Val_unit);
+}
+
+/* [texture_format surface -> internal_format * format * type], or raises
+   Not_found when upload_surface would convert the surface first */
+value sdlstub_GL_texture_format(value s)
+{
+    CAMLparam1(s);
+    CAMLlocal1(result);
+    SDL_Surface *surf = (SDL_Surface *) s;
+    const struct gl_texture_format *t = gl_texture_format_of(surf->format);
+
+    if (t == NULL) raise_not_found();
+    result = alloc_tuple(3);
+    Store_field(result, 0, Val_int(surf->format->Amask != 0 ? t->internal_alpha : t->internal));
+    Store_field(result, 1, Val_int(t->format));
+    Store_field(result, 2, Val_int(t->type));
+    CAMLreturn(result);
+}
+
 value sdlstub_string_of_pixels(value s) {
     CAMLparam1(s);
     CAMLlocal1(v);
     SDL_Surface * surf = (SDL_Surface *) s;
-    int n = surf->w * surf->h * surf->format->BytesPerPixel;
-    v = alloc_string(n);
-    memcpy(String_val(v), surf->pixels, n);
+    int row = surf->w * surf->format->BytesPerPixel, y;
+    v = alloc_string(row * surf->h);
+    /* rows packed, without the padding at the end of each scanline */
+    for (y = 0; y < surf->h; y++)
+        memcpy(String_val(v) + y * row, (Uint8 *)surf->pixels + y * surf->pitch, row);
     CAMLreturn(v);
 }
 
@@ -436,7 +920,62 @@ value sdlstub_unlock_surface(value s) {
 value sdlstub_surface_pixels(value ps) {
     CAMLparam1(ps);
     SDL_Surface *s = ((SDL_Surface*) ps);
-    CAMLreturn (alloc_bigarray_dims(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT, 1, s->pixels, s->w * s->h * (s->format->BitsPerPixel/8)));
+    CAMLreturn (alloc_bigarray_dims(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT, 1, s->pixels, s->h * s->pitch));
+}
+
+value sdlstub_surface_pitch(value s) {
+    CAMLparam1(s);
+    CAMLreturn (Val_int(((SDL_Surface*) s)->pitch));
+}
+
+/* Views of the pixel memory, one row per scanline and pitch / size
+   elements per row, so padding is part of each row and never shifts the
+   rows below. Each view takes a reference on the surface; sdl.ml gives it
+   back through free_surface when the view is collected. The display
+   surface is the exception: SDL frees it with the video mode whatever its
+   reference count, so its views take none. */
+static value surface_view(value ps, int kind, int size, int channels, const char *name)
+{
+    CAMLparam1(ps);
+    CAMLlocal1(v);
+    SDL_Surface *s = (SDL_Surface*) ps;
+    long dims[3];
+
+    if (s->pixels == NULL || s->pitch % size != 0) invalid_argument(name);
+    if (channels > 0 && (s->format->BytesPerPixel != channels || s->pitch % channels != 0)) invalid_argument(name);
+    if (channels == 0 && size > 1 && s->format->BytesPerPixel != size) invalid_argument(name);
+    dims[0] = s->h;
+    if (channels > 0) {
+        dims[1] = s->pitch / channels;
+        dims[2] = channels;
+        v = alloc_bigarray(kind | BIGARRAY_C_LAYOUT, 3, s->pixels, dims);
+    } else {
+        dims[1] = s->pitch / size;
+        v = alloc_bigarray(kind | BIGARRAY_C_LAYOUT, 2, s->pixels, dims);
+    }
+    if (s != SDL_GetVideoSurface()) s->refcount++;
+    CAMLreturn(v);
+}
+
+value sdlstub_is_video_surface(value s) {
+    CAMLparam1(s);
+    CAMLreturn (Val_bool((SDL_Surface*) s == SDL_GetVideoSurface()));
+}
+
+value sdlstub_surface_rows8(value s) {
+    return surface_view(s, BIGARRAY_UINT8, 1, 0, "Video.surface_rows8");
+}
+
+value sdlstub_surface_rows16(value s) {
+    return surface_view(s, BIGARRAY_UINT16, 2, 0, "Video.surface_rows16");
+}
+
+value sdlstub_surface_rows32(value s) {
+    return surface_view(s, BIGARRAY_INT32, 4, 0, "Video.surface_rows32");
+}
+
+value sdlstub_surface_channels(value s) {
+    return surface_view(s, BIGARRAY_UINT8, 1, ((SDL_Surface*) s)->format->BytesPerPixel, "Video.surface_channels");
 }
 
 value sdlstub_surface_width(value s) {
@@ -536,14 +1075,29 @@ value sdlstub_get_ticks(value u) {
 value sdlstub_delay(value vms) {
     CAMLparam1(vms);
     int ms = Int_val(vms);
+    caml_enter_blocking_section();
     SDL_Delay(ms);
+    caml_leave_blocking_section();
     CAMLreturn (Val_unit);
 }
 
+value sdlstub_pacer_reset(value p) {
+    return pacer_reset(p);
+}
+
+value sdlstub_pacer_wait(value p) {
+    return pacer_wait(p);
+}
+
+value sdlstub_pacer_steps(value p, value step) {
+    return pacer_steps(p, step);
+}
+
 value sdlstub_fill_surface(value s, value vc) {
     CAMLparam2(s,vc);
     int c = Int32_val(vc);
     if (SDL_FillRect((SDL_Surface*) s, NULL, c) < 0) raise_failure();
+    sdl_mark_dirty((SDL_Surface*) s, 0, 0, ((SDL_Surface*) s)->w, ((SDL_Surface*) s)->h);
     CAMLreturn(Val_unit);
 }
 
@@ -556,6 +1110,7 @@ value sdlstub_fill_rect(value s, value vr, value vc) {
     r.w = Int_val(Field(vr,2));
     r.h = Int_val(Field(vr,3));
     if (SDL_FillRect((SDL_Surface*) s, &r, c) < 0) raise_failure();
+    sdl_mark_dirty((SDL_Surface*) s, Int_val(Field(vr,0)), Int_val(Field(vr,1)), Int_val(Field(vr,2)), Int_val(Field(vr,3)));
     CAMLreturn(Val_unit);
 }
 
@@ -576,15 +1131,28 @@ value sdlstub_update_rect(value s, value vx, value vy, value vw, value vh) {
     CAMLreturn (Val_unit);
 }
 
-value sdlstub_update_rects(value s, value vn, value arr){
-    CAMLparam3(s, vn, arr);
-    int n = Int_val(vn);
+/* Rectangles for SDL_UpdateRects, kept between calls. */
+static SDL_Rect *update_buffer = NULL;
+static int update_capacity = 0;
+
+static SDL_Rect *update_rects_buffer(int n)
+{
+    if (n > update_capacity) {
+        SDL_Rect *grown = (SDL_Rect *) realloc(update_buffer, n * sizeof(SDL_Rect));
+        if (grown == NULL) raise_out_of_memory();
+        update_buffer = grown;
+        update_capacity = n;
+    }
+    return update_buffer;
+}
+
+value sdlstub_update_rects(value s, value arr){
+    CAMLparam2(s, arr);
+    int n = Wosize_val(arr);
     value v;
     int i;
-    SDL_Rect* rects;
+    SDL_Rect* rects = update_rects_buffer(n);
 
-    if (Wosize_val(arr) < (unsigned)n) invalid_argument("update_rects");
-    rects = (SDL_Rect*) malloc(n * sizeof(SDL_Rect));
     for (i = 0; i < n; i++) {
         v = Field(arr,i);
         rects[i].x = Int_val(Field(v,0));
@@ -593,10 +1161,159 @@ value sdlstub_update_rects(value s, value vn, value arr){
         rects[i].h = Int_val(Field(v,3));
     };
     SDL_UpdateRects((SDL_Surface*) s, n, rects);
-    free(rects);
     CAMLreturn (Val_unit);
 }
 
+/* Dirty rectangles. The tracked surface is divided into square tiles and
+   sdl_mark_dirty sets the tiles a rectangle touches. flush_dirty covers
+   the marked tiles with rectangles - the runs of marked tiles along each
+   row, merged downwards while the run below has the same columns - and
+   sends them with one SDL_UpdateRects call. */
+static struct {
+    SDL_Surface *surface;
+    int tile, columns, rows, marked;
+    Uint8 *tiles;
+    int *open, *next;           /* rectangles ending on the last row, by first column */
+    long long flushes, rects, pushed, full;
+} dirty;
+
+static void free_dirty(void)
+{
+    free(dirty.tiles);
+    free(dirty.open);
+    free(dirty.next);
+    dirty.tiles = NULL;
+    dirty.open = dirty.next = NULL;
+    dirty.surface = NULL;
+}
+
+void sdl_mark_dirty(SDL_Surface *s, int x, int y, int w, int h)
+{
+    int c0, c1, r;
+    long x1 = (long)x + w, y1 = (long)y + h;
+
+    if (s != dirty.surface || s == NULL) return;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x1 > s->w) x1 = s->w;
+    if (y1 > s->h) y1 = s->h;
+    if (x >= x1 || y >= y1) return;
+    c0 = x / dirty.tile;
+    c1 = (int)((x1 - 1) / dirty.tile);
+    for (r = y / dirty.tile; r <= (y1 - 1) / dirty.tile; r++)
+        memset(dirty.tiles + r * dirty.columns + c0, 1, c1 - c0 + 1);
+    dirty.marked = 1;
+}
+
+/* Covers the marked tiles, in pixels and clipped to the surface;
+   returns the number of rectangles. */
+static int dirty_cover(SDL_Rect *rects)
+{
+    int n = 0, r, c, c0, i, t = dirty.tile, *swap;
+    SDL_Surface *s = dirty.surface;
+
+    for (c = 0; c < dirty.columns; c++) dirty.open[c] = -1;
+    for (r = 0; r < dirty.rows; r++) {
+        const Uint8 *row = dirty.tiles + r * dirty.columns;
+        for (c = 0; c < dirty.columns; c++) dirty.next[c] = -1;
+        for (c = 0; c < dirty.columns; ) {
+            if (!row[c]) {
+                c++;
+                continue;
+            }
+            for (c0 = c; c < dirty.columns && row[c]; c++) ;
+            i = dirty.open[c0];
+            if (i >= 0 && rects[i].x + rects[i].w == (c == dirty.columns ? s->w : c * t)) {
+                rects[i].h = (Uint16)((r + 1) * t > s->h ? s->h - rects[i].y : (r + 1) * t - rects[i].y);
+            } else {
+                i = n++;
+                rects[i].x = (Sint16)(c0 * t);
+                rects[i].y = (Sint16)(r * t);
+                rects[i].w = (Uint16)((c == dirty.columns ? s->w : c * t) - c0 * t);
+                rects[i].h = (Uint16)((r + 1) * t > s->h ? s->h - r * t : t);
+            }
+            dirty.next[c0] = i;
+        }
+        swap = dirty.open;
+        dirty.open = dirty.next;
+        dirty.next = swap;
+    }
+    return n;
+}
+
+value sdlstub_track_dirty(value s, value vtile)
+{
+    CAMLparam2(s, vtile);
+    SDL_Surface *surf = (SDL_Surface *) s;
+    int tile = Int_val(vtile);
+
+    if (tile <= 0) invalid_argument("Video.track_dirty");
+    free_dirty();
+    dirty.tile = tile;
+    dirty.columns = (surf->w + tile - 1) / tile;
+    dirty.rows = (surf->h + tile - 1) / tile;
+    dirty.tiles = (Uint8 *) calloc((size_t)dirty.columns * dirty.rows + 1, 1);
+    dirty.open = (int *) malloc((dirty.columns + 1) * sizeof(int));
+    dirty.next = (int *) malloc((dirty.columns + 1) * sizeof(int));
+    if (dirty.tiles == NULL || dirty.open == NULL || dirty.next == NULL) {
+        free_dirty();
+        raise_out_of_memory();
+    }
+    /* the most rectangles a cover can need */
+    update_rects_buffer(dirty.columns * dirty.rows + 1);
+    dirty.surface = surf;
+    dirty.marked = 0;
+    dirty.flushes = dirty.rects = dirty.pushed = dirty.full = 0;
+    CAMLreturn(Val_unit);
+}
+
+value sdlstub_untrack_dirty(value unit)
+{
+    CAMLparam1(unit);
+    free_dirty();
+    CAMLreturn(Val_unit);
+}
+
+value sdlstub_mark_dirty(value s, value vx, value vy, value vw, value vh)
+{
+    CAMLparam5(s, vx, vy, vw, vh);
+    sdl_mark_dirty((SDL_Surface *) s, Int_val(vx), Int_val(vy), Int_val(vw), Int_val(vh));
+    CAMLreturn(Val_unit);
+}
+
+/* Sends the dirty rectangles and clears them; returns how many were sent. */
+value sdlstub_flush_dirty(value unit)
+{
+    CAMLparam1(unit);
+    int n = 0, i;
+
+    if (dirty.surface == NULL) failwith("Video.flush_dirty: no surface tracked");
+    if (dirty.marked) {
+        n = dirty_cover(update_buffer);
+        SDL_UpdateRects(dirty.surface, n, update_buffer);
+        for (i = 0; i < n; i++) dirty.pushed += (long long)update_buffer[i].w * update_buffer[i].h;
+        memset(dirty.tiles, 0, (size_t)dirty.columns * dirty.rows);
+        dirty.marked = 0;
+    }
+    dirty.flushes++;
+    dirty.rects += n;
+    dirty.full += (long long)dirty.surface->w * dirty.surface->h;
+    CAMLreturn(Val_int(n));
+}
+
+/* (flushes, rectangles, pixels pushed, pixels a full update each time would have pushed) */
+value sdlstub_dirty_stats(value unit)
+{
+    CAMLparam1(unit);
+    CAMLlocal1(result);
+    result = alloc_tuple(4);
+    Store_field(result, 0, Val_long(dirty.flushes));
+    Store_field(result, 1, Val_long(dirty.rects));
+    Store_field(result, 2, Val_long(dirty.pushed));
+    Store_field(result, 3, Val_long(dirty.full));
+    CAMLreturn(result);
+}
+
 value sdlstub_flip(value s) {
     CAMLparam1(s);
     if (SDL_Flip((SDL_Surface*) s) < 0) raise_failure();
@@ -641,6 +1358,12 @@ value sdlstub_blit_surface(value src, value srcr, value dst, value dstr) {
 
     if (SDL_BlitSurface((SDL_Surface*) src, srp, (SDL_Surface*) dst, drp) < 0)
         raise_failure();
+    /* SDL leaves the rectangle it blitted to in dr */
+    if (drp != NULL)
+        sdl_mark_dirty((SDL_Surface*) dst, dr.x, dr.y, dr.w, dr.h);
+    else
+        sdl_mark_dirty((SDL_Surface*) dst, 0, 0, srp != NULL ? srp->w : ((SDL_Surface*) src)->w,
+                       srp != NULL ? srp->h : ((SDL_Surface*) src)->h);
     if (! (srp == NULL)) update_rect_option(srcr,srp);
     if (! (drp == NULL)) update_rect_option(dstr,drp);
     CAMLreturn(Val_unit);
@@ -980,14 +1703,384 @@ static value SDL_event_to_ML_tevent(SDL_Event event)
     }
 }
 
+/* Allocation-free decoding: each event takes EVENT_WORDS int32 of the
+   buffer, its type (the constructor number in Event.event) followed by the
+   fields below, in the order of the OCaml records. Keys are the number of
+   the Event.key constructor and modifiers the SDL bit mask. */
+#define EVENT_WORDS 8
+
+static void event_to_words(const SDL_Event *e, Sint32 *w)
+{
+    memset(w, 0, EVENT_WORDS * sizeof(Sint32));
+    switch (e->type) {
+    case SDL_ACTIVEEVENT:
+        w[0] = 1;
+        w[1] = e->active.gain;
+        w[2] = e->active.state & SDL_APPACTIVE ? 2 : e->active.state & SDL_APPINPUTFOCUS ? 1 : 0;
+        break;
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+        w[0] = 2;
+        w[1] = e->key.state;
+        w[2] = e->key.keysym.scancode;
+        w[3] = key_to_flag[e->key.keysym.sym];
+        w[4] = e->key.keysym.mod;
+        w[5] = e->key.keysym.unicode;
+        break;
+    case SDL_MOUSEMOTION:
+        w[0] = 3;
+        w[1] = e->motion.state;
+        w[2] = e->motion.x;
+        w[3] = e->motion.y;
+        w[4] = e->motion.xrel;
+        w[5] = e->motion.yrel;
+        break;
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+        w[0] = 4;
+        w[1] = e->button.button - 1;
+        w[2] = e->button.state;
+        w[3] = e->button.x;
+        w[4] = e->button.y;
+        break;
+    case SDL_JOYAXISMOTION:
+        w[0] = 5;
+        w[1] = e->jaxis.which;
+        w[2] = e->jaxis.axis;
+        w[3] = e->jaxis.value;
+        break;
+    case SDL_JOYBALLMOTION:
+        w[0] = 6;
+        w[1] = e->jball.which;
+        w[2] = e->jball.ball;
+        w[3] = e->jball.xrel;
+        w[4] = e->jball.yrel;
+        break;
+    case SDL_JOYHATMOTION:
+        w[0] = 7;
+        w[1] = e->jhat.which;
+        w[2] = e->jhat.hat;
+        w[3] = e->jhat.value;
+        break;
+    case SDL_JOYBUTTONUP:
+    case SDL_JOYBUTTONDOWN:
+        w[0] = 8;
+        w[1] = e->jbutton.which;
+        w[2] = e->jbutton.button;
+        w[3] = e->jbutton.state;
+        break;
+    case SDL_VIDEORESIZE:
+        w[0] = 9;
+        w[1] = e->resize.w;
+        w[2] = e->resize.h;
+        break;
+    case SDL_VIDEOEXPOSE:
+        w[0] = 10;
+        break;
+    case SDL_QUIT:
+        w[0] = 11;
+        break;
+    case SDL_SYSWMEVENT:
+        w[0] = 13;
+        break;
+    default:
+        /* SDL_USEREVENT and up; the data pointers are not passed */
+        w[0] = 12;
+        w[1] = e->user.code;
+        break;
+    }
+}
+
+/* Recording and replay of the event stream, for repeatable benchmark runs.
+
+   A recording starts with RECORD_MAGIC, then has one record per event
+   handed to OCaml: the nanoseconds since start_recording as a little
+   endian int64, then the words of event_to_words as little endian int32.
+   A record of type 0 is a mark for the end of one poll: a poll_event that
+   found nothing, or a poll_events call. Replaying as fast as possible
+   hands each poll exactly the events its recorded counterpart got, so the
+   run does not depend on the frame rate; replaying in real time hands out
+   the events whose time has come. While replaying, live events are thrown
+   away except a quit, which ends the replay. */
+#define RECORD_MAGIC "GLCAMLEV"
+#define RECORD_BYTES (8 + 4 * EVENT_WORDS)
+
+struct replay_event {
+    long long time;
+    int mark;
+    SDL_Event event;
+};
+
+/* the constructors of Event.replay_speed, and off */
+enum { REPLAY_REALTIME, REPLAY_FAST, REPLAY_OFF };
+
+static FILE *record_file = NULL;
+static long long record_start;
+
+static struct replay_event *replay = NULL;
+static int replay_count = 0, replay_next = 0, replay_mode = REPLAY_OFF;
+static long long replay_start;
+
+static void put_le(unsigned char *p, unsigned long long x, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; i++) p[i] = (unsigned char)(x >> (8 * i));
+}
+
+static unsigned long long get_le(const unsigned char *p, int bytes)
+{
+    unsigned long long x = 0;
+    int i;
+    for (i = bytes - 1; i >= 0; i--) x = x << 8 | p[i];
+    return x;
+}
+
+static void record_words(const Sint32 *w)
+{
+    unsigned char r[RECORD_BYTES];
+    int i;
+    put_le(r, (unsigned long long)(hrtime_ns() - record_start), 8);
+    for (i = 0; i < EVENT_WORDS; i++) put_le(r + 8 + 4 * i, (Uint32)w[i], 4);
+    fwrite(r, RECORD_BYTES, 1, record_file);
+}
+
+static void record_event(const SDL_Event *e)
+{
+    Sint32 w[EVENT_WORDS];
+    if (record_file == NULL) return;
+    event_to_words(e, w);
+    record_words(w);
+}
+
+static void record_mark(void)
+{
+    Sint32 w[EVENT_WORDS];
+    if (record_file == NULL) return;
+    memset(w, 0, sizeof(w));
+    record_words(w);
+}
+
+/* The inverse of event_to_words. Returns 0 for what cannot be replayed:
+   window manager events and unknown types. */
+static int words_to_event(const Sint32 *w, SDL_Event *e)
+{
+    memset(e, 0, sizeof(*e));
+    switch (w[0]) {
+    case 1:
+        e->type = SDL_ACTIVEEVENT;
+        e->active.gain = w[1];
+        e->active.state = w[2] == 2 ? SDL_APPACTIVE : w[2] == 1 ? SDL_APPINPUTFOCUS : SDL_APPMOUSEFOCUS;
+        break;
+    case 2:
+        if (w[3] < 0 || w[3] >= (int)(sizeof(flag_to_key) / sizeof(flag_to_key[0]))) return 0;
+        e->type = w[1] == SDL_PRESSED ? SDL_KEYDOWN : SDL_KEYUP;
+        e->key.state = w[1];
+        e->key.keysym.scancode = w[2];
+        e->key.keysym.sym = flag_to_key[w[3]];
+        e->key.keysym.mod = w[4];
+        e->key.keysym.unicode = w[5];
+        break;
+    case 3:
+        e->type = SDL_MOUSEMOTION;
+        e->motion.state = w[1];
+        e->motion.x = w[2];
+        e->motion.y = w[3];
+        e->motion.xrel = w[4];
+        e->motion.yrel = w[5];
+        break;
+    case 4:
+        e->type = w[2] == SDL_PRESSED ? SDL_MOUSEBUTTONDOWN : SDL_MOUSEBUTTONUP;
+        e->button.button = w[1] + 1;
+        e->button.state = w[2];
+        e->button.x = w[3];
+        e->button.y = w[4];
+        break;
+    case 5:
+        e->type = SDL_JOYAXISMOTION;
+        e->jaxis.which = w[1];
+        e->jaxis.axis = w[2];
+        e->jaxis.value = w[3];
+        break;
+    case 6:
+        e->type = SDL_JOYBALLMOTION;
+        e->jball.which = w[1];
+        e->jball.ball = w[2];
+        e->jball.xrel = w[3];
+        e->jball.yrel = w[4];
+        break;
+    case 7:
+        e->type = SDL_JOYHATMOTION;
+        e->jhat.which = w[1];
+        e->jhat.hat = w[2];
+        e->jhat.value = w[3];
+        break;
+    case 8:
+        e->type = w[3] == SDL_PRESSED ? SDL_JOYBUTTONDOWN : SDL_JOYBUTTONUP;
+        e->jbutton.which = w[1];
+        e->jbutton.button = w[2];
+        e->jbutton.state = w[3];
+        break;
+    case 9:
+        e->type = SDL_VIDEORESIZE;
+        e->resize.w = w[1];
+        e->resize.h = w[2];
+        break;
+    case 10:
+        e->type = SDL_VIDEOEXPOSE;
+        break;
+    case 11:
+        e->type = SDL_QUIT;
+        break;
+    case 12:
+        e->type = SDL_USEREVENT;
+        e->user.code = w[1];
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+static void end_replay(void)
+{
+    free(replay);
+    replay = NULL;
+    replay_count = replay_next = 0;
+    replay_mode = REPLAY_OFF;
+}
+
+/* Pumps and empties the live queue; returns 1 if it held a quit, which
+   also ends the replay. */
+static int drop_live_events(void)
+{
+    SDL_Event e;
+    int quit = 0;
+    SDL_PumpEvents();
+    while (SDL_PeepEvents(&e, 1, SDL_GETEVENT, SDL_ALLEVENTS) > 0)
+        if (e.type == SDL_QUIT) quit = 1;
+    if (quit) end_replay();
+    return quit;
+}
+
+/* The replayed counterpart of SDL_PollEvent, or SDL_WaitEvent if [wait];
+   touches no OCaml values, so it can run in a blocking section. */
+static int replay_one(SDL_Event *out, int wait)
+{
+    for (;;) {
+        const struct replay_event *r;
+        if (drop_live_events()) {
+            memset(out, 0, sizeof(*out));
+            out->type = SDL_QUIT;
+            return 1;
+        }
+        if (replay_next >= replay_count) {
+            end_replay();
+            return wait ? SDL_WaitEvent(out) : 0;
+        }
+        r = &replay[replay_next];
+        if (r->mark) {
+            replay_next++;
+            if (replay_mode == REPLAY_FAST && !wait) return 0;
+        } else if (replay_mode == REPLAY_FAST || r->time <= hrtime_ns() - replay_start) {
+            *out = r->event;
+            replay_next++;
+            return 1;
+        } else if (!wait) {
+            return 0;
+        } else {
+            SDL_Delay(1);
+        }
+    }
+}
+
+value sdlstub_start_recording(value vpath)
+{
+    CAMLparam1(vpath);
+    FILE *f = fopen(String_val(vpath), "wb");
+    if (f == NULL) failwith("Event.start_recording: cannot open file");
+    if (fwrite(RECORD_MAGIC, 8, 1, f) != 1) {
+        fclose(f);
+        failwith("Event.start_recording: write failed");
+    }
+    if (record_file != NULL) fclose(record_file);
+    record_file = f;
+    record_start = hrtime_ns();
+    CAMLreturn(Val_unit);
+}
+
+value sdlstub_stop_recording(value u)
+{
+    CAMLparam1(u);
+    FILE *f = record_file;
+    record_file = NULL;
+    if (f != NULL && (ferror(f) | fclose(f)) != 0) failwith("Event.stop_recording: write failed");
+    CAMLreturn(Val_unit);
+}
+
+value sdlstub_start_replay(value vpath, value vspeed)
+{
+    CAMLparam2(vpath, vspeed);
+    FILE *f = fopen(String_val(vpath), "rb");
+    unsigned char r[RECORD_BYTES];
+    struct replay_event *events = NULL;
+    int i, n = 0, size = 0;
+
+    if (f == NULL) failwith("Event.start_replay: cannot open file");
+    if (fread(r, 8, 1, f) != 1 || memcmp(r, RECORD_MAGIC, 8) != 0) {
+        fclose(f);
+        failwith("Event.start_replay: not an event recording");
+    }
+    while (fread(r, RECORD_BYTES, 1, f) == 1) {
+        Sint32 w[EVENT_WORDS];
+        if (n == size) {
+            struct replay_event *grown;
+            size = size == 0 ? 1024 : size * 2;
+            grown = (struct replay_event *)realloc(events, size * sizeof(struct replay_event));
+            if (grown == NULL) {
+                free(events);
+                fclose(f);
+                raise_out_of_memory();
+            }
+            events = grown;
+        }
+        for (i = 0; i < EVENT_WORDS; i++) w[i] = (Sint32)(Uint32)get_le(r + 8 + 4 * i, 4);
+        events[n].time = (long long)get_le(r, 8);
+        events[n].mark = w[0] == 0;
+        if (events[n].mark || words_to_event(w, &events[n].event)) n++;
+    }
+    fclose(f);
+    end_replay();
+    replay = events;
+    replay_count = n;
+    replay_mode = Int_val(vspeed);
+    replay_start = hrtime_ns();
+    CAMLreturn(Val_unit);
+}
+
+value sdlstub_stop_replay(value u)
+{
+    CAMLparam1(u);
+    end_replay();
+    CAMLreturn(Val_unit);
+}
+
+value sdlstub_replaying(value u)
+{
+    CAMLparam1(u);
+    CAMLreturn(Val_bool(replay_mode != REPLAY_OFF));
+}
+
 value sdlstub_poll_event(value u)
 {
     CAMLparam1(u);
     SDL_Event event;
     int isevent;
     caml_enter_blocking_section();
-    isevent=SDL_PollEvent(&event);
+    if (replay_mode != REPLAY_OFF) isevent=replay_one(&event, 0);
+    else isevent=SDL_PollEvent(&event);
     caml_leave_blocking_section();
+    if (isevent==1) record_event(&event);
+    else record_mark();
     if (isevent==1)
     CAMLreturn (SDL_event_to_ML_tevent(event));
     else CAMLreturn (Val_int(0));
@@ -999,13 +2092,133 @@ value sdlstub_wait_event(value u)
     SDL_Event event;
     int isevent;
     caml_enter_blocking_section();
-    isevent=SDL_WaitEvent(&event);
+    if (replay_mode != REPLAY_OFF) isevent=replay_one(&event, 1);
+    else isevent=SDL_WaitEvent(&event);
     caml_leave_blocking_section();
+    if (isevent==1) record_event(&event);
     if (isevent==1)
     CAMLreturn (SDL_event_to_ML_tevent(event));
     else CAMLreturn (Val_int(0));
 }
 
+/* Batched polling: one pump and SDL_PeepEvents in chunks move the whole
+   queue into event_batch within a single blocking section. */
+#define PEEP_CHUNK 128
+
+static SDL_Event *event_batch = NULL;
+static int event_batch_size = 0;
+
+/* Merges runs of mouse motion events with the same button state into the
+   last one of the run, summing the relative motion. */
+static int coalesce_motion(SDL_Event *events, int n)
+{
+    int i, m = 0;
+    for (i = 0; i < n; i++) {
+        if (m > 0 && events[i].type == SDL_MOUSEMOTION && events[m - 1].type == SDL_MOUSEMOTION
+            && events[i].motion.state == events[m - 1].motion.state) {
+            SDL_MouseMotionEvent *last = &events[m - 1].motion;
+            last->x = events[i].motion.x;
+            last->y = events[i].motion.y;
+            last->xrel += events[i].motion.xrel;
+            last->yrel += events[i].motion.yrel;
+        } else {
+            events[m++] = events[i];
+        }
+    }
+    return m;
+}
+
+static int reserve_batch(int n)
+{
+    if (n > event_batch_size) {
+        SDL_Event *grown = (SDL_Event *)realloc(event_batch, (event_batch_size + 4 * PEEP_CHUNK) * sizeof(SDL_Event));
+        if (grown == NULL) return 0;
+        event_batch = grown;
+        event_batch_size += 4 * PEEP_CHUNK;
+    }
+    return 1;
+}
+
+/* The replayed counterpart of one batch: up to the next mark when
+   replaying as fast as possible, else the events that are due. */
+static int replay_batch(int max)
+{
+    int n = 0;
+    if (drop_live_events()) {
+        if (!reserve_batch(1)) return 0;
+        memset(event_batch, 0, sizeof(SDL_Event));
+        event_batch[0].type = SDL_QUIT;
+        return 1;
+    }
+    while (n < max && replay_next < replay_count) {
+        const struct replay_event *r = &replay[replay_next];
+        if (r->mark) {
+            replay_next++;
+            if (replay_mode == REPLAY_FAST) break;
+            continue;
+        }
+        if (replay_mode == REPLAY_REALTIME && r->time > hrtime_ns() - replay_start) break;
+        /* out of memory: the rest is handed out by the next call */
+        if (!reserve_batch(n + 1)) break;
+        event_batch[n++] = r->event;
+        replay_next++;
+    }
+    if (replay_next >= replay_count) end_replay();
+    return n;
+}
+
+/* Takes at most [max] events. */
+static int drain_events(int coalesce, int max)
+{
+    int i, n = 0, got, want;
+    caml_enter_blocking_section();
+    if (replay_mode != REPLAY_OFF) {
+        n = replay_batch(max);
+    } else {
+        SDL_PumpEvents();
+        while (n < max) {
+            /* out of memory: the rest stays queued for the next call */
+            if (!reserve_batch(n + PEEP_CHUNK)) break;
+            want = max - n < PEEP_CHUNK ? max - n : PEEP_CHUNK;
+            got = SDL_PeepEvents(event_batch + n, want, SDL_GETEVENT, SDL_ALLEVENTS);
+            if (got <= 0) break;
+            n += got;
+            if (got < want) break;
+        }
+    }
+    caml_leave_blocking_section();
+    if (record_file != NULL) {
+        for (i = 0; i < n; i++) record_event(&event_batch[i]);
+        record_mark();
+    }
+    return coalesce ? coalesce_motion(event_batch, n) : n;
+}
+
+value sdlstub_poll_events(value vcoalesce)
+{
+    CAMLparam1(vcoalesce);
+    CAMLlocal2(result, ev);
+    int i, n = drain_events(Bool_val(vcoalesce), INT_MAX);
+    result = alloc(n, 0);
+    for (i = 0; i < n; i++) {
+        ev = SDL_event_to_ML_tevent(event_batch[i]);
+        Store_field(result, i, ev);
+    }
+    CAMLreturn(result);
+}
+
+value sdlstub_poll_events_into(value vbuf, value vcoalesce)
+{
+    CAMLparam2(vbuf, vcoalesce);
+    Sint32 *words = (Sint32 *)Data_bigarray_val(vbuf);
+    int capacity = Bigarray_val(vbuf)->dim[0] / EVENT_WORDS;
+    int i, n = 0;
+
+    if (capacity > 0) n = drain_events(Bool_val(vcoalesce), capacity);
+    for (i = 0; i < n; i++) event_to_words(&event_batch[i], words + i * EVENT_WORDS);
+    CAMLreturn(Val_int(n));
+}
+
 void sdlstub_pump_events(value u)
 {
     CAMLparam1(u);
@@ -1032,6 +2245,40 @@ value sdlstub_get_mouse_state(value u)
     CAMLreturn(toreturn);
 }
 
+/* SDL keeps the key state in one static array, so the view stays valid
+   and is updated in place by every pump. */
+value sdlstub_get_key_state(value u)
+{
+    CAMLparam1(u);
+    int n;
+    Uint8 *keys = SDL_GetKeyState(&n);
+    CAMLreturn(alloc_bigarray_dims(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT, 1, keys, n));
+}
+
+value sdlstub_key_syms(value u)
+{
+    CAMLparam1(u);
+    CAMLlocal1(result);
+    int i, n = sizeof(flag_to_key) / sizeof(flag_to_key[0]);
+    result = alloc(n, 0);
+    for (i = 0; i < n; i++) Field(result, i) = Val_int(flag_to_key[i]);
+    CAMLreturn(result);
+}
+
+/* noalloc; the fields of Event.mouse_state are immediate ints */
+value sdlstub_read_mouse_state(value r)
+{
+    int x, y, xrel, yrel;
+    Uint8 buttons = SDL_GetMouseState(&x, &y);
+    SDL_GetRelativeMouseState(&xrel, &yrel);
+    Field(r, 0) = Val_int(buttons);
+    Field(r, 1) = Val_int(x);
+    Field(r, 2) = Val_int(y);
+    Field(r, 3) = Val_int(xrel);
+    Field(r, 4) = Val_int(yrel);
+    return Val_unit;
+}
+
 value sdlstub_enable_unicode(value enable)
 {
     CAMLparam1(enable);
@@ -1133,9 +2380,34 @@ value sdlstub_get_grab_input(value u)
 
 
 /* open GL */
+/* SDL 1.2 has no present feedback, the frame times are CPU times */
+static struct present_stats gl_stats = { 0, 0, 0, 0, -1, 0, { 0 }, 0, 0, { 0 } };
+
 value sdlstub_GL_swap_buffers(value u) {
     CAMLparam1(u);
+    gl_stats.swap_start = hrtime_ns();
+    caml_enter_blocking_section();
     SDL_GL_SwapBuffers();
+    caml_leave_blocking_section();
+    gl_stats.swap_end = hrtime_ns();
+    gl_stats.frames++;
+    present_stats_record(&gl_stats, gl_stats.swap_end, -1, 0);
+    CAMLreturn(Val_unit);
+}
+
+value sdlstub_GL_present_timing(value u) {
+    CAMLparam1(u);
+    CAMLreturn(present_stats_value(&gl_stats));
+}
+
+value sdlstub_GL_frame_histogram(value u) {
+    CAMLparam1(u);
+    CAMLreturn(present_histogram_value(&gl_stats));
+}
+
+value sdlstub_GL_reset_present_timing(value u) {
+    CAMLparam1(u);
+    present_stats_reset(&gl_stats);
     CAMLreturn(Val_unit);
 }
 
@@ -1217,6 +2489,7 @@ value sdldraw_put_pixel(value s, value vx, value vy, value vc) {
                 break;
         };
         SDL_UnlockSurface(dst);
+        sdl_mark_dirty(dst, x, y, 1, 1);
     };
     CAMLreturn(Val_unit);
 }
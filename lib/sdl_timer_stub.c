@@ -0,0 +1,182 @@
+/*
+ * Sdl.Timer - nanosecond clock and scope profiler.
+ *
+ * The profiler keeps the open scopes on a stack and writes each scope as
+ * one complete event (start, duration) into a ring buffer when it closes,
+ * so overwriting old events never leaves half a scope behind. Entering and
+ * leaving scopes neither allocates nor touches the OCaml heap; they are
+ * meant to be called by the thread holding the runtime lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+
+#include "hrtime.h"
+
+int64_t sdlstub_now_ns(value unit)
+{
+    (void)unit;
+    return hrtime_ns();
+}
+
+value sdlstub_now_ns_byte(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn(copy_int64(hrtime_ns()));
+}
+
+struct scope_event {
+    long long start, duration;
+    int scope, depth;
+};
+
+#define MAX_DEPTH 64
+
+static struct scope_event *events = NULL;
+static int capacity = 0, next_event = 0, event_count = 0;
+static long long overwritten = 0;
+static int recording = 0;
+static long long epoch = 0;
+
+static long long open_start[MAX_DEPTH];
+static int open_scope[MAX_DEPTH];
+static int depth = 0;
+
+static char **names = NULL;
+static int name_count = 0, name_capacity = 0;
+
+value sdlstub_profile_scope(value vname)
+{
+    CAMLparam1(vname);
+    const char *name = String_val(vname);
+    int i;
+
+    for (i = 0; i < name_count; i++)
+        if (strcmp(names[i], name) == 0) CAMLreturn(Val_int(i));
+    if (name_count == name_capacity) {
+        int n = name_capacity == 0 ? 16 : name_capacity * 2;
+        char **grown = (char **)realloc(names, n * sizeof(char *));
+        if (grown == NULL) raise_out_of_memory();
+        names = grown;
+        name_capacity = n;
+    }
+    names[name_count] = (char *)malloc(strlen(name) + 1);
+    if (names[name_count] == NULL) raise_out_of_memory();
+    strcpy(names[name_count], name);
+    CAMLreturn(Val_int(name_count++));
+}
+
+value sdlstub_profile_start(value vcapacity)
+{
+    CAMLparam1(vcapacity);
+    int n = Int_val(vcapacity);
+
+    if (n <= 0) invalid_argument("Timer.start_profiler");
+    if (n != capacity) {
+        struct scope_event *e = (struct scope_event *)malloc(n * sizeof(struct scope_event));
+        if (e == NULL) raise_out_of_memory();
+        free(events);
+        events = e;
+        capacity = n;
+    }
+    next_event = event_count = depth = 0;
+    overwritten = 0;
+    epoch = hrtime_ns();
+    recording = 1;
+    CAMLreturn(Val_unit);
+}
+
+value sdlstub_profile_stop(value unit)
+{
+    CAMLparam1(unit);
+    recording = 0;
+    depth = 0;
+    CAMLreturn(Val_unit);
+}
+
+/* noalloc */
+value sdlstub_profile_enter(value vscope)
+{
+    if (recording) {
+        if (depth < MAX_DEPTH) {
+            open_scope[depth] = Int_val(vscope);
+            open_start[depth] = hrtime_ns();
+        }
+        depth++;
+    }
+    return Val_unit;
+}
+
+/* noalloc; scopes deeper than MAX_DEPTH are not recorded */
+value sdlstub_profile_leave(value vscope)
+{
+    long long now;
+    struct scope_event *e;
+
+    (void)vscope;
+    if (!recording || depth == 0) return Val_unit;
+    depth--;
+    if (depth >= MAX_DEPTH) return Val_unit;
+    now = hrtime_ns();
+    e = &events[next_event];
+    e->start = open_start[depth];
+    e->duration = now - open_start[depth];
+    e->scope = open_scope[depth];
+    e->depth = depth;
+    next_event = (next_event + 1) % capacity;
+    if (event_count < capacity) event_count++;
+    else overwritten++;
+    return Val_unit;
+}
+
+value sdlstub_profile_counts(value unit)
+{
+    CAMLparam1(unit);
+    CAMLlocal1(result);
+    result = alloc_tuple(2);
+    Store_field(result, 0, Val_int(event_count));
+    Store_field(result, 1, Val_long(overwritten));
+    CAMLreturn(result);
+}
+
+static void write_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+/* Writes the recorded scopes, oldest first, in the Chrome trace event
+   format (chrome://tracing, Perfetto); times are microseconds since
+   start_profiler. */
+value sdlstub_profile_export(value vpath)
+{
+    CAMLparam1(vpath);
+    FILE *f = fopen(String_val(vpath), "w");
+    int i, first = event_count < capacity ? 0 : next_event;
+
+    if (f == NULL) failwith("Timer.export_chrome_trace: cannot open file");
+    fputs("{\"traceEvents\":[\n", f);
+    for (i = 0; i < event_count; i++) {
+        const struct scope_event *e = &events[(first + i) % capacity];
+        fputs("{\"name\":", f);
+        write_json_string(f, names[e->scope]);
+        fprintf(f, ",\"cat\":\"ocaml\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1,\"args\":{\"depth\":%d}},\n",
+                (e->start - epoch) / 1000.0, e->duration / 1000.0, e->depth);
+    }
+    fputs("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"main\"}}\n", f);
+    fputs("],\"displayTimeUnit\":\"ms\"}\n", f);
+    if (fclose(f) != 0) failwith("Timer.export_chrome_trace: write failed");
+    CAMLreturn(Val_unit);
+}
@@ -48,13 +48,160 @@
 external init_gl' : string -> unit = "stub_init_gl" "stub_init_gl"
 external swap_buffers : unit -> unit = "stub_swap_buffers" "stub_swap_buffers"
 
-let init_opengl () =
+type gl_attributes = {
+  red_bits : int;
+  green_bits : int;
+  blue_bits : int;
+  alpha_bits : int;
+  depth_bits : int;
+  stencil_bits : int;
+  samples : int;
+  srgb : bool;
+  double_buffer : bool;
+}
+
+let default_attributes = {
+  red_bits = 8;
+  green_bits = 8;
+  blue_bits = 8;
+  alpha_bits = 0;
+  depth_bits = 24;
+  stencil_bits = 0;
+  samples = 0;
+  srgb = false;
+  double_buffer = true;
+}
+
+external init_gl_config : string -> gl_attributes -> unit = "stub_init_gl_config"
+
+let with_unique_title init =
   let _  = Random.self_init () in
   let title = Printf.sprintf "%d.%d" (Random.int 1000000) (Random.int 1000000) in
   Graphics.set_window_title title;
-  init_gl' title;
+  init title;
   Graphics.set_window_title "";;
 
+let init_opengl () = with_unique_title init_gl'
+
+let init_opengl_with attributes = with_unique_title (fun title -> init_gl_config title attributes)
+
+(* Negative intervals ask for adaptive vsync *)
+external set_swap_interval : int -> bool = "stub_set_swap_interval"
+
+(* Present timing, times in seconds of a monotonic clock *)
+type present_timing = {
+  frames : int;
+  swap_start : float;
+  swap_end : float;
+  present : float;
+  msc : int;
+  hardware_timing : bool;
+  mean_frame_time : float;
+  min_frame_time : float;
+  max_frame_time : float;
+  median_frame_time : float;
+  p99_frame_time : float;
+}
+
+external present_timing' : unit -> float array = "stub_present_timing"
+
+let present_timing () =
+  let a = present_timing' () in
+  { frames = int_of_float a.(0);
+    swap_start = a.(1);
+    swap_end = a.(2);
+    present = a.(3);
+    msc = int_of_float a.(4);
+    hardware_timing = a.(5) <> 0.0;
+    mean_frame_time = a.(6);
+    min_frame_time = a.(7);
+    max_frame_time = a.(8);
+    median_frame_time = a.(9);
+    p99_frame_time = a.(10) }
+
+external frame_histogram : unit -> int array = "stub_frame_histogram"
+
+let histogram_bucket_width = 0.0005
+
+external reset_present_timing : unit -> unit = "stub_reset_present_timing"
+
+(*********************** Headless ****************************************)
+(*
+ * Without a display (e.g. on a CI machine) an offscreen context can be created
+ * instead with init_headless width height. The library has to be built with
+ * HEADLESS=egl for this; headless_backend tells whether it was.
+ * swap_buffers then waits for rendering to finish, so frame times stay honest,
+ * and the image can be read back with glReadPixels.
+ *)
+
+external init_headless : int -> int -> unit = "stub_init_headless"
+external headless_backend' : unit -> string = "stub_headless_backend"
+
+let headless_backend = headless_backend' ()
+
+(*********************** Frame pacing ****************************************)
+
+type pacer = {
+  mutable pacer_period : float;
+  mutable pacer_spin : float;
+  mutable pacer_deadline : float;
+  mutable pacer_last_wake : float;
+  mutable pacer_frame_time : float;
+  mutable pacer_accumulator : float;
+  mutable pacer_accumulated_at : float;
+  mutable pacer_alpha : float;
+  mutable pacer_frames : float;
+  mutable pacer_late : float;
+  mutable pacer_overshoot_sum : float;
+  mutable pacer_overshoot_max : float;
+  mutable pacer_overshoot_last : float;
+}
+
+type pacer_stats = {
+  paced_frames : int;
+  late_frames : int;
+  mean_overshoot : float;
+  max_overshoot : float;
+  last_overshoot : float;
+}
+
+external reset_pacer : pacer -> unit = "stub_pacer_reset"
+external wait_frame : pacer -> unit = "stub_pacer_wait"
+external fixed_steps : pacer -> float -> int = "stub_pacer_steps"
+
+let create_pacer period =
+  if period <= 0.0 then invalid_arg "create_pacer";
+  let p = {
+    pacer_period = period *. 1e9;
+    pacer_spin = 2e6;
+    pacer_deadline = 0.0;
+    pacer_last_wake = 0.0;
+    pacer_frame_time = 0.0;
+    pacer_accumulator = 0.0;
+    pacer_accumulated_at = 0.0;
+    pacer_alpha = 0.0;
+    pacer_frames = 0.0;
+    pacer_late = 0.0;
+    pacer_overshoot_sum = 0.0;
+    pacer_overshoot_max = 0.0;
+    pacer_overshoot_last = 0.0 } in
+  reset_pacer p;
+  p
+
+let set_pacer_spin p seconds = p.pacer_spin <- seconds *. 1e9
+
+let frame_time p = p.pacer_frame_time *. 1e-9
+
+let interpolation p = p.pacer_alpha
+
+let pacer_stats p =
+  let waited = p.pacer_frames -. p.pacer_late in
+  { paced_frames = int_of_float p.pacer_frames;
+    late_frames = int_of_float p.pacer_late;
+    mean_overshoot = if waited > 0.0 then p.pacer_overshoot_sum *. 1e-9 /. waited else 0.0;
+    max_overshoot = p.pacer_overshoot_max *. 1e-9;
+    last_overshoot = p.pacer_overshoot_last *. 1e-9 }
+
 (* Sleep for n microseconds *)
 external usleep: int -> unit = "stub_usleep"
 
@@ -29,9 +29,128 @@
    If the window had a title it will have to be set again *)
 val init_opengl : unit -> unit
 
-(** Swap the back buffer to the screen *)
+(** Framebuffer attributes for [init_opengl_with]. The bit counts and samples
+   are minimums; [srgb] asks for an sRGB capable framebuffer (enable
+   gl_framebuffer_srgb to have writes converted) *)
+type gl_attributes = {
+  red_bits : int;
+  green_bits : int;
+  blue_bits : int;
+  alpha_bits : int;
+  depth_bits : int;
+  stencil_bits : int;
+  samples : int;
+  srgb : bool;
+  double_buffer : bool;
+}
+
+(** 8 bits per colour channel, 24 bit depth buffer, double buffered *)
+val default_attributes : gl_attributes
+
+(** Like [init_opengl], with a framebuffer chosen from the attributes
+   (via GLXFBConfig on X11, wglChoosePixelFormatARB on Windows).
+   Raises [Failure] if no framebuffer configuration matches *)
+val init_opengl_with : gl_attributes -> unit
+
+(** [set_swap_interval n] waits for [n] vertical retraces per swap_buffers,
+   0 turns vsync off. A negative [n] asks for adaptive vsync, which swaps late
+   frames at once; without support for it [-n] is used.
+   Returns false if the interval could not be set as requested *)
+external set_swap_interval : int -> bool = "stub_set_swap_interval"
+
+(** Timing of the buffer swaps, times in seconds of a monotonic clock.
+   [swap_start] and [swap_end] are taken around the last swap; [present] is
+   when the last frame known to be shown reached the screen and [msc] its
+   vertical retrace count (-1 if unknown). The frame times are the intervals
+   between presents over the last 256 frames *)
+type present_timing = {
+  frames : int;
+  swap_start : float;
+  swap_end : float;
+  present : float;
+  msc : int;
+  hardware_timing : bool; (** [present] and [msc] come from the driver *)
+  mean_frame_time : float;
+  min_frame_time : float;
+  max_frame_time : float;
+  median_frame_time : float;
+  p99_frame_time : float;
+}
+
+(** Present timing of the swaps since the start or the last [reset_present_timing].
+   On X11 the present times come from GLX_OML_sync_control (one frame late)
+   or GLX_INTEL_swap_event when available, otherwise the end of the swap is used *)
+val present_timing : unit -> present_timing
+
+(** Histogram of the last 256 frame times, in buckets of [histogram_bucket_width]
+   seconds. The last bucket also counts all longer frames *)
+external frame_histogram : unit -> int array = "stub_frame_histogram"
+
+(** Width of the [frame_histogram] buckets in seconds, 0.5 ms *)
+val histogram_bucket_width : float
+
+(** Clear the present timing and the histogram *)
+external reset_present_timing : unit -> unit = "stub_reset_present_timing"
+
+(** Swap the back buffer to the screen. Other threads keep running while it waits *)
 external swap_buffers : unit -> unit = "stub_swap_buffers" "stub_swap_buffers"
 
-(** Sleep for n microseconds *)
+(** [init_headless width height] creates an OpenGL context without a window,
+   rendering to an offscreen framebuffer of the given size, and makes it current.
+   Needs the library to be built with HEADLESS=egl;
+   raises [Failure] otherwise or when no context can be created.
+   After this [swap_buffers] only waits for rendering to finish. *)
+external init_headless : int -> int -> unit = "stub_init_headless"
+
+(** The headless backend the library was built with: ["egl"] or [""] *)
+val headless_backend : string
+
+(** Sleep for n microseconds, letting other threads run *)
 external usleep: int -> unit = "stub_usleep"
 
+(** Frame pacer. [wait_frame] waits for the next deadline, one period after
+   the previous one, sleeping until [spin] seconds before it and spinning the
+   rest on a monotonic nanosecond clock. A frame that is already past its
+   deadline is counted as late and the following deadlines keep their phase.
+   For fixed timestep updates call [fixed_steps] once per frame, run that many
+   steps and draw with [interpolation] between the last two states. *)
+type pacer
+
+(** Statistics of a pacer in seconds. The overshoot is how far past the
+   deadline [wait_frame] woke up, for frames that were not late *)
+type pacer_stats = {
+  paced_frames : int;
+  late_frames : int;
+  mean_overshoot : float;
+  max_overshoot : float;
+  last_overshoot : float;
+}
+
+(** [create_pacer period] makes a pacer for frames of [period] seconds,
+   starting now, spinning the last 2 ms *)
+val create_pacer : float -> pacer
+
+(** Sets how long before the deadline to stop sleeping and start spinning.
+   Raise it where sleeps are coarse (Windows without timeBeginPeriod) *)
+val set_pacer_spin : pacer -> float -> unit
+
+(** Starts pacing from now and clears the statistics and the accumulator *)
+external reset_pacer : pacer -> unit = "stub_pacer_reset"
+
+(** Waits for the next frame deadline. Other threads keep running meanwhile *)
+external wait_frame : pacer -> unit = "stub_pacer_wait"
+
+(** Seconds between the last two [wait_frame] *)
+val frame_time : pacer -> float
+
+(** [fixed_steps pacer step] adds the time since the last call to the
+   accumulator and returns how many steps of [step] seconds to run now
+   (at most 8, the excess is dropped) *)
+external fixed_steps : pacer -> float -> int = "stub_pacer_steps"
+
+(** What is left in the accumulator after [fixed_steps], as a fraction of a step *)
+val interpolation : pacer -> float
+
+(** Statistics of the pacer since it was created or reset *)
+val pacer_stats : pacer -> pacer_stats
+
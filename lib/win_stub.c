@@ -11,6 +11,12 @@
 #ifdef _WIN32
 #include <windows.h>
 #include <wingdi.h>
+#include <GL/gl.h>
+#endif
+
+#ifdef USE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #endif
 
 #include <caml/mlvalues.h>
@@ -18,8 +24,12 @@
 #include <caml/alloc.h>
 #include <caml/fail.h>
 #include <caml/callback.h>
+#include <caml/signals.h>
 #include <caml/bigarray.h>
 
+#include "present_stats.h"
+#include "frame_pacer.h"
+
 #ifdef __unix__
 Window gwin;
 Display *gdisplay = NULL;
@@ -31,6 +41,15 @@ HDC ghDC = NULL;
 HGLRC  ghGlrc = NULL;
 #endif
 
+#ifdef USE_EGL
+static EGLDisplay gegl_display = EGL_NO_DISPLAY;
+static EGLContext gegl_context = EGL_NO_CONTEXT;
+static EGLSurface gegl_surface = EGL_NO_SURFACE;
+#endif
+
+/* set by stub_init_headless, swap_buffers then only waits for the GPU */
+static int gheadless = 0;
+
 #ifdef __unix__
 static Window local_find_window (Display *display, Window root, char *name)
 {
@@ -138,20 +157,552 @@ value stub_init_gl(value name)
     CAMLreturn(result);
 }
 
+/*
+ * Context creation from a Win.gl_attributes record. On X11 the visual is
+ * picked with glXChooseFBConfig, preferring the config that uses the visual
+ * of the Graphics window. On Windows wglChoosePixelFormatARB is used when
+ * multisampling or sRGB is asked for, which needs a temporary context on a
+ * hidden window to be loaded; otherwise ChoosePixelFormat is enough.
+ */
+
+/* fields of Win.gl_attributes */
+enum {
+    ATTR_RED, ATTR_GREEN, ATTR_BLUE, ATTR_ALPHA, ATTR_DEPTH, ATTR_STENCIL,
+    ATTR_SAMPLES, ATTR_SRGB, ATTR_DOUBLE_BUFFER
+};
+
+#define Attr_int(a, i) Int_val(Field(a, i))
+
+#ifdef __unix__
+#ifndef GLX_FRAMEBUFFER_SRGB_CAPABLE_ARB
+#define GLX_FRAMEBUFFER_SRGB_CAPABLE_ARB 0x20B2
+#endif
+
+static GLXContext create_fbconfig_context(Display *display, int screen, Window win, value attrs)
+{
+    int list[32], k = 0, n = 0, i, best = -1;
+    XWindowAttributes wa;
+    VisualID visual;
+    GLXFBConfig *configs;
+    GLXContext ctx;
+
+    list[k++] = GLX_X_RENDERABLE;   list[k++] = True;
+    list[k++] = GLX_DRAWABLE_TYPE;  list[k++] = GLX_WINDOW_BIT;
+    list[k++] = GLX_RENDER_TYPE;    list[k++] = GLX_RGBA_BIT;
+    list[k++] = GLX_RED_SIZE;       list[k++] = Attr_int(attrs, ATTR_RED);
+    list[k++] = GLX_GREEN_SIZE;     list[k++] = Attr_int(attrs, ATTR_GREEN);
+    list[k++] = GLX_BLUE_SIZE;      list[k++] = Attr_int(attrs, ATTR_BLUE);
+    list[k++] = GLX_ALPHA_SIZE;     list[k++] = Attr_int(attrs, ATTR_ALPHA);
+    list[k++] = GLX_DEPTH_SIZE;     list[k++] = Attr_int(attrs, ATTR_DEPTH);
+    list[k++] = GLX_STENCIL_SIZE;   list[k++] = Attr_int(attrs, ATTR_STENCIL);
+    list[k++] = GLX_DOUBLEBUFFER;   list[k++] = Bool_val(Field(attrs, ATTR_DOUBLE_BUFFER));
+    if (Attr_int(attrs, ATTR_SAMPLES) > 0) {
+        list[k++] = GLX_SAMPLE_BUFFERS; list[k++] = 1;
+        list[k++] = GLX_SAMPLES;        list[k++] = Attr_int(attrs, ATTR_SAMPLES);
+    }
+    if (Bool_val(Field(attrs, ATTR_SRGB))) {
+        list[k++] = GLX_FRAMEBUFFER_SRGB_CAPABLE_ARB; list[k++] = True;
+    }
+    list[k] = None;
+
+    configs = glXChooseFBConfig(display, screen, list, &n);
+    if (configs == NULL) return NULL;
+    XGetWindowAttributes(display, win, &wa);
+    visual = XVisualIDFromVisual(wa.visual);
+    /* the configs come sorted best first; take the window's own visual if
+       it is among them, else the first one of the same depth */
+    for (i = 0; i < n; i++) {
+        XVisualInfo *vi = glXGetVisualFromFBConfig(display, configs[i]);
+        if (vi == NULL) continue;
+        if (vi->visualid == visual) {
+            best = i;
+            XFree(vi);
+            break;
+        }
+        if (best < 0 && vi->depth == wa.depth) best = i;
+        XFree(vi);
+    }
+    ctx = best < 0 ? NULL : glXCreateNewContext(display, configs[best], GLX_RGBA_TYPE, NULL, True);
+    XFree(configs);
+    if (ctx != NULL && !glXMakeContextCurrent(display, win, win, ctx)) {
+        glXDestroyContext(display, ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+#endif
+
+#ifdef _WIN32
+typedef BOOL (WINAPI *choose_pixel_format_t)(HDC, const int *, const FLOAT *, UINT, int *, UINT *);
+
+static int choose_pixel_format_arb(HDC hdc, value attrs)
+{
+    PIXELFORMATDESCRIPTOR pfd;
+    choose_pixel_format_t choose;
+    HWND dummy;
+    HDC dummy_dc;
+    HGLRC dummy_rc;
+    int list[32], k = 0, format = 0;
+    UINT n = 0;
+
+    dummy = CreateWindowA("STATIC", "", WS_POPUP, 0, 0, 1, 1, NULL, NULL, GetModuleHandle(NULL), NULL);
+    if (dummy == NULL) return 0;
+    dummy_dc = GetDC(dummy);
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.nSize = sizeof(pfd);
+    pfd.nVersion = 1;
+    pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL;
+    pfd.iPixelType = PFD_TYPE_RGBA;
+    pfd.cColorBits = 24;
+    SetPixelFormat(dummy_dc, ChoosePixelFormat(dummy_dc, &pfd), &pfd);
+    dummy_rc = wglCreateContext(dummy_dc);
+    if (dummy_rc != NULL && wglMakeCurrent(dummy_dc, dummy_rc)) {
+        choose = (choose_pixel_format_t)wglGetProcAddress("wglChoosePixelFormatARB");
+        if (choose != NULL) {
+            list[k++] = 0x2001; list[k++] = TRUE;   /* WGL_DRAW_TO_WINDOW_ARB */
+            list[k++] = 0x2010; list[k++] = TRUE;   /* WGL_SUPPORT_OPENGL_ARB */
+            list[k++] = 0x2003; list[k++] = 0x2027; /* WGL_ACCELERATION_ARB, FULL */
+            list[k++] = 0x2013; list[k++] = 0x202B; /* WGL_PIXEL_TYPE_ARB, RGBA */
+            list[k++] = 0x2011; list[k++] = Bool_val(Field(attrs, ATTR_DOUBLE_BUFFER));
+            list[k++] = 0x2015; list[k++] = Attr_int(attrs, ATTR_RED);
+            list[k++] = 0x2017; list[k++] = Attr_int(attrs, ATTR_GREEN);
+            list[k++] = 0x2019; list[k++] = Attr_int(attrs, ATTR_BLUE);
+            list[k++] = 0x201B; list[k++] = Attr_int(attrs, ATTR_ALPHA);
+            list[k++] = 0x2022; list[k++] = Attr_int(attrs, ATTR_DEPTH);
+            list[k++] = 0x2023; list[k++] = Attr_int(attrs, ATTR_STENCIL);
+            if (Attr_int(attrs, ATTR_SAMPLES) > 0) {
+                list[k++] = 0x2041; list[k++] = 1;  /* WGL_SAMPLE_BUFFERS_ARB */
+                list[k++] = 0x2042; list[k++] = Attr_int(attrs, ATTR_SAMPLES);
+            }
+            if (Bool_val(Field(attrs, ATTR_SRGB))) {
+                list[k++] = 0x20A9; list[k++] = TRUE; /* WGL_FRAMEBUFFER_SRGB_CAPABLE_ARB */
+            }
+            list[k] = 0;
+            if (!choose(hdc, list, NULL, 1, &format, &n) || n == 0) format = 0;
+        }
+        wglMakeCurrent(NULL, NULL);
+    }
+    if (dummy_rc != NULL) wglDeleteContext(dummy_rc);
+    ReleaseDC(dummy, dummy_dc);
+    DestroyWindow(dummy);
+    return format;
+}
+#endif
+
+value stub_init_gl_config(value name, value attrs)
+{
+    CAMLparam2(name, attrs);
+    char *wname = String_val(name);
+#ifdef __unix__
+    Display *display = XOpenDisplay(NULL);
+    Window win;
+    GLXContext ctx;
+
+    if (display == NULL) failwith("Win.init_opengl_with: cannot open display");
+    win = local_find_window(display, RootWindow(display, DefaultScreen(display)), wname);
+    if (!win) {
+        XCloseDisplay(display);
+        failwith("Win.init_opengl_with: window not found");
+    }
+    ctx = create_fbconfig_context(display, DefaultScreen(display), win, attrs);
+    if (ctx == NULL) {
+        XCloseDisplay(display);
+        failwith("Win.init_opengl_with: no matching GLXFBConfig");
+    }
+    gwin = win;
+    gdisplay = display;
+#endif
+#ifdef _WIN32
+    PIXELFORMATDESCRIPTOR pfd;
+    int format = 0;
+
+    ghWnd = FindWindow(NULL, wname);
+    if (ghWnd == NULL) failwith("Win.init_opengl_with: window not found");
+    ghDC = GetDC(ghWnd);
+    if (Attr_int(attrs, ATTR_SAMPLES) > 0 || Bool_val(Field(attrs, ATTR_SRGB)))
+        format = choose_pixel_format_arb(ghDC, attrs);
+    if (format == 0) {
+        memset(&pfd, 0, sizeof(pfd));
+        pfd.nSize = sizeof(pfd);
+        pfd.nVersion = 1;
+        pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL
+            | (Bool_val(Field(attrs, ATTR_DOUBLE_BUFFER)) ? PFD_DOUBLEBUFFER : 0);
+        pfd.iPixelType = PFD_TYPE_RGBA;
+        pfd.cColorBits = Attr_int(attrs, ATTR_RED) + Attr_int(attrs, ATTR_GREEN) + Attr_int(attrs, ATTR_BLUE);
+        pfd.cAlphaBits = Attr_int(attrs, ATTR_ALPHA);
+        pfd.cDepthBits = Attr_int(attrs, ATTR_DEPTH);
+        pfd.cStencilBits = Attr_int(attrs, ATTR_STENCIL);
+        pfd.iLayerType = PFD_MAIN_PLANE;
+        format = ChoosePixelFormat(ghDC, &pfd);
+    }
+    if (format == 0) failwith("Win.init_opengl_with: no matching pixel format");
+    DescribePixelFormat(ghDC, format, sizeof(pfd), &pfd);
+    SetPixelFormat(ghDC, format, &pfd);
+    ghGlrc = wglCreateContext(ghDC);
+    if (ghGlrc == NULL || !wglMakeCurrent(ghDC, ghGlrc))
+        failwith("Win.init_opengl_with: wglCreateContext failed");
+#endif
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Present timing. Every swap is timed with the CPU clock; on X11 the time
+ * the frame reached the screen comes from GLX_OML_sync_control or, failing
+ * that, GLX_INTEL_swap_event, chosen at the first swap. With OML the present
+ * time of the previous swap is read after each swap, which waits for that
+ * swap to complete if the driver queues more than one, so it is read with
+ * the runtime released, together with the swap. Both report the
+ * driver's UST in microseconds, which Mesa takes from CLOCK_MONOTONIC like
+ * hrtime_ns.
+ */
+
+static struct present_stats gstats = { 0, 0, 0, 0, -1, 0, { 0 }, 0, 0, { 0 } };
+
+#ifdef __unix__
+enum { TIMING_CPU, TIMING_OML, TIMING_INTEL };
+
+typedef Bool (*get_sync_values_t)(Display *, GLXDrawable, int64_t *, int64_t *, int64_t *);
+typedef Bool (*wait_for_sbc_t)(Display *, GLXDrawable, int64_t, int64_t *, int64_t *, int64_t *);
+
+static int gtiming = -1;
+static wait_for_sbc_t gwait_for_sbc = NULL;
+static int64_t gsbc = 0;
+static int gglx_event_base = 0;
+
+static int has_extension(const char *list, const char *name);
+
+static void choose_timing(void)
+{
+    const char *ext = glXQueryExtensionsString(gdisplay, DefaultScreen(gdisplay));
+    int error_base;
+    gtiming = TIMING_CPU;
+    if (has_extension(ext, "GLX_OML_sync_control")) {
+        get_sync_values_t get_sync_values =
+            (get_sync_values_t)glXGetProcAddressARB((const GLubyte *)"glXGetSyncValuesOML");
+        int64_t ust, msc;
+        gwait_for_sbc = (wait_for_sbc_t)glXGetProcAddressARB((const GLubyte *)"glXWaitForSbcOML");
+        /* counts the swaps before the one about to be made */
+        if (get_sync_values != NULL && gwait_for_sbc != NULL
+            && get_sync_values(gdisplay, gwin, &ust, &msc, &gsbc)) {
+            gtiming = TIMING_OML;
+            return;
+        }
+    }
+    if (has_extension(ext, "GLX_INTEL_swap_event")
+        && glXQueryExtension(gdisplay, &error_base, &gglx_event_base)) {
+        glXSelectEvent(gdisplay, gwin, GLX_BUFFER_SWAP_COMPLETE_INTEL_MASK);
+        gtiming = TIMING_INTEL;
+    }
+}
+
+/* with OML, waits for the previous swap and returns whether it has a
+   present time; called without the runtime */
+static int wait_previous_swap(int64_t *ust, int64_t *msc)
+{
+    int64_t sbc;
+    if (gtiming != TIMING_OML) return 0;
+    gsbc++;
+    return gsbc > 1 && gwait_for_sbc(gdisplay, gwin, gsbc - 1, ust, msc, &sbc);
+}
+
+static void record_present(int presented, int64_t ust, int64_t msc)
+{
+    if (gtiming == TIMING_OML) {
+        if (presented) present_stats_record(&gstats, ust * 1000, msc, 1);
+    } else if (gtiming == TIMING_INTEL) {
+        XEvent event;
+        while (XCheckTypedEvent(gdisplay, gglx_event_base + GLX_BufferSwapComplete, &event)) {
+            GLXBufferSwapComplete *swap = (GLXBufferSwapComplete *)&event;
+            present_stats_record(&gstats, swap->ust * 1000, swap->msc, 1);
+        }
+    } else {
+        present_stats_record(&gstats, gstats.swap_end, -1, 0);
+    }
+}
+#endif
+
 value stub_swap_buffers(value unit)
 {
     CAMLparam1(unit);
     CAMLlocal1(result);
+    gstats.swap_start = hrtime_ns();
+    if (gheadless) {
+        caml_enter_blocking_section();
+        glFinish();
+        caml_leave_blocking_section();
+        gstats.swap_end = hrtime_ns();
+        gstats.frames++;
+        present_stats_record(&gstats, gstats.swap_end, -1, 0);
+        CAMLreturn(Val_unit);
+    }
 #ifdef __unix__
-    glXSwapBuffers(gdisplay, gwin);
+    {
+        int64_t ust = 0, msc = 0;
+        int presented;
+        if (gtiming < 0) choose_timing();
+        caml_enter_blocking_section();
+        glXSwapBuffers(gdisplay, gwin);
+        gstats.swap_end = hrtime_ns();
+        presented = wait_previous_swap(&ust, &msc);
+        caml_leave_blocking_section();
+        gstats.frames++;
+        record_present(presented, ust, msc);
+    }
 #endif
 #ifdef _WIN32
+    caml_enter_blocking_section();
     wglSwapLayerBuffers(ghDC, WGL_SWAP_MAIN_PLANE);
+    caml_leave_blocking_section();
+    gstats.swap_end = hrtime_ns();
+    gstats.frames++;
+    present_stats_record(&gstats, gstats.swap_end, -1, 0);
 #endif
     result = Val_unit;
     CAMLreturn(result);
 }
 
+value stub_present_timing(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn(present_stats_value(&gstats));
+}
+
+value stub_frame_histogram(value unit)
+{
+    CAMLparam1(unit);
+    CAMLreturn(present_histogram_value(&gstats));
+}
+
+value stub_reset_present_timing(value unit)
+{
+    CAMLparam1(unit);
+    present_stats_reset(&gstats);
+    CAMLreturn(Val_unit);
+}
+
+/*
+ * Headless contexts, for running the examples and benchmarks without a
+ * display. With EGL a pbuffer of the requested size is used; if the driver
+ * has no pbuffer configs (Mesa's surfaceless platform on some versions) the
+ * context is made current without a surface and a framebuffer object of the
+ * requested size is bound instead. Glcaml loads its entry points from
+ * libGL, which dispatches to the current EGL context through libglvnd.
+ */
+
+#ifdef USE_EGL
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+typedef EGLDisplay (*get_platform_display_t)(EGLenum, void *, const EGLint *);
+typedef void (*gen_t)(GLsizei, GLuint *);
+typedef void (*bind_t)(GLenum, GLuint);
+typedef void (*storage_t)(GLenum, GLenum, GLsizei, GLsizei);
+typedef void (*attach_t)(GLenum, GLenum, GLenum, GLuint);
+typedef GLenum (*status_t)(GLenum);
+
+static int headless_fbo(int width, int height)
+{
+    gen_t gen_framebuffers = (gen_t)eglGetProcAddress("glGenFramebuffers");
+    bind_t bind_framebuffer = (bind_t)eglGetProcAddress("glBindFramebuffer");
+    gen_t gen_renderbuffers = (gen_t)eglGetProcAddress("glGenRenderbuffers");
+    bind_t bind_renderbuffer = (bind_t)eglGetProcAddress("glBindRenderbuffer");
+    storage_t storage = (storage_t)eglGetProcAddress("glRenderbufferStorage");
+    attach_t attach = (attach_t)eglGetProcAddress("glFramebufferRenderbuffer");
+    status_t status = (status_t)eglGetProcAddress("glCheckFramebufferStatus");
+    GLuint fbo, rb[2];
+
+    if (gen_framebuffers == NULL || bind_framebuffer == NULL || gen_renderbuffers == NULL
+        || bind_renderbuffer == NULL || storage == NULL || attach == NULL || status == NULL)
+        return 0;
+    gen_renderbuffers(2, rb);
+    bind_renderbuffer(0x8D41 /* GL_RENDERBUFFER */, rb[0]);
+    storage(0x8D41, GL_RGBA8, width, height);
+    bind_renderbuffer(0x8D41, rb[1]);
+    storage(0x8D41, 0x88F0 /* GL_DEPTH24_STENCIL8 */, width, height);
+    gen_framebuffers(1, &fbo);
+    bind_framebuffer(0x8D40 /* GL_FRAMEBUFFER */, fbo);
+    attach(0x8D40, 0x8CE0 /* GL_COLOR_ATTACHMENT0 */, 0x8D41, rb[0]);
+    attach(0x8D40, 0x821A /* GL_DEPTH_STENCIL_ATTACHMENT */, 0x8D41, rb[1]);
+    return status(0x8D40) == 0x8CD5 /* GL_FRAMEBUFFER_COMPLETE */;
+}
+
+/* undoes a partly made headless context */
+static void headless_egl_release(void)
+{
+    if (gegl_display == EGL_NO_DISPLAY) return;
+    eglMakeCurrent(gegl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (gegl_context != EGL_NO_CONTEXT) eglDestroyContext(gegl_display, gegl_context);
+    if (gegl_surface != EGL_NO_SURFACE) eglDestroySurface(gegl_display, gegl_surface);
+    eglTerminate(gegl_display);
+    gegl_display = EGL_NO_DISPLAY;
+    gegl_context = EGL_NO_CONTEXT;
+    gegl_surface = EGL_NO_SURFACE;
+}
+
+static const char *headless_egl(int width, int height)
+{
+    static const EGLint pbuffer_config[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+        EGL_DEPTH_SIZE, 24, EGL_STENCIL_SIZE, 8,
+        EGL_NONE
+    };
+    static const EGLint any_config[] = {
+        EGL_SURFACE_TYPE, 0,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_DEPTH_SIZE, 24,
+        EGL_NONE
+    };
+    EGLint pbuffer_attribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+    get_platform_display_t get_platform_display;
+    const char *extensions;
+    EGLConfig config;
+    EGLint n = 0;
+
+    /* prefer the surfaceless platform, it needs neither X nor a DRM device */
+    extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    get_platform_display = (get_platform_display_t)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (extensions != NULL && strstr(extensions, "EGL_MESA_platform_surfaceless") != NULL
+        && get_platform_display != NULL)
+        gegl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (gegl_display == EGL_NO_DISPLAY)
+        gegl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (gegl_display == EGL_NO_DISPLAY || !eglInitialize(gegl_display, NULL, NULL))
+        return "no EGL display";
+    if (!eglBindAPI(EGL_OPENGL_API))
+        return "EGL has no desktop OpenGL";
+    if (eglChooseConfig(gegl_display, pbuffer_config, &config, 1, &n) && n > 0) {
+        gegl_surface = eglCreatePbufferSurface(gegl_display, config, pbuffer_attribs);
+        if (gegl_surface == EGL_NO_SURFACE) return "eglCreatePbufferSurface failed";
+    } else if (!eglChooseConfig(gegl_display, any_config, &config, 1, &n) || n == 0) {
+        return "no EGL config for OpenGL";
+    }
+    gegl_context = eglCreateContext(gegl_display, config, EGL_NO_CONTEXT, NULL);
+    if (gegl_context == EGL_NO_CONTEXT) return "eglCreateContext failed";
+    if (!eglMakeCurrent(gegl_display, gegl_surface, gegl_surface, gegl_context))
+        return "eglMakeCurrent failed";
+    if (gegl_surface == EGL_NO_SURFACE && !headless_fbo(width, height))
+        return "no framebuffer object for the surfaceless context";
+    return NULL;
+}
+
+#endif
+
+value stub_init_headless(value vwidth, value vheight)
+{
+    CAMLparam2(vwidth, vheight);
+    int width = Int_val(vwidth), height = Int_val(vheight);
+    const char *error = "built without a headless backend";
+
+    if (width <= 0 || height <= 0) invalid_argument("Win.init_headless");
+    if (gheadless) failwith("Win.init_headless: already initialized");
+#ifdef USE_EGL
+    error = headless_egl(width, height);
+    if (error != NULL) headless_egl_release();
+#endif
+    if (error != NULL) {
+        char message[128];
+        strcpy(message, "Win.init_headless: ");
+        strncat(message, error, sizeof(message) - strlen(message) - 1);
+        failwith(message);
+    }
+    glViewport(0, 0, width, height);
+    gheadless = 1;
+    CAMLreturn(Val_unit);
+}
+
+value stub_headless_backend(value unit)
+{
+    CAMLparam1(unit);
+#ifdef USE_EGL
+    CAMLreturn(copy_string("egl"));
+#else
+    CAMLreturn(copy_string(""));
+#endif
+}
+
+/*
+ * Swap interval. A negative interval asks for adaptive vsync (late frames
+ * are swapped at once instead of waiting for the next retrace), available
+ * with the swap_control_tear extensions; without them the absolute value is
+ * used. Returns false when the requested interval could not be set exactly.
+ */
+
+#ifdef __unix__
+typedef void (*swap_interval_ext_t)(Display *, GLXDrawable, int);
+typedef int (*swap_interval_t)(int);
+
+static int has_extension(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = list;
+    while (p != NULL && (p = strstr(p, name)) != NULL) {
+        if ((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) return 1;
+        p += len;
+    }
+    return 0;
+}
+#endif
+
+#ifdef _WIN32
+typedef BOOL (WINAPI *swap_interval_ext_t)(int);
+#endif
+
+value stub_set_swap_interval(value vinterval)
+{
+    CAMLparam1(vinterval);
+    int wanted = Int_val(vinterval), interval = wanted, ok = 0;
+
+    if (gheadless) {
+#ifdef USE_EGL
+        if (wanted >= 0) ok = eglSwapInterval(gegl_display, wanted);
+#endif
+        CAMLreturn(Val_bool(ok));
+    }
+#ifdef __unix__
+    {
+        const char *ext;
+        if (gdisplay == NULL) failwith("Win.set_swap_interval: no context");
+        ext = glXQueryExtensionsString(gdisplay, DefaultScreen(gdisplay));
+        if (interval < 0 && !has_extension(ext, "GLX_EXT_swap_control_tear")) interval = -interval;
+        if (has_extension(ext, "GLX_EXT_swap_control")) {
+            swap_interval_ext_t f = (swap_interval_ext_t)glXGetProcAddressARB((const GLubyte *)"glXSwapIntervalEXT");
+            if (f != NULL) {
+                f(gdisplay, gwin, interval);
+                ok = 1;
+            }
+        }
+        if (!ok && interval >= 0 && has_extension(ext, "GLX_MESA_swap_control")) {
+            swap_interval_t f = (swap_interval_t)glXGetProcAddressARB((const GLubyte *)"glXSwapIntervalMESA");
+            ok = f != NULL && f(interval) == 0;
+        }
+        /* SGI cannot turn vsync off */
+        if (!ok && interval > 0 && has_extension(ext, "GLX_SGI_swap_control")) {
+            swap_interval_t f = (swap_interval_t)glXGetProcAddressARB((const GLubyte *)"glXSwapIntervalSGI");
+            ok = f != NULL && f(interval) == 0;
+        }
+    }
+#endif
+#ifdef _WIN32
+    {
+        swap_interval_ext_t f = (swap_interval_ext_t)wglGetProcAddress("wglSwapIntervalEXT");
+        if (ghGlrc == NULL) failwith("Win.set_swap_interval: no context");
+        if (f != NULL) {
+            ok = f(interval);
+            /* without WGL_EXT_swap_control_tear negative values fail */
+            if (!ok && interval < 0) {
+                interval = -interval;
+                ok = f(interval);
+            }
+        }
+    }
+#endif
+    CAMLreturn(Val_bool(ok && interval == wanted));
+}
+
 #ifdef _WIN32
 #  include <windows.h>
 #  define usleep(t) Sleep((t) / 1000)
@@ -162,6 +713,24 @@ value stub_swap_buffers(value unit)
 value stub_usleep(value t)
 {
     CAMLparam1(t);
-    usleep(Int_val(t));
+    int us = Int_val(t);
+    caml_enter_blocking_section();
+    usleep(us);
+    caml_leave_blocking_section();
     CAMLreturn(Val_unit);
 }
+
+value stub_pacer_reset(value p)
+{
+    return pacer_reset(p);
+}
+
+value stub_pacer_wait(value p)
+{
+    return pacer_wait(p);
+}
+
+value stub_pacer_steps(value p, value step)
+{
+    return pacer_steps(p, step);
+}